@@ -2,6 +2,6 @@
 # Automatically-generated file. Do not edit!
 ################################################################################
 
-LIBS :=
+LIBS := -lpthread -lm
 
 USER_OBJS :=
\ No newline at end of file
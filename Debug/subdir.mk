@@ -4,18 +4,39 @@
 
 # Add inputs and outputs from these tool invocations to the build variables 
 C_SRCS += \
+../apmap.c \
+../arena.c \
+../batch.c \
+../counters.c \
+../image.c \
+../ingest.c \
 ../model-2.c \
 ../predict.c \
+../sink.c \
 ../string16.c 
 
 OBJS += \
+./apmap.o \
+./arena.o \
+./batch.o \
+./counters.o \
+./image.o \
+./ingest.o \
 ./model-2.o \
 ./predict.o \
+./sink.o \
 ./string16.o 
 
 C_DEPS += \
+./apmap.d \
+./arena.d \
+./batch.d \
+./counters.d \
+./image.d \
+./ingest.d \
 ./model-2.d \
 ./predict.d \
+./sink.d \
 ./string16.d 
 
 
@@ -0,0 +1,453 @@
+/*******************************************************
+ * apmap.c
+ *
+ * AP maps: which APs are neighbors of which (see apmap.h).
+ *
+ * All three ways of getting a map (mapping.h, a text file and
+ * a binary file) fill in the symbols and the rows of neighbors,
+ * and finish_ap_map() does the rest: it builds the symbol to AP
+ * number index, turns neighbor symbols into AP numbers, sorts the
+ * rows, and builds the bitset.
+ *
+ * *****************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "model.h"
+#include "predict.h"		// for TRUE and FALSE
+#include "apmap.h"
+#include "mapping.h"		// for the built in ap mapping and ap neighbors
+
+/*
+ * The map neighboring_ap() uses.  It's set once by set_ap_map() before
+ * any tests are run, and only read after that, so threads can share it.
+ */
+static AP_MAP *current_map = NULL;
+
+/* Local procedures */
+AP_MAP * new_ap_map( int num_aps, int num_neighbors );
+int finish_ap_map( AP_MAP *map, int rows_hold_symbols );
+int compare_ints( const void *a, const void *b );
+int map_ap_number( AP_MAP *map, int symbol );
+AP_MAP * read_text_ap_map( FILE *file );
+AP_MAP * read_binary_ap_map( FILE *file );
+
+/* new_ap_map
+ * Allocate a map with room for num_aps APs and num_neighbors neighbors.
+ * NULL means out of memory.
+ */
+AP_MAP * new_ap_map( int num_aps, int num_neighbors ){
+	AP_MAP *map;
+
+	map = (AP_MAP *) calloc( 1, sizeof( AP_MAP));
+	if (map == NULL)
+		return( NULL);
+	map->num_aps = num_aps;
+	map->num_neighbors = num_neighbors;
+	map->symbols = (int *) malloc( (num_aps + 1) * sizeof( int));
+	map->offsets = (int *) malloc( (num_aps + 1) * sizeof( int));
+	map->neighbors = (int *) malloc( (num_neighbors + 1) * sizeof( int));
+	if (map->symbols == NULL || map->offsets == NULL || map->neighbors == NULL) {
+		free_ap_map( map);
+		return( NULL);
+	}
+	return( map);
+}
+
+/* Destructor */
+void free_ap_map( AP_MAP *map ){
+	if (map == NULL)
+		return;
+	free( map->symbols);
+	free( map->offsets);
+	free( map->neighbors);
+	free( map->ap_numbers);
+	free( map->bits);
+	free( map);
+}
+
+/* builtin_ap_map
+ * The map compiled in from mapping.h.  ap_map[ a ] is the symbol of
+ * AP a (AP 0 isn't used, and has symbol 0), and ap_neighbors[ a ]
+ * lists the symbols of its neighbors, ending with a 0.
+ * RETURNS: the map, or NULL if it couldn't be built
+ */
+AP_MAP * builtin_ap_map( void ){
+	int num_aps = sizeof( ap_map) / sizeof( ap_map[ 0 ]);
+	int row_length = sizeof( ap_neighbors[ 0 ]) / sizeof( ap_neighbors[ 0 ][ 0 ]);
+	AP_MAP *map;
+	int a;
+	int i;
+	int n = 0;
+
+	for (a = 0; a < num_aps; a++)
+		for (i = 0; i < row_length && ap_neighbors[ a ][ i ] != 0; i++)
+			n++;
+	map = new_ap_map( num_aps, n);
+	if (map == NULL)
+		return( NULL);
+	n = 0;
+	for (a = 0; a < num_aps; a++) {
+		map->symbols[ a ] = (int) ap_map[ a ];
+		map->offsets[ a ] = n;
+		for (i = 0; i < row_length && ap_neighbors[ a ][ i ] != 0; i++)
+			map->neighbors[ n++ ] = (int) ap_neighbors[ a ][ i ];
+	}
+	map->offsets[ num_aps ] = n;
+	if (finish_ap_map( map, TRUE) != 0) {
+		free_ap_map( map);
+		return( NULL);
+	}
+	return( map);
+}
+
+/* load_ap_map
+ * Read a map file, in either the text or the binary form.
+ * RETURNS: the map, or NULL (after printing the reason) if there
+ * is something wrong with the file
+ */
+AP_MAP * load_ap_map( FILE *file ){
+	char magic[ 8 ];
+
+	if (fread( magic, 1, sizeof( magic), file) == sizeof( magic) &&
+			memcmp( magic, AP_MAP_MAGIC, sizeof( magic)) == 0) {
+		rewind( file);
+		return( read_binary_ap_map( file));
+	}
+	rewind( file);
+	return( read_text_ap_map( file));
+}
+
+/* read_text_ap_map
+ * Read the text form of a map: one line per AP, its symbol and then
+ * the symbols of its neighbors.
+ */
+AP_MAP * read_text_ap_map( FILE *file ){
+	AP_MAP *map = NULL;
+	char *line = NULL;
+	size_t line_size = 0;
+	char *p;
+	char *end;
+	long value;
+	int *symbols = NULL;		// what's been read so far
+	int *row_ends = NULL;
+	int *neighbors = NULL;
+	int num_aps = 0;
+	int ap_capacity = 0;
+	int num_neighbors = 0;
+	int neighbor_capacity = 0;
+	int line_number = 0;
+	int first;
+	void *grown;
+
+	while (getline( &line, &line_size, file) != -1) {
+		line_number++;
+		for (p = line; *p == ' ' || *p == '\t'; p++)
+			;
+		if (*p == '#' || *p == '\n' || *p == '\r' || *p == '\0')
+			continue;
+		for (first = TRUE; ; first = FALSE) {
+			value = strtol( p, &end, 0);
+			if (end == p)
+				break;
+			if (value < -32768 || value > 32767) {
+				fprintf( stderr, "Error in AP map line %d: %ld isn't a symbol\n", line_number, value);
+				goto fail;
+			}
+			p = end;
+			if (first) {
+				if (num_aps == ap_capacity) {
+					ap_capacity = ap_capacity ? 2 * ap_capacity : 1024;
+					grown = realloc( symbols, ap_capacity * sizeof( int));
+					if (grown == NULL)
+						goto out_of_memory;
+					symbols = (int *) grown;
+					grown = realloc( row_ends, ap_capacity * sizeof( int));
+					if (grown == NULL)
+						goto out_of_memory;
+					row_ends = (int *) grown;
+				}
+				symbols[ num_aps++ ] = (int) value;
+			}
+			else {
+				if (num_neighbors == neighbor_capacity) {
+					neighbor_capacity = neighbor_capacity ? 2 * neighbor_capacity : 8192;
+					grown = realloc( neighbors, neighbor_capacity * sizeof( int));
+					if (grown == NULL)
+						goto out_of_memory;
+					neighbors = (int *) grown;
+				}
+				neighbors[ num_neighbors++ ] = (int) value;
+			}
+		}
+		while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+			p++;
+		if (*p != '\0') {
+			fprintf( stderr, "Error in AP map line %d: expecting \"symbol neighbor neighbor ...\"\n", line_number);
+			goto fail;
+		}
+		row_ends[ num_aps - 1 ] = num_neighbors;
+	}
+
+	map = new_ap_map( num_aps, num_neighbors);
+	if (map == NULL)
+		goto out_of_memory;
+	if (num_aps > 0)
+		memcpy( map->symbols, symbols, num_aps * sizeof( int));
+	if (num_neighbors > 0)
+		memcpy( map->neighbors, neighbors, num_neighbors * sizeof( int));
+	map->offsets[ 0 ] = 0;
+	if (num_aps > 0)
+		memcpy( map->offsets + 1, row_ends, num_aps * sizeof( int));
+	if (finish_ap_map( map, TRUE) != 0) {
+		free_ap_map( map);
+		map = NULL;
+	}
+	goto done;
+
+out_of_memory:
+	fprintf( stderr, "Out of memory reading the AP map\n");
+fail:
+	map = NULL;
+done:
+	free( line);
+	free( symbols);
+	free( row_ends);
+	free( neighbors);
+	return( map);
+}
+
+/* read_binary_ap_map
+ * Read the binary form of a map, written by save_ap_map().
+ */
+AP_MAP * read_binary_ap_map( FILE *file ){
+	AP_MAP_HEADER header;
+	AP_MAP *map;
+	int a;
+	int i;
+
+	if (fread( &header, sizeof( header), 1, file) != 1)
+		return( NULL);
+	if (header.byte_order != AP_MAP_BYTE_ORDER || header.version != AP_MAP_VERSION) {
+		fprintf( stderr, "AP map is version %d, expecting version %d (native byte order)\n",
+				header.byte_order == AP_MAP_BYTE_ORDER ? header.version : -1,
+				AP_MAP_VERSION);
+		return( NULL);
+	}
+	if (header.num_aps < 0 || header.num_neighbors < 0)
+		return( NULL);
+	map = new_ap_map( header.num_aps, header.num_neighbors);
+	if (map == NULL) {
+		fprintf( stderr, "Out of memory reading the AP map\n");
+		return( NULL);
+	}
+	if (fread( map->symbols, sizeof( int), header.num_aps, file) != (size_t) header.num_aps ||
+			fread( map->offsets, sizeof( int), header.num_aps + 1, file) != (size_t) header.num_aps + 1 ||
+			fread( map->neighbors, sizeof( int), header.num_neighbors, file) != (size_t) header.num_neighbors)
+		goto bad;
+	// The rows have to fit, and hold sorted AP numbers
+	if (map->offsets[ 0 ] != 0 || map->offsets[ header.num_aps ] != header.num_neighbors)
+		goto bad;
+	for (a = 0; a < header.num_aps; a++) {
+		if (map->offsets[ a+1 ] < map->offsets[ a ])
+			goto bad;
+		for (i = map->offsets[ a ]; i < map->offsets[ a+1 ]; i++)
+			if (map->neighbors[ i ] < 0 || map->neighbors[ i ] >= header.num_aps ||
+					(i > map->offsets[ a ] && map->neighbors[ i ] <= map->neighbors[ i-1 ]))
+				goto bad;
+	}
+	if (finish_ap_map( map, FALSE) != 0)
+		goto bad;
+	return( map);
+
+bad:
+	free_ap_map( map);
+	return( NULL);
+}
+
+/* save_ap_map
+ * Write the binary form of a map.
+ * RETURNS: 0, or -1 if the file couldn't be written
+ */
+int save_ap_map( AP_MAP *map, FILE *file ){
+	AP_MAP_HEADER header;
+
+	memset( &header, 0, sizeof( header));
+	memcpy( header.magic, AP_MAP_MAGIC, sizeof( header.magic));
+	header.version = AP_MAP_VERSION;
+	header.byte_order = AP_MAP_BYTE_ORDER;
+	header.num_aps = map->num_aps;
+	header.num_neighbors = map->num_neighbors;
+	if (fwrite( &header, sizeof( header), 1, file) != 1 ||
+			fwrite( map->symbols, sizeof( int), map->num_aps, file) != (size_t) map->num_aps ||
+			fwrite( map->offsets, sizeof( int), map->num_aps + 1, file) != (size_t) map->num_aps + 1 ||
+			fwrite( map->neighbors, sizeof( int), map->num_neighbors, file) != (size_t) map->num_neighbors ||
+			fflush( file) != 0)
+		return( -1);
+	return( 0);
+}
+
+/* finish_ap_map
+ * Build the index from symbols to AP numbers and the bitset.  If
+ * rows_hold_symbols is set, the rows hold the neighbors' symbols,
+ * and they are turned into AP numbers and sorted first (dropping
+ * any neighbor that is listed twice).
+ * RETURNS: 0, or -1 (after printing the reason) if the map is bad
+ */
+int finish_ap_map( AP_MAP *map, int rows_hold_symbols ){
+	int a;
+	int b;
+	int i;
+	int j;
+	int n;
+	int start;
+	int end;
+	int last_symbol = -1;
+
+	// The index covers every symbol from the lowest AP symbol to the highest.
+	// The symbols in a binary map haven't been checked yet, so they are here,
+	// before their range is used to size anything.
+	map->first_symbol = 0;
+	for (a = 0; a < map->num_aps; a++) {
+		if (map->symbols[ a ] < -32768 || map->symbols[ a ] > 32767) {
+			fprintf( stderr, "AP map: %d isn't a symbol\n", map->symbols[ a ]);
+			return( -1);
+		}
+		if (a == 0 || map->symbols[ a ] < map->first_symbol)
+			map->first_symbol = map->symbols[ a ];
+		if (a == 0 || map->symbols[ a ] > last_symbol)
+			last_symbol = map->symbols[ a ];
+	}
+	if (map->num_aps > 0 && last_symbol < map->first_symbol) {
+		fprintf( stderr, "AP map: its symbols run from 0x%x down to 0x%x\n", map->first_symbol, last_symbol);
+		return( -1);
+	}
+	map->num_symbols = last_symbol - map->first_symbol + 1;
+	map->ap_numbers = (int *) malloc( (map->num_symbols + 1) * sizeof( int));
+	if (map->ap_numbers == NULL)
+		goto out_of_memory;
+	memset( map->ap_numbers, -1, map->num_symbols * sizeof( int));
+	for (a = 0; a < map->num_aps; a++) {
+		if (map->ap_numbers[ map->symbols[ a ] - map->first_symbol ] >= 0) {
+			fprintf( stderr, "AP map: symbol 0x%x is given to two APs\n", map->symbols[ a ]);
+			return( -1);
+		}
+		map->ap_numbers[ map->symbols[ a ] - map->first_symbol ] = a;
+	}
+
+	if (rows_hold_symbols) {
+		// Rows only get shorter, so this can be done in place
+		for (a = 0, i = 0, n = 0; a < map->num_aps; a++) {
+			end = map->offsets[ a+1 ];
+			map->offsets[ a ] = start = n;
+			for ( ; i < end; i++) {
+				b = map_ap_number( map, map->neighbors[ i ]);
+				if (b < 0) {
+					fprintf( stderr, "AP map: AP 0x%x has neighbor 0x%x, which isn't an AP\n",
+							map->symbols[ a ], map->neighbors[ i ]);
+					return( -1);
+				}
+				map->neighbors[ n++ ] = b;
+			}
+			qsort( map->neighbors + start, n - start, sizeof( int), compare_ints);
+			for (j = i = start; i < n; i++)
+				if (j == start || map->neighbors[ i ] != map->neighbors[ j-1 ])
+					map->neighbors[ j++ ] = map->neighbors[ i ];
+			i = end;
+			n = j;
+		}
+		map->offsets[ map->num_aps ] = n;
+		map->num_neighbors = n;
+	}
+
+	if (map->num_aps <= AP_BITSET_MAX) {
+		map->row_words = (map->num_aps + AP_WORD_BITS - 1) / AP_WORD_BITS;
+		map->bits = (unsigned int *) calloc( (size_t) map->num_aps * map->row_words + 1, sizeof( unsigned int));
+		if (map->bits == NULL)
+			goto out_of_memory;
+		for (a = 0; a < map->num_aps; a++)
+			for (i = map->offsets[ a ]; i < map->offsets[ a+1 ]; i++) {
+				b = map->neighbors[ i ];
+				map->bits[ a * map->row_words + b / AP_WORD_BITS ] |= 1u << (b % AP_WORD_BITS);
+			}
+	}
+	return( 0);
+
+out_of_memory:
+	fprintf( stderr, "Out of memory building the AP map\n");
+	return( -1);
+}
+
+int compare_ints( const void *a, const void *b ){
+	return( (*(const int *) a > *(const int *) b) - (*(const int *) a < *(const int *) b));
+}
+
+/* map_ap_number
+ * RETURNS: the number of the AP with the given symbol in a map,
+ * or -1 if the symbol isn't an AP
+ */
+int map_ap_number( AP_MAP *map, int symbol ){
+	if (symbol < map->first_symbol || symbol - map->first_symbol >= map->num_symbols)
+		return( -1);
+	return( map->ap_numbers[ symbol - map->first_symbol ]);
+}
+
+/* set_ap_map
+ * Make map the one neighboring_ap() uses.  This has to be done
+ * before any tests are run.
+ */
+void set_ap_map( AP_MAP *map ){
+	current_map = map;
+}
+
+/* ap_number
+ * Translate from the ap symbol value to the actual ap number.
+ * RETURNS: the AP number, or -1 if symbol isn't an AP
+ */
+int ap_number( SYMBOL_TYPE symbol ){
+	return( map_ap_number( current_map, symbol));
+}
+
+/***********************************************************
+ *	neighboring_ap
+ *
+ * Given two symbols for locations (AP) return true if
+ * the first one is a neighbor of the second.  If the second
+ * one isn't an AP at all the answer is just false; it's up
+ * to the caller to report that (this can be called from
+ * several threads at once, and doesn't print anything).
+ *
+ ***********************************************************/
+unsigned char neighboring_ap( SYMBOL_TYPE predicted_ap, SYMBOL_TYPE actual_ap ){
+	int actual_ap_number;
+	int predicted_ap_number;
+	int low;
+	int high;
+	int mid;
+
+	actual_ap_number = ap_number( actual_ap);
+	if (actual_ap_number < 0)
+		return( FALSE );
+	predicted_ap_number = ap_number( predicted_ap);
+	if (predicted_ap_number < 0)
+		return( FALSE );		// only APs are neighbors
+	if (current_map->bits != NULL) {
+		if (current_map->bits[ actual_ap_number * current_map->row_words + predicted_ap_number / AP_WORD_BITS ] &
+				(1u << (predicted_ap_number % AP_WORD_BITS)))
+			return( TRUE );
+		return( FALSE );
+	}
+	// Too many APs for a bitset, so look in the (sorted) row
+	low = current_map->offsets[ actual_ap_number ];
+	high = current_map->offsets[ actual_ap_number + 1 ] - 1;
+	while (low <= high) {
+		mid = (low + high) / 2;
+		if (current_map->neighbors[ mid ] == predicted_ap_number)
+			return( TRUE );
+		if (current_map->neighbors[ mid ] < predicted_ap_number)
+			low = mid + 1;
+		else
+			high = mid - 1;
+	}
+	return( FALSE );
+}	// end of neighboring_ap
@@ -0,0 +1,80 @@
+/**************************************************
+ * apmap.h
+ *
+ * Which access points (APs) are neighbors of which, for scoring
+ * location predictions (see score_prediction() in predict.c).
+ *
+ * An AP map gives each AP a number (0 to num_aps-1) and its
+ * location symbol, and lists the neighbors of each AP in
+ * compressed sparse rows: the AP numbers of AP a's neighbors are
+ * neighbors[ offsets[ a ] .. offsets[ a+1 ]-1 ], sorted, so the
+ * map only takes room for the neighbors there really are.  A small
+ * map also gets a bitset with one row of bits per AP, so testing
+ * for a neighbor is a single lookup; a big one binary searches
+ * the row instead.
+ *
+ * The map compiled in from mapping.h is used unless one is loaded
+ * with -apmap.  A map file is either text, one line per AP giving
+ * its symbol and then its neighbors' symbols (in hex, like 0x2321,
+ * or decimal):
+ *
+ *     # symbol  neighbors...
+ *     0x2321    0x2322 0x2340
+ *     0x2322    0x2321
+ *
+ * (blank lines and lines starting with '#' are skipped), or the
+ * binary form written by save_ap_map(), which is laid out as:
+ *
+ *     AP_MAP_HEADER
+ *     int symbols[ num_aps ]
+ *     int offsets[ num_aps + 1 ]
+ *     int neighbors[ num_neighbors ]
+ *
+ * in the machine's own byte order.  Reading the binary form is
+ * just one read per array.
+ *
+ * ************************************************/
+
+#ifndef APMAP_H_
+#define APMAP_H_
+
+#include <stdio.h>		// for FILE
+#include "model.h"		// for SYMBOL_TYPE
+
+#define AP_MAP_MAGIC		"PMELTAPM"
+#define AP_MAP_VERSION		1
+#define AP_MAP_BYTE_ORDER	0x01020304
+#define AP_BITSET_MAX		1024	// most APs a map can have and still get a bitset
+#define AP_WORD_BITS		32
+
+typedef struct {
+	char magic[ 8 ];
+	int version;
+	int byte_order;
+	int num_aps;
+	int num_neighbors;		// length of the neighbors array
+} AP_MAP_HEADER;
+
+typedef struct {
+	int num_aps;
+	int num_neighbors;
+	int *symbols;			// location symbol of each AP
+	int *offsets;			// where each AP's row of neighbors starts
+	int *neighbors;			// AP numbers of the neighbors, sorted in each row
+	int first_symbol;		// ap_numbers[ s - first_symbol ] is the AP number
+	int num_symbols;		// of symbol s, or -1 if s isn't an AP
+	int *ap_numbers;
+	int row_words;			// size of each row of the bitset
+	unsigned int *bits;		// the bitset, NULL if there are more than AP_BITSET_MAX APs
+} AP_MAP;
+
+/* Function Prototypes */
+AP_MAP * builtin_ap_map( void );
+AP_MAP * load_ap_map( FILE *file );
+int save_ap_map( AP_MAP *map, FILE *file );
+void free_ap_map( AP_MAP *map );
+void set_ap_map( AP_MAP *map );
+int ap_number( SYMBOL_TYPE symbol );
+unsigned char neighboring_ap( SYMBOL_TYPE predicted_ap, SYMBOL_TYPE actual_ap );
+
+#endif /*APMAP_H_*/
@@ -0,0 +1,214 @@
+/*******************************************************
+ * arena.c
+ *
+ * Memory arena used by the model (see arena.h).
+ *
+ * All memory comes out of chunks that are allocated from the
+ * system with calloc().  arena_alloc() just bumps a pointer in
+ * the newest chunk, and is used for things that live as long as
+ * the model.  arena_block_alloc() rounds the request up to a
+ * power of two and hands out a block from that size class,
+ * reusing freed blocks first.  CONTEXT nodes come from the
+ * pools too, so a decaying model can reuse them.  Arrays that grow
+ * (stats, links) double their size each time, so a table with
+ * n symbols costs O(n) copying instead of O(n^2).
+ *
+ * arena_destroy() gives every chunk back to the system, so
+ * tearing down a model doesn't have to walk the tree.
+ *
+ * *****************************************************/
+#include <stdlib.h>			// for calloc(), free()
+#include <string.h>			// for memset(), memcpy()
+#include <stdio.h>
+#include "arena.h"
+
+#define ARENA_ALIGN			16
+#define ALIGN_UP( n )		( ( (n) + ARENA_ALIGN - 1 ) & ~(size_t) ( ARENA_ALIGN - 1 ) )
+#define CHUNK_HEADER		ALIGN_UP( sizeof( ARENA_CHUNK ) )
+#define CHUNK_DATA( c )		( (char *) (c) + CHUNK_HEADER )
+
+/* Local procedures */
+void * arena_carve( ARENA *arena, size_t size );
+int arena_size_class( size_t size );
+
+/* Constructor arena_create
+ * Create an empty arena.  Chunks are allocated as they are needed.
+ * NULL means error.
+ */
+ARENA * arena_create( size_t chunk_size ){
+	ARENA * arena;
+
+	arena = (ARENA *) calloc( sizeof( ARENA ), 1 );
+	if (arena == NULL)
+		return NULL;
+	arena->chunk_size = chunk_size ? chunk_size : ARENA_CHUNK_SIZE;
+	return( arena );
+}
+
+/* Destructor - give all chunks back to the system */
+void arena_destroy( ARENA *arena ){
+	ARENA_CHUNK *chunk, *next;
+
+	if (arena == NULL)
+		return;
+	for (chunk = arena->chunks; chunk != NULL; chunk = next) {
+		next = chunk->next;
+		free( chunk);
+	}
+	free( arena);
+}
+
+/* arena_carve - take size bytes from the newest chunk, starting a
+ * new chunk if it's full.  Requests that are large compared to a chunk
+ * get a chunk of their own, which is linked in behind the newest one
+ * so that the space left in it can still be used.
+ */
+void * arena_carve( ARENA *arena, size_t size ){
+	ARENA_CHUNK *chunk;
+	size_t chunk_size;
+	void *ptr;
+
+	size = ALIGN_UP( size);
+	chunk = arena->chunks;
+	if (chunk != NULL && chunk->used + size <= chunk->size) {
+		ptr = CHUNK_DATA( chunk) + chunk->used;
+		chunk->used += size;
+		return( ptr);
+	}
+	chunk_size = arena->chunk_size;
+	if (size > chunk_size / 4)
+		chunk_size = size;
+	chunk = (ARENA_CHUNK *) calloc( CHUNK_HEADER + chunk_size, 1);
+	if (chunk == NULL)
+		return NULL;
+	arena->system_allocs++;
+	arena->bytes_reserved += CHUNK_HEADER + chunk_size;
+	chunk->size = chunk_size;
+	chunk->used = size;
+	if (chunk_size == size && arena->chunks != NULL) {
+		chunk->next = arena->chunks->next;		// dedicated chunk
+		arena->chunks->next = chunk;
+	}
+	else {
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+	}
+	return( CHUNK_DATA( chunk));
+}
+
+/* arena_alloc - bump-allocate size bytes of zeroed memory.
+ * This memory is only given back when the arena is destroyed.
+ */
+void * arena_alloc( ARENA *arena, size_t size ){
+	void *ptr;
+
+	ptr = arena_carve( arena, size);
+	if (ptr != NULL) {
+		arena->arena_allocs++;
+		arena->bytes_requested += size;
+		arena->bytes_in_use += ALIGN_UP( size);
+	}
+	return( ptr);
+}
+
+/* Return the size class for a block of the given size.
+ * Class k holds blocks of 2^(k+ARENA_MIN_SHIFT) bytes.
+ */
+int arena_size_class( size_t size ){
+	int k;
+
+	for (k = 0; k < ARENA_CLASSES - 1 && ((size_t) 1 << (k + ARENA_MIN_SHIFT)) < size; k++)
+		;
+	return( k);
+}
+
+/* arena_block_alloc - allocate a block of at least size bytes,
+ * zeroed, from the size class pools.
+ */
+void * arena_block_alloc( ARENA *arena, size_t size ){
+	int k;
+	size_t block_size;
+	void *block;
+
+	k = arena_size_class( size);
+	block_size = (size_t) 1 << (k + ARENA_MIN_SHIFT);
+	block = arena->free_list[ k ];
+	if (block != NULL) {
+		arena->free_list[ k ] = *(void **) block;
+		arena->bytes_free -= block_size;
+		memset( block, 0, block_size);
+	}
+	else {
+		block = arena_carve( arena, block_size);
+		if (block == NULL)
+			return NULL;
+	}
+	arena->block_allocs++;
+	arena->bytes_requested += size;
+	arena->bytes_in_use += block_size;
+	return( block);
+}
+
+/* arena_block_free - give a block back to its size class pool.
+ * size must be the size it was allocated with.
+ */
+void arena_block_free( ARENA *arena, void *block, size_t size ){
+	int k;
+	size_t block_size;
+
+	if (block == NULL)
+		return;
+	k = arena_size_class( size);
+	block_size = (size_t) 1 << (k + ARENA_MIN_SHIFT);
+	*(void **) block = arena->free_list[ k ];
+	arena->free_list[ k ] = block;
+	arena->block_frees++;
+	arena->bytes_requested -= size;
+	arena->bytes_in_use -= block_size;
+	arena->bytes_free += block_size;
+}
+
+/* arena_block_realloc - resize a block, keeping its contents.
+ * If the new size still fits in the same size class, the block
+ * doesn't move.  Any new space at the end of the block is zeroed.
+ */
+void * arena_block_realloc( ARENA *arena, void *block, size_t old_size, size_t new_size ){
+	void *new_block;
+
+	if (block == NULL)
+		return( arena_block_alloc( arena, new_size));
+	if (arena_size_class( old_size) == arena_size_class( new_size)) {
+		arena->bytes_requested += new_size - old_size;
+		if (new_size < old_size)
+			memset( (char *) block + new_size, 0, old_size - new_size);
+		return( block);
+	}
+	new_block = arena_block_alloc( arena, new_size);
+	if (new_block == NULL)
+		return NULL;
+	memcpy( new_block, block, old_size < new_size ? old_size : new_size);
+	arena_block_free( arena, block, old_size);
+	return( new_block);
+}
+
+/* arena_report - print out the statistics on memory usage.
+ * Fragmentation is the part of the reserved memory that isn't
+ * holding data the caller asked for: rounding up to the size
+ * classes, blocks on the free lists, and unused chunk space.
+ */
+void arena_report( ARENA *arena, FILE *out ){
+	fprintf( out, "%ld system allocations, %lu bytes reserved.\n",
+			arena->system_allocs,
+			(unsigned long) arena->bytes_reserved);
+	fprintf( out, "%ld nodes, %ld blocks allocated, %ld blocks freed.\n",
+			arena->arena_allocs,
+			arena->block_allocs,
+			arena->block_frees);
+	fprintf( out, "%lu bytes requested, %lu bytes in use, %lu bytes free, fragmentation = %.1f%%\n",
+			(unsigned long) arena->bytes_requested,
+			(unsigned long) arena->bytes_in_use,
+			(unsigned long) arena->bytes_free,
+			arena->bytes_reserved ?
+				100.0 * (double) (arena->bytes_reserved - arena->bytes_requested) / (double) arena->bytes_reserved
+				: 0.0);
+}
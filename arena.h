@@ -0,0 +1,55 @@
+/**************************************************
+ * arena.h
+ *
+ * A simple memory arena for the model.  Things that live as
+ * long as the model are bump-allocated out of large chunks,
+ * and CONTEXT nodes and variable sized arrays (stats, links,
+ * hash indexes) come from power-of-two size class pools
+ * carved out of the same chunks.  Blocks that
+ * are given back go onto a free list for their size class, so
+ * nothing is returned to the system until the whole arena is
+ * destroyed.
+ *
+ * ************************************************/
+
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <stddef.h>		// for size_t
+#include <stdio.h>		// for FILE
+
+#define ARENA_CHUNK_SIZE	( 64 * 1024 )	// default size of a chunk
+#define ARENA_MIN_SHIFT		4				// smallest block is 16 bytes
+#define ARENA_CLASSES		28				// largest pooled block is 2GB
+
+typedef struct arena_chunk {
+	struct arena_chunk *next;	// next chunk in the arena
+	size_t size;				// usable bytes in this chunk
+	size_t used;				// bytes handed out so far
+} ARENA_CHUNK;
+
+typedef struct {
+	ARENA_CHUNK *chunks;				// list of chunks, newest first
+	void *free_list[ ARENA_CLASSES ];	// free blocks, by size class
+	size_t chunk_size;					// size of a normal chunk
+	/* Statistics */
+	long system_allocs;			// number of chunks requested from the system
+	long arena_allocs;			// number of bump allocations (nodes)
+	long block_allocs;			// number of pooled block allocations
+	long block_frees;			// number of blocks returned to the pools
+	size_t bytes_reserved;		// bytes obtained from the system
+	size_t bytes_requested;		// live bytes asked for by the caller
+	size_t bytes_in_use;		// live bytes handed out (rounded up to the size class)
+	size_t bytes_free;			// bytes sitting on the free lists
+} ARENA;
+
+/* Function Prototypes */
+ARENA * arena_create( size_t chunk_size );
+void arena_destroy( ARENA *arena );
+void * arena_alloc( ARENA *arena, size_t size );
+void * arena_block_alloc( ARENA *arena, size_t size );
+void arena_block_free( ARENA *arena, void *block, size_t size );
+void * arena_block_realloc( ARENA *arena, void *block, size_t old_size, size_t new_size );
+void arena_report( ARENA *arena, FILE *out );
+
+#endif /*ARENA_H_*/
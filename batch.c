@@ -0,0 +1,233 @@
+/*******************************************************
+ * batch.c
+ *
+ * Batch evaluation of many (training file, test file, order)
+ * jobs in one process (see batch.h).
+ *
+ * The jobs share nothing but the list they come from: each one
+ * loads its own files and builds, tests and frees its own model,
+ * so a fixed pool of threads can simply take the next job off
+ * the list until there are none left.  The list and the output
+ * are protected by one mutex.  A job's results are printed as
+ * soon as every job before it in the manifest has been printed,
+ * so the output is in the same order no matter how many threads
+ * are used.
+ *
+ * *****************************************************/
+#include <stdio.h>
+#include <stdlib.h>			// for malloc(), realloc(), strtol()
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>			// for sysconf()
+#include "model.h"
+#include "ingest.h"			// for loading the training file
+#include "batch.h"
+#include "counters.h"		// for the phase times
+
+typedef struct {
+	BATCH_JOB *jobs;
+	int num_jobs;
+	int next_job;			// next job for a thread to run
+	int next_to_print;		// every job before this one has been printed
+	int num_failed;
+	FILE *out;
+	pthread_mutex_t lock;	// protects all of the above, and out
+} BATCH;
+
+/* Local procedures */
+int read_manifest( FILE *manifest, int default_order, int default_representation, BATCH_JOB **jobs );
+void run_job( BATCH_JOB *job );
+void * batch_worker( void *arg );
+void print_finished_jobs( BATCH *batch );
+
+/* run_batch
+ * Read the jobs in the manifest and run them on num_threads threads
+ * (0 means one per processor), printing the results on out.
+ * Returns the number of jobs that failed, or -1 if the manifest
+ * couldn't be read.
+ */
+int run_batch( FILE *manifest, int num_threads, int default_order, int default_representation, FILE *out ){
+	BATCH batch;
+	pthread_t threads[ MAX_BATCH_THREADS ];
+	int started;
+	int i;
+
+	memset( &batch, 0, sizeof( batch));
+	batch.num_jobs = read_manifest( manifest, default_order, default_representation, &batch.jobs);
+	if (batch.num_jobs < 0)
+		return -1;
+	batch.out = out;
+	pthread_mutex_init( &batch.lock, NULL);
+
+	if (num_threads <= 0)
+		num_threads = (int) sysconf( _SC_NPROCESSORS_ONLN);
+	if (num_threads > MAX_BATCH_THREADS)
+		num_threads = MAX_BATCH_THREADS;
+	if (num_threads > batch.num_jobs)
+		num_threads = batch.num_jobs;
+	for (started = 0; started < num_threads; started++)
+		if (pthread_create( &threads[ started ], NULL, batch_worker, &batch) != 0)
+			break;
+	if (started == 0)
+		batch_worker( &batch);		// no threads, so run the jobs here
+	for (i = 0; i < started; i++)
+		pthread_join( threads[ i ], NULL);
+
+	pthread_mutex_destroy( &batch.lock);
+	free( batch.jobs);
+	return( batch.num_failed);
+}
+
+/* read_manifest
+ * Read the whole manifest into an array of jobs.
+ * Returns the number of jobs, or -1 (after printing the reason)
+ * if there is a bad line in the manifest.
+ */
+int read_manifest( FILE *manifest, int default_order, int default_representation, BATCH_JOB **jobs ){
+	char line[ 4 * (MAX_JOB_NAME+1) ];
+	char str_order[ 41 ];
+	char str_type[ 41 ];
+	char *end;
+	char *p;
+	BATCH_JOB *job;
+	BATCH_JOB *new_jobs;
+	int num_jobs = 0;
+	int capacity = 0;
+	int line_number = 0;
+	int n;
+
+	*jobs = NULL;
+	while (fgets( line, sizeof( line), manifest) != NULL) {
+		line_number++;
+		for (p = line; *p == ' ' || *p == '\t'; p++)
+			;
+		if (*p == '#' || *p == '\n' || *p == '\r' || *p == '\0')
+			continue;
+		if (num_jobs == capacity) {
+			capacity = capacity ? 2 * capacity : 64;
+			new_jobs = (BATCH_JOB *) realloc( *jobs, capacity * sizeof( BATCH_JOB ));
+			if (new_jobs == NULL) {
+				fprintf( stderr, "Out of memory reading the batch manifest\n");
+				free( *jobs);
+				return -1;
+			}
+			*jobs = new_jobs;
+		}
+		job = *jobs + num_jobs;
+		memset( job, 0, sizeof( BATCH_JOB ));
+		job->line = line_number;
+		job->max_order = default_order;
+		job->representation = default_representation;
+		// (the field widths are MAX_JOB_NAME and the sizes of str_order and str_type)
+		n = sscanf( p, "%255s %255s %255s %40s %40s",
+				job->id, job->training_file_name, job->test_file_name, str_order, str_type);
+		if (n >= 4) {
+			job->max_order = (int) strtol( str_order, &end, 10);
+			if (*end != '\0' || job->max_order < 0 || job->max_order > MAX_DEPTH - 3)
+				n = 0;
+		}
+		if (n >= 5)
+			job->representation = get_representation( str_type);
+		if (n < 3) {
+			fprintf( stderr, "Error in batch manifest line %d: expecting \"job_id training_file test_file [order [input_type]]\"\n",
+					line_number);
+			free( *jobs);
+			*jobs = NULL;
+			return -1;
+		}
+		num_jobs++;
+	}
+	return( num_jobs);
+}
+
+/* run_job
+ * Train a new model on the job's training file, and run predict_test()
+ * with it on the job's test file.  If something goes wrong, job->error
+ * says what.
+ */
+void run_job( BATCH_JOB *job ){
+	FILE *training_file;
+	FILE *test_file;
+	SYMBOL_SPAN training_symbols;
+	MODEL *model;
+	PHASE_START( ingest_start);
+
+	training_file = fopen( job->training_file_name, "rb");
+	if (training_file == NULL) {
+		snprintf( job->error, sizeof( job->error), "Had trouble opening the input training file %s", job->training_file_name);
+		return;
+	}
+	test_file = fopen( job->test_file_name, "rb");
+	if (test_file == NULL) {
+		snprintf( job->error, sizeof( job->error), "Had trouble opening the testing file %s", job->test_file_name);
+		fclose( training_file);
+		return;
+	}
+	if (load_symbol_span( &training_symbols, training_file) != 0) {
+		snprintf( job->error, sizeof( job->error), "Had trouble reading the input training file %s", job->training_file_name);
+		fclose( training_file);
+		fclose( test_file);
+		return;
+	}
+	PHASE_END( PHASE_INGEST, ingest_start);
+
+	PHASE_START( train_start);
+	model = initialize_model( job->max_order);
+	train_model( model, training_symbols.s, training_symbols.length);
+	free_symbol_span( &training_symbols);
+	fclose( training_file);
+	PHASE_END( PHASE_TRAIN, train_start);
+
+	PHASE_START( evaluate_start);
+	predict_test( model, NULL, job->max_order, job->representation, test_file, job->line, job->id, &job->results);
+	PHASE_END( PHASE_EVALUATE, evaluate_start);
+
+	fclose( test_file);
+	free_model( model);
+}
+
+/* batch_worker
+ * Thread procedure - run jobs until there are none left.
+ */
+void * batch_worker( void *arg ){
+	BATCH *batch = (BATCH *) arg;
+	int j;
+
+	for (;;) {
+		pthread_mutex_lock( &batch->lock);
+		j = batch->next_job++;
+		pthread_mutex_unlock( &batch->lock);
+		if (j >= batch->num_jobs)
+			break;
+
+		run_job( &batch->jobs[ j ]);
+
+		pthread_mutex_lock( &batch->lock);
+		batch->jobs[ j ].done = TRUE;
+		print_finished_jobs( batch);
+		pthread_mutex_unlock( &batch->lock);
+	}
+	return NULL;
+}
+
+/* print_finished_jobs
+ * Print the results of the finished jobs that are next in line.
+ * The batch must be locked.
+ */
+void print_finished_jobs( BATCH *batch ){
+	BATCH_JOB *job;
+
+	while (batch->next_to_print < batch->num_jobs && batch->jobs[ batch->next_to_print ].done) {
+		job = &batch->jobs[ batch->next_to_print++ ];
+		if (job->error[0] != '\0') {
+			fprintf( stderr, "%s (manifest line %d): %s\n", job->id, job->line, job->error);
+			batch->num_failed++;
+		}
+		else {
+			flockfile( batch->out);		// keep the line in one piece
+			fprintf( batch->out, "%s, ", job->id);
+			print_test_results( batch->out, &job->results, FALSE);
+			funlockfile( batch->out);
+		}
+	}
+}
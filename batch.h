@@ -0,0 +1,48 @@
+/**************************************************
+ * batch.h
+ *
+ * Batch evaluation (-batch).  A manifest lists many prediction
+ * tests, one per line:
+ *
+ *     job_id  training_file  test_file  [order  [input_type]]
+ *
+ * Blank lines and lines starting with '#' are skipped.  The order
+ * and input_type default to the -o and -input_type options.
+ *
+ * Each job trains its own model on the training file and runs
+ * predict_test() on the test file.  The jobs are run by a fixed
+ * number of threads (-threads), and the results are printed in
+ * manifest order, each as the usual predict_test() CSV line with
+ * the job id in front:
+ *
+ *     job_id, order, # right, # tests, % right, ...
+ *
+ * A job that fails prints its error on stderr instead.
+ *
+ * ************************************************/
+
+#ifndef BATCH_H_
+#define BATCH_H_
+
+#include <stdio.h>		// for FILE
+#include "predict.h"	// for TEST_RESULTS
+
+#define MAX_BATCH_THREADS	64
+#define MAX_JOB_NAME		255		// longest job id or file name in a manifest
+
+typedef struct {
+	char id[ MAX_JOB_NAME+1 ];
+	char training_file_name[ MAX_JOB_NAME+1 ];
+	char test_file_name[ MAX_JOB_NAME+1 ];
+	int max_order;
+	int representation;
+	int line;						// line of the manifest the job came from
+	char error[ MAX_JOB_NAME+81 ];	// why the job failed, empty if it didn't
+	int done;						// true once the job has finished
+	TEST_RESULTS results;
+} BATCH_JOB;
+
+/* Function Prototypes */
+int run_batch( FILE *manifest, int num_threads, int default_order, int default_representation, FILE *out );
+
+#endif /*BATCH_H_*/
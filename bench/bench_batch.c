@@ -0,0 +1,159 @@
+/*******************************************************
+ * bench_batch.c
+ *
+ * Benchmark for predict_next_batch(): how many predictions a
+ * second it makes, compared with a loop of predict_next() calls
+ * on the same contexts.
+ *
+ *     bench_batch training_file test_file [order [repeats]]
+ *
+ * The model is trained on training_file, and the contexts are
+ * the ones predict_test() would use on test_file (the order
+ * symbols before every other symbol).  Both ways are run
+ * repeats times over all of the contexts, and the predictions
+ * are checked to be the same.  The interleaving only pays on a
+ * model that doesn't fit in the cache; predict_next_batch() makes
+ * plain predict_next() calls on a smaller one, so there the two
+ * should come out about even.
+ *
+ * *****************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../model.h"
+#include "../ingest.h"
+
+#define BATCH_SIZE	256		// contexts passed to each predict_next_batch() call
+
+double seconds( void );
+int same_prediction( STRUCT_PREDICTION *a, STRUCT_PREDICTION *b );
+
+int main( int argc, char **argv ){
+	FILE *training_file;
+	FILE *test_file;
+	SYMBOL_SPAN training_symbols;
+	STRING16 *test_string;
+	MODEL *model;
+	MODEL_CURSOR *cursor;
+	STRING16_VIEW *contexts;
+	STRING16_VIEW str_sub;
+	STRUCT_PREDICTION *single;
+	STRUCT_PREDICTION *batched;
+	int order = 3;
+	int repeats = 20;
+	int length;
+	int n = 0;
+	int i;
+	int r;
+	int mismatches = 0;
+	double start;
+	double single_time;
+	double batch_time;
+
+	if (argc < 3) {
+		fprintf( stderr, "usage: %s training_file test_file [order [repeats]]\n", argv[0]);
+		return 1;
+	}
+	if (argc > 3)
+		order = atoi( argv[3]);
+	if (argc > 4)
+		repeats = atoi( argv[4]);
+	if (order < 0 || order > MAX_DEPTH - 3 || repeats < 1) {
+		fprintf( stderr, "bad order or repeat count\n");
+		return 1;
+	}
+	training_file = fopen( argv[1], "rb");
+	test_file = fopen( argv[2], "rb");
+	if (training_file == NULL || test_file == NULL) {
+		fprintf( stderr, "Had trouble opening the input files\n");
+		return 1;
+	}
+	if (load_symbol_span( &training_symbols, training_file) != 0) {
+		fprintf( stderr, "Had trouble reading the input training file %s\n", argv[1]);
+		return 1;
+	}
+	model = initialize_model( order);
+	train_model( model, training_symbols.s, training_symbols.length);
+	free_symbol_span( &training_symbols);
+	fclose( training_file);
+	test_string = string16( MAX_STRING_LENGTH+1);
+	length = fread16( test_string, MAX_STRING_LENGTH, test_file);
+	fclose( test_file);
+
+	// The contexts predict_test() would use
+	contexts = (STRING16_VIEW *) malloc( (length/2 + 1) * sizeof( STRING16_VIEW));
+	single = (STRUCT_PREDICTION *) malloc( (length/2 + 1) * sizeof( STRUCT_PREDICTION));
+	batched = (STRUCT_PREDICTION *) malloc( (length/2 + 1) * sizeof( STRUCT_PREDICTION));
+	if (contexts == NULL || single == NULL || batched == NULL) {
+		fprintf( stderr, "Out of memory\n");
+		return 1;
+	}
+	for (i = order; i < length; i += 2)
+		contexts[ n++ ] = view16( test_string, i - order, order);
+	if (n == 0) {
+		fprintf( stderr, "The test file is too short\n");
+		return 1;
+	}
+	cursor = model_cursor( model);
+
+	start = seconds();
+	for (r = 0; r < repeats; r++)
+		for (i = 0; i < n; i++) {
+			str_sub = contexts[ i ];		// (predict_next() shortens it)
+			predict_next( cursor, &str_sub, &single[ i ]);
+		}
+	single_time = seconds() - start;
+
+	start = seconds();
+	for (r = 0; r < repeats; r++)
+		for (i = 0; i < n; i += BATCH_SIZE)
+			predict_next_batch( cursor, (n - i < BATCH_SIZE) ? n - i : BATCH_SIZE,
+					contexts + i, batched + i);
+	batch_time = seconds() - start;
+
+	for (i = 0; i < n; i++)
+		if (!same_prediction( &single[ i ], &batched[ i ]))
+			mismatches++;
+	printf( "order %d, %d contexts x %d, %d tables, %lu KB\n", order, n, repeats,
+			model->alloc_count, (unsigned long) (model->arena->bytes_in_use / 1024));
+	printf( "predict_next:       %12.0f predictions/sec\n", (double) n * repeats / single_time);
+	printf( "predict_next_batch: %12.0f predictions/sec (%.2fx)\n",
+			(double) n * repeats / batch_time, single_time / batch_time);
+	if (mismatches)
+		printf( "%d predictions are different!\n", mismatches);
+
+	delete_model_cursor( cursor);
+	free_model( model);
+	delete_string16( test_string);
+	free( contexts);
+	free( single);
+	free( batched);
+	return( mismatches != 0);
+}
+
+/* seconds
+ * A monotonic clock, in seconds.
+ */
+double seconds( void ){
+	struct timespec now;
+
+	clock_gettime( CLOCK_MONOTONIC, &now);
+	return( now.tv_sec + now.tv_nsec / 1e9);
+}
+
+/* same_prediction
+ * True if two predictions agree in everything predict_test() looks at.
+ */
+int same_prediction( STRUCT_PREDICTION *a, STRUCT_PREDICTION *b ){
+	int i;
+
+	if (a->depth != b->depth || a->num_predictions != b->num_predictions ||
+			a->prob_denominator != b->prob_denominator)
+		return( false);
+	for (i = 0; i < a->num_predictions; i++)
+		if (a->sym[ i ].symbol != b->sym[ i ].symbol ||
+				a->sym[ i ].prob_numerator != b->sym[ i ].prob_numerator)
+			return( false);
+	return( true);
+}
@@ -0,0 +1,432 @@
+/*******************************************************
+ * bench_suite.c
+ *
+ * Microbenchmarks for the hot paths of the model, with the
+ * results written as JSON so runs can be compared from one
+ * change to the next.
+ *
+ *     bench_suite [-data file] [-synthetic n] [-repeats n]
+ *                 [-min-time seconds] [-flush-bytes n] [-json file]
+ *
+ * There are two data sets: the file given with -data (181wks10_10.dat
+ * by default), whose first half is trained on and second half tested,
+ * and a synthetic trace of n symbols (400000 by default) plus a
+ * test trace a twentieth as long (cut to MAX_STRING_LENGTH, as
+ * the test halves are).  The synthetic trace is <time,
+ * location> pairs, where the location mostly stays put or moves to
+ * a neighboring AP, and is made from a fixed seed so every run
+ * uses the same one.
+ *
+ * For each data set and each order from 1 to 7 it measures:
+ *
+ *   training         symbols/sec through train_model() (update_model()
+ *                    and add_character_to_model()), median of the repeats
+ *   predict_next     latency percentiles of single predict_next() calls
+ *                    on the contexts predict_test() would use
+ *   traverse_tree    warm: the same context over and over; cold: one
+ *                    context right after the caches have been flushed
+ *                    by writing flush-bytes of memory
+ *   compute_logloss  test symbols/sec, and the log-loss itself
+ *   neighboring_ap   time per call, on the (predicted, actual) pairs
+ *                    from the predictions (topped up with random pairs)
+ *
+ * Anything that is timed as a loop runs for at least min-time
+ * seconds (0.2 by default).
+ *
+ * *****************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../model.h"
+#include "../ingest.h"
+#include "../apmap.h"
+
+#define MIN_ORDER			1
+#define MAX_BENCH_ORDER		7
+#define TRAVERSE_SAMPLES	128		// contexts timed for traverse_tree
+#define WARM_CALLS			64		// calls per warm traverse_tree sample
+#define MIN_NEIGHBOR_PAIRS	4096
+
+typedef struct {
+	const char *name;
+	SYMBOL_TYPE *train;
+	long train_length;
+	STRING16 *test;
+} DATASET;
+
+/* Options */
+long synthetic_length = 400000;
+int repeats = 5;
+double min_time = 0.2;
+long flush_bytes = 32L << 20;
+
+char *flush_buffer;
+unsigned long long random_state = 0x2545F4914F6CDD1DULL;
+
+/* Local procedures */
+double seconds( void );
+unsigned long next_random( void );
+int compare_doubles( const void *a, const void *b );
+double percentile( double *sorted, long n, double p );
+void flush_caches( void );
+int load_dataset( DATASET *data, char *file_name );
+void make_synthetic( DATASET *data, long length );
+STRING16 * make_string16( SYMBOL_TYPE *symbols, long length );
+void bench_order( FILE *out, DATASET *data, int order, int first );
+
+int main( int argc, char **argv ){
+	char *data_file_name = "181wks10_10.dat";
+	char *json_file_name = NULL;
+	FILE *out = stdout;
+	DATASET datasets[ 2 ];
+	AP_MAP *map;
+	int d;
+	int order;
+	int first = 1;
+
+	for (argc--, argv++; argc > 0; argc--, argv++) {
+		if (argc > 1 && strcmp( *argv, "-data") == 0)
+			data_file_name = *++argv;
+		else if (argc > 1 && strcmp( *argv, "-synthetic") == 0)
+			synthetic_length = atol( *++argv);
+		else if (argc > 1 && strcmp( *argv, "-repeats") == 0)
+			repeats = atoi( *++argv);
+		else if (argc > 1 && strcmp( *argv, "-min-time") == 0)
+			min_time = atof( *++argv);
+		else if (argc > 1 && strcmp( *argv, "-flush-bytes") == 0)
+			flush_bytes = atol( *++argv);
+		else if (argc > 1 && strcmp( *argv, "-json") == 0)
+			json_file_name = *++argv;
+		else {
+			fprintf( stderr, "usage: bench_suite [-data file] [-synthetic n] [-repeats n]\n"
+					"                   [-min-time seconds] [-flush-bytes n] [-json file]\n");
+			return 1;
+		}
+		argc--;
+	}
+	if (synthetic_length < 1000 || repeats < 1 || min_time < 0 || flush_bytes < 4096) {
+		fprintf( stderr, "bad option value\n");
+		return 1;
+	}
+
+	map = builtin_ap_map();
+	flush_buffer = (char *) malloc( flush_bytes);
+	if (map == NULL || flush_buffer == NULL) {
+		fprintf( stderr, "Out of memory\n");
+		return 1;
+	}
+	memset( flush_buffer, 0, flush_bytes);
+	set_ap_map( map);
+	if (load_dataset( &datasets[ 0 ], data_file_name) != 0)
+		return 1;
+	make_synthetic( &datasets[ 1 ], synthetic_length);
+	if (json_file_name != NULL && (out = fopen( json_file_name, "w")) == NULL) {
+		fprintf( stderr, "Had trouble opening %s\n", json_file_name);
+		return 1;
+	}
+
+	fprintf( out, "{\n  \"benchmark\": \"predict_melt\",\n");
+	fprintf( out, "  \"repeats\": %d,\n  \"min_time_sec\": %g,\n  \"flush_bytes\": %ld,\n",
+			repeats, min_time, flush_bytes);
+	fprintf( out, "  \"results\": [\n");
+	for (d = 0; d < 2; d++)
+		for (order = MIN_ORDER; order <= MAX_BENCH_ORDER; order++) {
+			fprintf( stderr, "%s, order %d\n", datasets[ d ].name, order);
+			bench_order( out, &datasets[ d ], order, first);
+			first = 0;
+		}
+	fprintf( out, "\n  ]\n}\n");
+	if (out != stdout)
+		fclose( out);
+	free_ap_map( map);
+	free( flush_buffer);
+	return 0;
+}
+
+/* bench_order
+ * Run every benchmark on one data set at one order, and write its
+ * JSON object.
+ */
+void bench_order( FILE *out, DATASET *data, int order, int first ){
+	MODEL *model;
+	MODEL_CURSOR *cursor;
+	STRUCT_PREDICTION pred;
+	STRING16_VIEW *contexts;
+	STRING16_VIEW str_sub;
+	SYMBOL_TYPE *pairs;			// (predicted, actual) pairs for neighboring_ap
+	double *samples;
+	double *rates;
+	double start;
+	double elapsed;
+	double logloss = 0;
+	double warm_sum;
+	long num_contexts = 0;
+	long num_pairs = 0;
+	long num_samples;
+	long calls;
+	long i;
+	int length = strlen16( data->test);
+	int r;
+	int k;
+	int tables = 0;
+	volatile int sink = 0;
+
+	contexts = (STRING16_VIEW *) malloc( (length/2 + 1) * sizeof( STRING16_VIEW));
+	pairs = (SYMBOL_TYPE *) malloc( 2 * (length/2 + MIN_NEIGHBOR_PAIRS + 1) * sizeof( SYMBOL_TYPE));
+	samples = (double *) malloc( ((length/2 + 1) * (long) repeats + TRAVERSE_SAMPLES) * sizeof( double));
+	rates = (double *) malloc( repeats * sizeof( double));
+	if (contexts == NULL || pairs == NULL || samples == NULL || rates == NULL) {
+		fprintf( stderr, "Out of memory\n");
+		exit( 1);
+	}
+	for (i = order; i < length; i += 2)
+		contexts[ num_contexts++ ] = view16( data->test, i - order, order);
+
+	/* training */
+	for (r = 0; r < repeats; r++) {
+		calls = 0;
+		start = seconds();
+		do {
+			model = initialize_model( order);
+			train_model( model, data->train, data->train_length);
+			calls++;
+			elapsed = seconds() - start;
+			if (elapsed < min_time)
+				free_model( model);
+		} while (elapsed < min_time);
+		tables = model->alloc_count;
+		free_model( model);
+		rates[ r ] = (double) calls * data->train_length / elapsed;
+	}
+	qsort( rates, repeats, sizeof( double), compare_doubles);
+	if (!first)
+		fprintf( out, ",\n");
+	fprintf( out, "    {\n      \"dataset\": \"%s\",\n      \"order\": %d,\n", data->name, order);
+	fprintf( out, "      \"training\": { \"symbols\": %ld, \"tables\": %d, \"symbols_per_sec\": %.0f },\n",
+			data->train_length, tables, percentile( rates, repeats, 0.5));
+
+	model = initialize_model( order);
+	train_model( model, data->train, data->train_length);
+	cursor = model_cursor( model);
+
+	/* predict_next */
+	num_samples = 0;
+	for (r = 0; r < repeats; r++)
+		for (i = 0; i < num_contexts; i++) {
+			str_sub = contexts[ i ];
+			start = seconds();
+			predict_next( cursor, &str_sub, &pred);
+			samples[ num_samples++ ] = (seconds() - start) * 1e9;
+			if (r == 0 && pred.num_predictions > 0 && ap_number( contexts[ i ].s[ order ]) >= 0) {
+				pairs[ 2*num_pairs ] = pred.sym[ 0 ].symbol;
+				pairs[ 2*num_pairs + 1 ] = contexts[ i ].s[ order ];
+				num_pairs++;
+			}
+		}
+	qsort( samples, num_samples, sizeof( double), compare_doubles);
+	fprintf( out, "      \"predict_next\": { \"calls\": %ld, \"p50_ns\": %.0f, \"p90_ns\": %.0f, "
+			"\"p99_ns\": %.0f, \"max_ns\": %.0f },\n",
+			num_samples, percentile( samples, num_samples, 0.5), percentile( samples, num_samples, 0.9),
+			percentile( samples, num_samples, 0.99), percentile( samples, num_samples, 1.0));
+
+	/* traverse_tree, warm and cold */
+	warm_sum = 0;
+	num_samples = (num_contexts < TRAVERSE_SAMPLES) ? num_contexts : TRAVERSE_SAMPLES;
+	for (i = 0; i < num_samples; i++) {
+		start = seconds();
+		for (k = 0; k < WARM_CALLS; k++) {
+			str_sub = contexts[ i * num_contexts / num_samples ];
+			traverse_tree( cursor, &str_sub);
+		}
+		warm_sum += (seconds() - start) * 1e9 / WARM_CALLS;
+	}
+	for (i = 0; i < num_samples; i++) {
+		flush_caches();
+		str_sub = contexts[ i * num_contexts / num_samples ];
+		start = seconds();
+		traverse_tree( cursor, &str_sub);
+		samples[ i ] = (seconds() - start) * 1e9;
+	}
+	qsort( samples, num_samples, sizeof( double), compare_doubles);
+	fprintf( out, "      \"traverse_tree\": { \"contexts\": %ld, \"warm_ns\": %.1f, "
+			"\"cold_p50_ns\": %.0f, \"cold_p90_ns\": %.0f },\n",
+			num_samples, num_samples ? warm_sum / num_samples : 0.0,
+			percentile( samples, num_samples, 0.5), percentile( samples, num_samples, 0.9));
+
+	/* compute_logloss */
+	for (r = 0; r < repeats; r++) {
+		calls = 0;
+		start = seconds();
+		do {
+			logloss = compute_logloss( cursor, data->test, 0);
+			calls++;
+			elapsed = seconds() - start;
+		} while (elapsed < min_time);
+		rates[ r ] = (double) calls * length / elapsed;
+	}
+	qsort( rates, repeats, sizeof( double), compare_doubles);
+	fprintf( out, "      \"compute_logloss\": { \"symbols\": %d, \"symbols_per_sec\": %.0f, \"logloss\": %.6f },\n",
+			length, percentile( rates, repeats, 0.5), logloss);
+
+	/* neighboring_ap, topped up with random pairs of APs */
+	{
+		AP_MAP *map = builtin_ap_map();		// (only its symbols are used)
+
+		while (num_pairs < MIN_NEIGHBOR_PAIRS) {
+			pairs[ 2*num_pairs ] = map->symbols[ 1 + next_random() % (map->num_aps - 1) ];
+			pairs[ 2*num_pairs + 1 ] = map->symbols[ 1 + next_random() % (map->num_aps - 1) ];
+			num_pairs++;
+		}
+		free_ap_map( map);
+	}
+	for (r = 0; r < repeats; r++) {
+		calls = 0;
+		start = seconds();
+		do {
+			for (i = 0; i < num_pairs; i++)
+				sink += neighboring_ap( pairs[ 2*i ], pairs[ 2*i + 1 ]);
+			calls += num_pairs;
+			elapsed = seconds() - start;
+		} while (elapsed < min_time);
+		rates[ r ] = elapsed * 1e9 / calls;
+	}
+	qsort( rates, repeats, sizeof( double), compare_doubles);
+	fprintf( out, "      \"neighboring_ap\": { \"pairs\": %ld, \"ns_per_call\": %.2f }\n    }",
+			num_pairs, percentile( rates, repeats, 0.5));
+
+	delete_model_cursor( cursor);
+	free_model( model);
+	free( contexts);
+	free( pairs);
+	free( samples);
+	free( rates);
+}
+
+/* load_dataset
+ * Read a trace file, and split it into training and test halves
+ * (at an even number of symbols, so the pairs stay together).
+ */
+int load_dataset( DATASET *data, char *file_name ){
+	FILE *file;
+	SYMBOL_SPAN span;
+	long half;
+
+	file = fopen( file_name, "rb");
+	if (file == NULL || load_symbol_span( &span, file) != 0) {
+		fprintf( stderr, "Had trouble reading the data file %s\n", file_name);
+		return -1;
+	}
+	fclose( file);
+	half = (span.length / 2) & ~1L;
+	data->name = strrchr( file_name, '/') ? strrchr( file_name, '/') + 1 : file_name;
+	data->train = (SYMBOL_TYPE *) malloc( (half + 1) * sizeof( SYMBOL_TYPE));
+	if (data->train == NULL) {
+		fprintf( stderr, "Out of memory\n");
+		return -1;
+	}
+	memcpy( data->train, span.s, half * sizeof( SYMBOL_TYPE));
+	data->train_length = half;
+	data->test = make_string16( span.s + half, span.length - half);
+	free_symbol_span( &span);
+	return 0;
+}
+
+/* make_synthetic
+ * Make a synthetic trace of <time, location> pairs: length symbols
+ * to train on, and a twentieth of that to test.  The time moves on
+ * one slot every few pairs, and the location stays where it is,
+ * moves to a neighboring AP, or (now and then) jumps anywhere.
+ */
+void make_synthetic( DATASET *data, long length ){
+	AP_MAP *map = builtin_ap_map();
+	SYMBOL_TYPE *symbols;
+	long total = length + length / 20;
+	long i;
+	int ap = 1;
+	int degree;
+	int slot = 0;
+	unsigned long dice;
+
+	symbols = (SYMBOL_TYPE *) malloc( (total + 1) * sizeof( SYMBOL_TYPE));
+	if (map == NULL || symbols == NULL) {
+		fprintf( stderr, "Out of memory\n");
+		exit( 1);
+	}
+	for (i = 0; i + 1 < total; i += 2) {
+		if (next_random() % 4 == 0)
+			slot = (slot + 1) % 1440;
+		dice = next_random() % 100;
+		degree = map->offsets[ ap + 1 ] - map->offsets[ ap ];
+		if (dice < 5 || degree == 0)
+			ap = 1 + next_random() % (map->num_aps - 1);
+		else if (dice < 35)
+			ap = map->neighbors[ map->offsets[ ap ] + next_random() % degree ];
+		symbols[ i ] = (SYMBOL_TYPE) (0x2621 + slot);
+		symbols[ i + 1 ] = (SYMBOL_TYPE) map->symbols[ ap ];
+	}
+	total = i;
+	data->name = "synthetic";
+	data->train = symbols;
+	data->train_length = length & ~1L;
+	data->test = make_string16( symbols + data->train_length, total - data->train_length);
+	free_ap_map( map);
+}
+
+STRING16 * make_string16( SYMBOL_TYPE *symbols, long length ){
+	STRING16 *s16;
+
+	if (length > MAX_STRING_LENGTH)
+		length = MAX_STRING_LENGTH;
+	s16 = string16( length + 1);
+	memcpy( s16->s, symbols, length * sizeof( SYMBOL_TYPE));
+	s16->length = length;
+	return( s16);
+}
+
+/* flush_caches
+ * Push the model out of the caches by writing a big buffer.
+ */
+void flush_caches( void ){
+	long i;
+
+	for (i = 0; i < flush_bytes; i += 64)
+		flush_buffer[ i ]++;
+}
+
+/* seconds
+ * A monotonic clock, in seconds.
+ */
+double seconds( void ){
+	struct timespec now;
+
+	clock_gettime( CLOCK_MONOTONIC, &now);
+	return( now.tv_sec + now.tv_nsec / 1e9);
+}
+
+/* next_random
+ * xorshift64*, so the synthetic trace and the random pairs are the
+ * same on every run.
+ */
+unsigned long next_random( void ){
+	random_state ^= random_state >> 12;
+	random_state ^= random_state << 25;
+	random_state ^= random_state >> 27;
+	return( (unsigned long) ((random_state * 2685821657736338717ULL) >> 32));
+}
+
+int compare_doubles( const void *a, const void *b ){
+	return( (*(const double *) a > *(const double *) b) - (*(const double *) a < *(const double *) b));
+}
+
+/* percentile
+ * The p'th percentile (0 to 1) of n sorted samples.
+ */
+double percentile( double *sorted, long n, double p ){
+	long i;
+
+	if (n == 0)
+		return( 0);
+	i = (long) (p * (n - 1) + 0.5);
+	return( sorted[ i ]);
+}
@@ -0,0 +1,118 @@
+/*******************************************************
+ * counters.c
+ *
+ * The hot path counters (see counters.h), and the JSON report
+ * of them.  When PREDICT_COUNTERS isn't defined there's nothing
+ * here but a write_counters() that says so.
+ *
+ * *****************************************************/
+#include <stdio.h>
+#include <time.h>
+#include "counters.h"
+
+#ifdef PREDICT_COUNTERS
+
+COUNTERS counters;
+
+char *phase_names[ NUM_PHASES ] = { "ingest", "train", "evaluate" };
+
+void count_tables( CONTEXT *table, int order, long *nodes, long *bytes );
+void write_histogram( FILE *out, char *name, long *histogram );
+
+int counters_enabled( void ){
+	return( 1);
+}
+
+/* counter_nsec
+ * A monotonic clock, in nanoseconds, for timing the phases.
+ */
+long counter_nsec( void ){
+	struct timespec now;
+
+	clock_gettime( CLOCK_MONOTONIC, &now);
+	return( now.tv_sec * 1000000000L + now.tv_nsec);
+}
+
+/* write_counters
+ * Write the counters so far as a JSON object.  If model isn't NULL,
+ * the number of tables and the bytes they take (the CONTEXT structs
+ * and whatever stats, links and hash arrays they have outside them)
+ * are counted for each of its orders too.  This can be called at
+ * any time.
+ * RETURNS: 0, or -1 if it couldn't be written
+ */
+int write_counters( FILE *out, MODEL *model ){
+	long nodes[ MAX_DEPTH ];
+	long bytes[ MAX_DEPTH ];
+	int i;
+
+	fprintf( out, "{\n  \"realloc_calls\": %ld,\n", counters.realloc_calls);
+	fprintf( out, "  \"rescale_table_calls\": %ld,\n", counters.rescale_table_calls);
+	fprintf( out, "  \"shorten_string16_calls\": %ld,\n", counters.shorten_string16_calls);
+	fprintf( out, "  \"traverse_tree\": { \"calls\": %ld, ", counters.traverse_calls);
+	write_histogram( out, "fallback", counters.traverse_fallback);
+	fprintf( out, " },\n  \"compute_logloss\": { \"symbols\": %ld, ", counters.logloss_symbols);
+	write_histogram( out, "escapes", counters.logloss_escapes);
+	fprintf( out, " },\n  \"phase_seconds\": {");
+	for (i = 0; i < NUM_PHASES; i++)
+		fprintf( out, "%s \"%s\": %.6f", (i > 0) ? "," : "", phase_names[ i ], counters.phase_nsec[ i ] / 1e9);
+	fprintf( out, " }");
+	if (model != NULL) {
+		for (i = 0; i < MAX_DEPTH; i++)
+			nodes[ i ] = bytes[ i ] = 0;
+		count_tables( model->contexts[ 0 ], 0, nodes, bytes);
+		fprintf( out, ",\n  \"model\": { \"max_order\": %d, \"tables\": %d, \"orders\": [",
+				model->max_order, model->alloc_count);
+		for (i = 0; i <= model->max_order && i < MAX_DEPTH; i++)
+			fprintf( out, "%s\n    { \"order\": %d, \"tables\": %ld, \"bytes\": %ld }",
+					(i > 0) ? "," : "", i, nodes[ i ], bytes[ i ]);
+		fprintf( out, "\n  ] }");
+	}
+	fprintf( out, "\n}\n");
+	return( ferror( out) ? -1 : 0);
+}
+
+/* count_tables
+ * Add up the tables under table (which is of the given order), and
+ * their sizes, by order.
+ */
+void count_tables( CONTEXT *table, int order, long *nodes, long *bytes ){
+	int i;
+
+	if (table == NULL || order >= MAX_DEPTH)
+		return;
+	nodes[ order ]++;
+	bytes[ order ] += sizeof( CONTEXT);
+	if (!IS_INLINE( table)) {
+		bytes[ order ] += table->capacity * sizeof( STATS);
+		if (table->hash != NULL)
+			bytes[ order ] += INDEX_SLOTS( table) * sizeof( int);
+		if (table->links != NULL)
+			bytes[ order ] += table->capacity * sizeof( LINKS);
+	}
+	if (table->links == NULL)
+		return;
+	for (i = 0; i <= table->max_index; i++)
+		count_tables( table->links[ i ].next, order + 1, nodes, bytes);
+}
+
+void write_histogram( FILE *out, char *name, long *histogram ){
+	int i;
+
+	fprintf( out, "\"%s\": [", name);
+	for (i = 0; i < HISTOGRAM_SIZE; i++)
+		fprintf( out, "%s%ld", (i > 0) ? ", " : " ", histogram[ i ]);
+	fprintf( out, " ]");
+}
+
+#else
+
+int counters_enabled( void ){
+	return( 0);
+}
+
+int write_counters( FILE *out, MODEL *model ){
+	return( -1);
+}
+
+#endif /*PREDICT_COUNTERS*/
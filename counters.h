@@ -0,0 +1,80 @@
+/**************************************************
+ * counters.h
+ *
+ * Counters for the hot paths: how often the tables are
+ * reallocated and rescaled, how far traverse_tree() has to fall
+ * back, how many escapes each symbol takes in compute_logloss(),
+ * shorten_string16() calls, and the time spent in each phase
+ * (reading the training file, training, and testing).  With
+ * write_counters() they go out as a JSON report, along with the
+ * number of tables and bytes the model has at each order.
+ *
+ * The counters are only there when PREDICT_COUNTERS is defined
+ * (uncomment it below, or compile with -DPREDICT_COUNTERS).
+ * Otherwise every COUNT...() and PHASE_...() macro is empty, and
+ * nothing is counted or timed at all.
+ *
+ * The counts are added atomically, so they are right with -threads
+ * too.  Phase times from batch jobs running at once add up, so they
+ * can be more than the time the program ran.
+ *
+ * ************************************************/
+
+#ifndef COUNTERS_H_
+#define COUNTERS_H_
+
+//#define PREDICT_COUNTERS
+
+#include <stdio.h>		// for FILE
+#include "model.h"		// for MODEL and MAX_DEPTH
+
+#define PHASE_INGEST		0		// reading the training file
+#define PHASE_TRAIN			1		// training the model
+#define PHASE_EVALUATE		2		// testing (-p, -logloss, -orders, -stream)
+#define NUM_PHASES			3
+#define HISTOGRAM_SIZE		( MAX_DEPTH + 2 )	// the last slot counts everything past the end
+
+#ifdef PREDICT_COUNTERS
+
+typedef struct {
+	long realloc_calls;				// stats, links and hash arrays resized
+	long rescale_table_calls;
+	long shorten_string16_calls;
+	long traverse_calls;
+	long traverse_fallback[ HISTOGRAM_SIZE ];	// lookups by how many symbols short of the whole context they ended
+	long logloss_symbols;
+	long logloss_escapes[ HISTOGRAM_SIZE ];		// symbols by how many escapes they took
+	long phase_nsec[ NUM_PHASES ];
+} COUNTERS;
+
+extern COUNTERS counters;
+
+#if defined( __GNUC__ )
+#define COUNT_ADD( field, n )	__atomic_fetch_add( &counters.field, (n), __ATOMIC_RELAXED )
+#else
+#define COUNT_ADD( field, n )	( counters.field += (n) )
+#endif
+#define COUNT( field )			COUNT_ADD( field, 1 )
+#define COUNT_HISTOGRAM( field, n )	\
+	COUNT_ADD( field[ ((n) < 0) ? 0 : ((n) < HISTOGRAM_SIZE) ? (n) : HISTOGRAM_SIZE - 1 ], 1 )
+// PHASE_START( start ) declares start, and PHASE_END() adds the time since then to the phase
+#define PHASE_START( start )		long start = counter_nsec()
+#define PHASE_END( phase, start )	COUNT_ADD( phase_nsec[ phase ], counter_nsec() - (start) )
+
+long counter_nsec( void );
+
+#else
+
+#define COUNT_ADD( field, n )
+#define COUNT( field )
+#define COUNT_HISTOGRAM( field, n )	( (void) sizeof( n ) )		// (n isn't evaluated)
+#define PHASE_START( start )
+#define PHASE_END( phase, start )
+
+#endif /*PREDICT_COUNTERS*/
+
+/* Function Prototypes */
+int counters_enabled( void );
+int write_counters( FILE *out, MODEL *model );
+
+#endif /*COUNTERS_H_*/
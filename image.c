@@ -0,0 +1,515 @@
+/*******************************************************
+ * image.c
+ *
+ * Queries on a frozen model image (see image.h).  The image is
+ * mapped read-only, so opening one only has to check the header;
+ * nothing is copied or rebuilt.
+ *
+ * image_traverse(), image_predict_next() and image_compute_logloss()
+ * work the same way as traverse_tree(), predict_next() and
+ * compute_logloss() in model-2.c, including the way the escape
+ * counts and exclusions are figured, so the results are the same
+ * as for the live model that was frozen.  One difference: the image
+ * can't be changed, so if a table ever needs rescaling (which the
+ * live model reports with "rescaling table!") the halved counts are
+ * only used for that one calculation.
+ *
+ * *****************************************************/
+#include <stdlib.h>			// for malloc(), free()
+#include <string.h>			// for memset(), memcmp()
+#include <stdio.h>
+#include <math.h>			// for log2()
+#include "model.h"
+#include "image.h"
+
+#if defined(__unix__) || defined(__CYGWIN__) || defined(__APPLE__)
+#define HAVE_MMAP
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
+
+/* Local procedures */
+int check_image( MODEL_IMAGE *image );
+int image_find_symbol( MODEL_IMAGE *image, int node, SYMBOL_TYPE symbol );
+void image_totalize( IMAGE_CURSOR *cursor, int node );
+int image_convert_int_to_symbol( IMAGE_CURSOR *cursor, SYMBOL_TYPE c, SYMBOL *s );
+
+/* Constructor open_image
+ * Map the image file into memory (or read it in, if it can't be
+ * mapped), and check that it is a good image.
+ * NULL means error.
+ */
+MODEL_IMAGE * open_image( char *file_name ){
+	MODEL_IMAGE *image;
+	FILE *file;
+	long size;
+#ifdef HAVE_MMAP
+	struct stat st;
+	void *map;
+#endif
+
+	file = fopen( file_name, "rb");
+	if (file == NULL)
+		return NULL;
+	image = (MODEL_IMAGE *) calloc( sizeof( MODEL_IMAGE), 1);
+	if (image == NULL) {
+		fclose( file);
+		return NULL;
+	}
+#ifdef HAVE_MMAP
+	if (fstat( fileno( file), &st) == 0 && S_ISREG( st.st_mode) &&
+			st.st_size >= (off_t) sizeof( IMAGE_HEADER)) {
+		map = mmap( NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fileno( file), 0);
+		if (map != MAP_FAILED) {
+			image->base = map;
+			image->size = (size_t) st.st_size;
+			image->mapped = true;
+		}
+	}
+#endif
+	if (!image->mapped) {
+		if (fseek( file, 0, SEEK_END) != 0 || (size = ftell( file)) < (long) sizeof( IMAGE_HEADER) ||
+				fseek( file, 0, SEEK_SET) != 0 ||
+				(image->base = malloc( (size_t) size)) == NULL ||
+				fread( image->base, 1, (size_t) size, file) != (size_t) size) {
+			fclose( file);
+			close_image( image);
+			return NULL;
+		}
+		image->size = (size_t) size;
+	}
+	fclose( file);
+	if (check_image( image) != 0) {
+		close_image( image);
+		return NULL;
+	}
+	return( image);
+}
+
+/* check_image
+ * Set up the pointers into the image, making sure that everything
+ * the header describes is really inside the file, and that every
+ * node's entries are.  The node numbers and positions stored in the
+ * entries and keys are checked as they are used.
+ * RETURNS: 0 if the image looks good, -1 if not.
+ */
+int check_image( MODEL_IMAGE *image ){
+	const IMAGE_HEADER *header;
+	const IMAGE_NODE *nodes;
+	char *base;
+	int i;
+
+	base = (char *) image->base;
+	header = (const IMAGE_HEADER *) base;
+	if (memcmp( header->magic, IMAGE_MAGIC, sizeof( header->magic)) != 0)
+		return( -1);
+	if (header->byte_order != IMAGE_BYTE_ORDER || header->version != IMAGE_VERSION) {
+		fprintf( stderr, "Model image is version %d, expecting version %d (native byte order)\n",
+				header->byte_order == IMAGE_BYTE_ORDER ? header->version : -1,
+				IMAGE_VERSION);
+		return( -1);
+	}
+	if (header->max_order < 0 || header->max_order > MAX_DEPTH - 3 ||
+			header->num_nodes < 2 || header->num_entries < 0 ||
+			header->image_size != (int) image->size ||
+			header->nodes_offset < (int) sizeof( IMAGE_HEADER) ||
+			header->nodes_offset + (double) header->num_nodes * sizeof( IMAGE_NODE) > header->image_size ||
+			header->entries_offset < 0 ||
+			header->entries_offset + (double) header->num_entries * sizeof( IMAGE_ENTRY) > header->image_size ||
+			header->keys_offset < 0 ||
+			header->keys_offset + (double) header->num_entries * sizeof( IMAGE_KEY) > header->image_size ||
+			header->root < 0 || header->root >= header->num_nodes ||
+			header->null_node < 0 || header->null_node >= header->num_nodes)
+		return( -1);
+	image->header = header;
+	image->nodes = nodes = (const IMAGE_NODE *) (base + header->nodes_offset);
+	image->entries = (const IMAGE_ENTRY *) (base + header->entries_offset);
+	image->keys = (const IMAGE_KEY *) (base + header->keys_offset);
+	for (i = 0; i < header->num_nodes; i++)
+		if (nodes[ i ].first < 0 || nodes[ i ].count < 0 ||
+				nodes[ i ].first + nodes[ i ].count > header->num_entries)
+			return( -1);
+	image->max_order = header->max_order;
+	return( 0);
+}
+
+/* Destructor - unmap or free the image */
+void close_image( MODEL_IMAGE *image ){
+	if (image == NULL)
+		return;
+#ifdef HAVE_MMAP
+	if (image->mapped)
+		munmap( image->base, image->size);
+	else
+#endif
+	free( image->base);
+	free( image);
+}
+
+/* Constructor image_cursor
+ * Create a cursor for queries on an image.  NULL means error.
+ */
+IMAGE_CURSOR * image_cursor( MODEL_IMAGE *image ){
+	IMAGE_CURSOR *cursor;
+
+	cursor = (IMAGE_CURSOR *) calloc( sizeof( IMAGE_CURSOR), 1);
+	if (cursor == NULL)
+		return NULL;
+	cursor->image = image;
+	cursor->contexts = cursor->context_nodes + 1;
+	cursor->contexts[ -1 ] = image->header->null_node;
+	cursor->contexts[ 0 ] = image->header->root;
+	cursor->epoch = 1;				// (an empty scoreboard is all zeros)
+	return( cursor);
+}
+
+/* Destructor - the image itself isn't touched */
+void delete_image_cursor( IMAGE_CURSOR *cursor ){
+	free( cursor);
+}
+
+/* image_find_symbol
+ * Binary search a node's keys for a symbol.
+ * RETURNS: the symbol's position in the node's entries, or -1
+ * if the symbol isn't there.
+ */
+int image_find_symbol( MODEL_IMAGE *image, int node, SYMBOL_TYPE symbol ){
+	const IMAGE_KEY *keys;
+	int low, high, mid;
+
+	keys = image->keys + image->nodes[ node ].first;
+	low = 0;
+	high = image->nodes[ node ].count - 1;
+	while (low <= high) {
+		mid = (low + high) / 2;
+		if (keys[ mid ].symbol == symbol)
+			return( (keys[ mid ].index < image->nodes[ node ].count) ? keys[ mid ].index : -1);
+		if (keys[ mid ].symbol < symbol)
+			low = mid + 1;
+		else
+			high = mid - 1;
+	}
+	return( -1);
+}
+
+/*************************************************************
+ * image_traverse
+ * Same as traverse_tree(): find the longest part of the end of
+ * context_string that is in the model, shortening the string
+ * until it's found.  A symbol without a next order table is
+ * treated the same as one whose next table is empty.
+ * OUTPUTS: cursor->current_order is the depth where the context
+ * 		was found (-1 if not even the last symbol was found)
+ * 		cursor->contexts[] valid from 0 to current_order
+ *************************************************************/
+void image_traverse( IMAGE_CURSOR *cursor, STRING16_VIEW *context_string ){
+	MODEL_IMAGE *image = cursor->image;
+	int i;
+	int next;
+	int local_order = 0;
+	int index_into_string = 0;
+	int done = false;
+
+	if (context_string->length == 0)
+		done = true;
+	while (!done) {
+		i = image_find_symbol( image, cursor->contexts[ local_order ],
+				context_string->s[ index_into_string ]);
+		next = (i < 0) ? -1 :
+				image->entries[ image->nodes[ cursor->contexts[ local_order ] ].first + i ].next;
+		if (next < 0 || next >= image->header->num_nodes || image->nodes[ next ].count == 0) {
+			if (context_string->length == 1) {
+				local_order = -1;
+				break;
+			}
+			shorten_view16( context_string);
+			index_into_string = 0;
+			local_order = 0;
+			continue;
+		}
+		if (++index_into_string == context_string->length)
+			done = true;
+		local_order++;
+		cursor->contexts[ local_order ] = next;
+	}
+	cursor->current_order = local_order;
+}
+
+/*************************************************************
+ * image_start_context, image_advance_context
+ * Same as start_context() and advance_context(): move the context
+ * along a string one symbol at a time, following the next order
+ * nodes and falling back to the lesser nodes, instead of doing an
+ * image_traverse() for every position.
+ * RETURNS: current_order
+ *************************************************************/
+void image_start_context( IMAGE_CURSOR *cursor ){
+	cursor->walk_node = cursor->image->header->root;
+	cursor->walk_order = 0;
+	cursor->contexts[ 0 ] = cursor->walk_node;
+	cursor->current_order = 0;
+}
+int image_advance_context( IMAGE_CURSOR *cursor, SYMBOL_TYPE c, int max_order ){
+	MODEL_IMAGE *image = cursor->image;
+	int node = cursor->walk_node;
+	int order = cursor->walk_order;
+	int i;
+	int next;
+
+	if (max_order <= 0)
+		return( cursor->current_order = 0);		// the context is always empty
+	if (order == max_order) {		// the oldest symbol drops out of the context
+		node = image->nodes[ node ].lesser;
+		order--;
+	}
+	for (;;) {
+		i = image_find_symbol( image, node, c);
+		next = (i < 0) ? -1 : image->entries[ image->nodes[ node ].first + i ].next;
+		if (next >= 0 && next < image->header->num_nodes && image->nodes[ next ].count != 0) {
+			node = next;
+			order++;
+			break;
+		}
+		if (order == 0)
+			break;			// not even c on its own is in the model
+		node = image->nodes[ node ].lesser;
+		order--;
+	}
+	cursor->walk_node = node;
+	cursor->walk_order = order;
+	cursor->contexts[ order ] = node;
+	cursor->current_order = (order == 0) ? -1 : order;
+	return( cursor->current_order);
+}
+
+/**************************
+ * image_predict_next
+ * Same as predict_next(), on the image.
+ * RETURNS: the most likely next symbol
+ */
+unsigned char image_predict_next( IMAGE_CURSOR *cursor, STRING16_VIEW *context_string, STRUCT_PREDICTION *results ){
+	image_traverse( cursor, context_string);
+	if (cursor->current_order < 0)
+		cursor->current_order = 0;
+	return( image_predict_in_context( cursor, cursor->current_order, results));
+}
+
+/**************************
+ * image_predict_in_context
+ * Same as predict_in_context(): the second half of
+ * image_predict_next(), once the contexts have been found.
+ * RETURNS: the most likely next symbol
+ */
+unsigned char image_predict_in_context( IMAGE_CURSOR *cursor, int order, STRUCT_PREDICTION *results ){
+	MODEL_IMAGE *image = cursor->image;
+	const IMAGE_NODE *node;
+	const IMAGE_ENTRY *entries;
+	int i;
+	int max_counts;
+
+	if (order < 0)
+		order = 0;
+	node = &image->nodes[ cursor->contexts[ order ] ];
+	entries = image->entries + node->first;
+	results->depth = order;
+
+	// The denominator is the sum of all the counts plus the number of
+	// entries (less one for the order 0 table), as in predict_next().
+	results->prob_denominator = node->total +
+			((order == 0) ? node->count - 1 : node->count);
+	results->num_predictions = 0;
+	if (node->count == 0)
+		return( 0);
+	max_counts = entries[ 0 ].counts;
+	for (i = 0;
+			i < node->count &&
+			entries[ i ].counts == max_counts &&
+			i < MAX_NUM_PREDICTIONS;
+			i++) {
+		results->sym[ i ].symbol = entries[ i ].symbol;
+		results->sym[ i ].prob_numerator = entries[ i ].counts;
+	}
+	results->num_predictions = i;
+	return( results->sym[ 0 ].symbol);
+}
+
+/* image_clear_scoreboard
+ * Same as clear_scoreboard(): start a new scoreboard epoch.
+ */
+void image_clear_scoreboard( IMAGE_CURSOR *cursor ){
+	if (++cursor->epoch == 0) {
+		memset( cursor->scoreboard, 0, sizeof( cursor->scoreboard));
+		cursor->epoch = 1;
+	}
+}
+
+/* image_totalize
+ * Same as totalize_table(): build the cumulative totals for a node,
+ * leaving out symbols on the scoreboard, and then put this node's
+ * symbols on the scoreboard.
+ */
+void image_totalize( IMAGE_CURSOR *cursor, int node ){
+	MODEL_IMAGE *image = cursor->image;
+	const IMAGE_ENTRY *entries;
+	short int *totals = cursor->totals;
+	int count;
+	int shift = 0;
+	int counts;
+	int i;
+	unsigned char max;
+
+	entries = image->entries + image->nodes[ node ].first;
+	count = image->nodes[ node ].count;
+	for ( ; ; ) {
+		max = 0;
+		i = count + 1;
+		totals[ i ] = 0;
+		for ( ; i > 1; i--) {
+			totals[ i-1 ] = totals[ i ];
+			counts = entries[ i-2 ].counts >> shift;
+			if (counts)
+				if (!ON_SCOREBOARD( entries[ i-2 ].symbol) ||
+						!SCOREBOARD_HAS( cursor, entries[ i-2 ].symbol))
+					totals[ i-1 ] += counts;
+			if (counts > max)
+				max = counts;
+		}
+		if (max == 0)
+			totals[ 0 ] = 1;
+		else if (cursor->current_order == 0)
+			totals[ 0 ] = totals[ 1 ] + count - 1;
+		else
+			totals[ 0 ] = totals[ 1 ] + count;
+		if (totals[ 0 ] < MAXIMUM_SCALE)
+			break;
+		// Rescale: halve the counts, and drop zero counts off the end of a leaf
+		shift++;
+		if (!image->nodes[ node ].has_links)
+			while (count > 0 && (entries[ count-1 ].counts >> shift) == 0)
+				count--;
+	}
+	for (i = 0; i < count - 1; i++)
+		if ((entries[ i ].counts >> shift) != 0 && ON_SCOREBOARD( entries[ i ].symbol))
+			SCOREBOARD_ADD( cursor, entries[ i ].symbol);
+}
+
+/* image_convert_int_to_symbol
+ * Same as convert_int_to_symbol(), for the node at current_order.
+ * RETURNS: 0 if the symbol was found, 1 for an ESCAPE (and the
+ * current order is decremented).
+ */
+int image_convert_int_to_symbol( IMAGE_CURSOR *cursor, SYMBOL_TYPE c, SYMBOL *s ){
+	MODEL_IMAGE *image = cursor->image;
+	int node;
+	int i;
+
+	node = cursor->contexts[ cursor->current_order ];
+	image_totalize( cursor, node);
+	s->scale = cursor->totals[ 0 ];
+	i = image_find_symbol( image, node, c);
+	if (i >= 0 && image->entries[ image->nodes[ node ].first + i ].counts != 0) {
+		s->low_count = cursor->totals[ i+2 ];
+		s->high_count = cursor->totals[ i+1 ];
+		return( 0);
+	}
+	s->low_count = cursor->totals[ 1 ];
+	s->high_count = cursor->totals[ 0 ];
+	cursor->current_order--;
+	return( 1);
+}
+
+/*******************************************
+ * image_compute_logloss
+ * Same as compute_logloss(), on the image: one walk along the
+ * test string, and the escapes go down the lesser nodes.
+ * RETURNS: the average log-loss over the test string
+ * *********************************************/
+float image_compute_logloss( IMAGE_CURSOR *cursor, STRING16 *test_string, int verbose ){
+	double summation;
+
+	image_start_context( cursor);
+	summation = image_logloss_sum( cursor, test_string, 0, 0, verbose);
+	return( average_logloss( summation, strlen16( test_string), verbose));
+}
+
+/*******************************************
+ * image_compute_logloss_file
+ * Same as compute_logloss_file(): the test file is read a chunk at
+ * a time, and the walk carries on from one chunk to the next.
+ * RETURNS: the average log-loss over the test file, or -1 if there
+ * 		wasn't memory to read it with
+ * *********************************************/
+float image_compute_logloss_file( IMAGE_CURSOR *cursor, FILE *test_file, int verbose ){
+	STRING16 *chunk;
+	int n;
+	long length = 0;
+	double summation = 0.0;
+
+	chunk = string16( MAX_STRING_LENGTH+1);
+	if (chunk == NULL)
+		return( -1);
+	image_start_context( cursor);
+	while ((n = fread16_chunk( chunk, cursor->image->max_order, MAX_STRING_LENGTH, test_file)) > 0) {
+		summation += image_logloss_sum( cursor, chunk, strlen16( chunk) - n, length, verbose);
+		length += n;
+	}
+	delete_string16( chunk);
+	return( average_logloss( summation, length, verbose));
+}
+
+/*******************************************
+ * image_logloss_sum
+ * Same as logloss_sum(): add up log2(P()) for the symbols from
+ * start on, carrying on from where the cursor is.
+ * *********************************************/
+double image_logloss_sum( IMAGE_CURSOR *cursor, STRING16 *test_string, int start, long position, int verbose ){
+	MODEL_IMAGE *image = cursor->image;
+	int i;
+	int length;
+	int context_length;		// number of symbols before the test symbol
+	int order;				// order of the node being used
+	int node;				// and the node
+	SYMBOL s;
+	int escaped;
+	double prob_numerator, prob_denominator;
+	float fl_prob;
+	double bits;
+	double summation = 0.0;
+	STRING16_VIEW str_sub;	// context window (a slice of test_string)
+
+	length = strlen16( test_string);
+	for (i = start; i < length; i++, position++) {
+		context_length = (position < image->max_order) ? position : image->max_order;
+		order = cursor->current_order;
+		node = cursor->contexts[ order ];
+		prob_numerator = 1;
+		prob_denominator = 1;
+		image_clear_scoreboard( cursor);
+		if (verbose) {
+			str_sub = view16( test_string, i - context_length, context_length);
+			printf("\t%ld: log2(P(0x%04x|\"%s\")",
+					position, get_symbol( test_string, i), format_view16( &str_sub));
+		}
+		for (;;) {
+			cursor->current_order = order;
+			cursor->contexts[ order ] = node;
+			escaped = image_convert_int_to_symbol( cursor, get_symbol( test_string, i), &s);
+			if (s.scale != 0) {
+				prob_numerator *= (s.high_count - s.low_count);
+				prob_denominator *= s.scale;
+			}
+			if (!escaped || order <= 1)
+				break;
+			node = image->nodes[ node ].lesser;
+			order--;
+		}
+		fl_prob = (float) prob_numerator / (float) prob_denominator;
+		bits = log2( fl_prob);
+		summation += bits;
+		if (verbose)
+			printf("= %f\n", bits);
+		image_advance_context( cursor, get_symbol( test_string, i), image->max_order);
+	}
+	return( summation);
+}
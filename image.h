@@ -0,0 +1,120 @@
+/**************************************************
+ * image.h
+ *
+ * A frozen, read-only copy of a trained model that can be
+ * mapped straight into memory from a file and used without
+ * rebuilding the trie.  Tables refer to each other by number
+ * instead of by pointer, so the file is used exactly as it
+ * sits on the disk, and processes that map the same image
+ * share its pages.
+ *
+ * The file is written by freeze_model() (model-2.c) and is
+ * laid out as:
+ *
+ *     IMAGE_HEADER
+ *     IMAGE_NODE    nodes[ num_nodes ]
+ *     IMAGE_ENTRY   entries[ num_entries ]
+ *     IMAGE_KEY     keys[ num_entries ]
+ *
+ * Each node is one CONTEXT table.  Its entries are
+ * entries[ first .. first+count-1 ], in the same order as the
+ * stats array (highest counts first), and keys[] over the same
+ * range holds the symbols sorted by value, so they can be found
+ * with a binary search.  The null (order -1) table is saved as
+ * a node too, so logloss can fall back to it.
+ *
+ * The image is in the machine's own byte order, and is limited
+ * to 2GB.
+ *
+ * ************************************************/
+
+#ifndef IMAGE_H_
+#define IMAGE_H_
+
+#include <stddef.h>		// for size_t
+#include "model.h"
+
+#define IMAGE_MAGIC			"PMELTIMG"
+#define IMAGE_VERSION		1
+#define IMAGE_BYTE_ORDER	0x01020304
+
+typedef struct {
+	char magic[ 8 ];
+	int version;
+	int byte_order;
+	int max_order;			// order the model was trained with
+	int num_nodes;
+	int num_entries;
+	int root;				// node number of the order 0 table
+	int null_node;			// node number of the order -1 table
+	int nodes_offset;		// byte offsets from the start of the image
+	int entries_offset;
+	int keys_offset;
+	int image_size;			// size of the whole image, in bytes
+} IMAGE_HEADER;
+
+typedef struct {
+	int first;				// index of the node's first entry
+	int count;				// number of entries (max_index + 1)
+	int lesser;				// node number of the lesser context, -1 for none
+	int has_links;			// true if the table had a links array
+	int total;				// sum of the counts of all entries
+} IMAGE_NODE;
+
+typedef struct {
+	SYMBOL_TYPE symbol;
+	short pad;
+	int counts;
+	int next;				// node number of the next order table, -1 for none
+} IMAGE_ENTRY;
+
+typedef struct {
+	SYMBOL_TYPE symbol;
+	short pad;
+	int index;				// position of the symbol in the node's entries
+} IMAGE_KEY;
+
+/* An open image.  This is never changed once it's open. */
+typedef struct {
+	const IMAGE_HEADER *header;
+	const IMAGE_NODE *nodes;
+	const IMAGE_ENTRY *entries;
+	const IMAGE_KEY *keys;
+	void *base;				// the mapping (or buffer) holding the image
+	size_t size;
+	int mapped;				// true if base is a memory mapping
+	int max_order;
+} MODEL_IMAGE;
+
+/*
+ * The working state for queries on an image, the same as a
+ * MODEL_CURSOR is for a live model.  Each thread needs its own.
+ */
+typedef struct {
+	MODEL_IMAGE *image;
+	int context_nodes[ MAX_DEPTH + 1 ];
+	int *contexts;			// contexts[ -1 .. max_order ], node numbers
+	int current_order;
+	int walk_node;			// where image_advance_context() is, and its order
+	int walk_order;
+	short int totals[ RANGE_OF_SYMBOLS+2 ];
+	unsigned short epoch;		// scoreboard epoch, as in a MODEL_CURSOR
+	unsigned short scoreboard[ RANGE_OF_SYMBOLS ];
+} IMAGE_CURSOR;
+
+/* Function Prototypes */
+MODEL_IMAGE * open_image( char *file_name );
+void close_image( MODEL_IMAGE *image );
+IMAGE_CURSOR * image_cursor( MODEL_IMAGE *image );
+void delete_image_cursor( IMAGE_CURSOR *cursor );
+void image_traverse( IMAGE_CURSOR *cursor, STRING16_VIEW *context_string );
+void image_start_context( IMAGE_CURSOR *cursor );
+int image_advance_context( IMAGE_CURSOR *cursor, SYMBOL_TYPE c, int max_order );
+void image_clear_scoreboard( IMAGE_CURSOR *cursor );
+unsigned char image_predict_next( IMAGE_CURSOR *cursor, STRING16_VIEW *context_string, STRUCT_PREDICTION *results );
+unsigned char image_predict_in_context( IMAGE_CURSOR *cursor, int order, STRUCT_PREDICTION *results );
+float image_compute_logloss( IMAGE_CURSOR *cursor, STRING16 *test_string, int verbose );
+float image_compute_logloss_file( IMAGE_CURSOR *cursor, FILE *test_file, int verbose );
+double image_logloss_sum( IMAGE_CURSOR *cursor, STRING16 *test_string, int start, long position, int verbose );
+
+#endif /*IMAGE_H_*/
@@ -0,0 +1,133 @@
+/*******************************************************
+ * ingest.c
+ *
+ * Loads a whole binary training file into memory so that the
+ * model can be trained from one contiguous array of symbols
+ * (see ingest.h).  On systems with mmap() the file is mapped
+ * read-only; otherwise, or if the mapping fails (pipes, for
+ * example), it is read in INGEST_BLOCK_SIZE blocks.
+ *
+ * *****************************************************/
+#include <stdlib.h>			// for malloc(), realloc(), free()
+#include <string.h>			// for memset()
+#include <stdio.h>
+#include "model.h"			// for DONE (through coder.h)
+#include "ingest.h"
+
+#if defined(__unix__) || defined(__CYGWIN__) || defined(__APPLE__)
+#define HAVE_MMAP
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
+
+/* Local procedures */
+int read_symbol_span( SYMBOL_SPAN *span, FILE *src_file );
+void validate_symbol_span( SYMBOL_SPAN *span );
+
+/* load_symbol_span
+ * Load the rest of src_file into span.
+ * RETURNS: 0 on success, -1 if the file couldn't be read.
+ */
+int load_symbol_span( SYMBOL_SPAN *span, FILE *src_file ){
+#ifdef HAVE_MMAP
+	struct stat st;
+	void *map;
+	long offset;
+#endif
+
+	memset( span, 0, sizeof( SYMBOL_SPAN));
+#ifdef HAVE_MMAP
+	offset = ftell( src_file);
+	if (offset == 0 &&
+			fstat( fileno( src_file), &st) == 0 &&
+			S_ISREG( st.st_mode) && st.st_size > 0) {
+		map = mmap( NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fileno( src_file), 0);
+		if (map != MAP_FAILED) {
+#ifdef MADV_SEQUENTIAL
+			madvise( map, (size_t) st.st_size, MADV_SEQUENTIAL);
+#endif
+			span->s = (SYMBOL_TYPE *) map;
+			span->size = (size_t) st.st_size;
+			span->mapped = true;
+			validate_symbol_span( span);
+			return( 0);
+		}
+	}
+#endif
+	if (read_symbol_span( span, src_file) != 0)
+		return( -1);
+	validate_symbol_span( span);
+	return( 0);
+}
+
+/* read_symbol_span
+ * Read the file into a malloc'd buffer, INGEST_BLOCK_SIZE bytes at a time.
+ */
+int read_symbol_span( SYMBOL_SPAN *span, FILE *src_file ){
+	char *buffer = NULL;
+	char *new_buffer;
+	size_t allocated = 0;
+	size_t used = 0;
+	size_t n;
+
+	for ( ; ; ) {
+		if (allocated - used < INGEST_BLOCK_SIZE) {
+			allocated = allocated ? 2 * allocated : INGEST_BLOCK_SIZE;
+			new_buffer = (char *) realloc( buffer, allocated);
+			if (new_buffer == NULL) {
+				free( buffer);
+				return( -1);
+			}
+			buffer = new_buffer;
+		}
+		n = fread( buffer + used, 1, INGEST_BLOCK_SIZE, src_file);
+		used += n;
+		if (n < INGEST_BLOCK_SIZE)
+			break;
+	}
+	if (ferror( src_file)) {
+		free( buffer);
+		return( -1);
+	}
+	span->s = (SYMBOL_TYPE *) buffer;
+	span->size = used;
+	span->mapped = false;
+	return( 0);
+}
+
+/* validate_symbol_span
+ * Make one pass over the symbols.  Training stops at the first DONE
+ * symbol, just like it did when the file was read a symbol at a time,
+ * and a partial symbol at the end of the file (usually a linefeed) is
+ * dropped.  Other negative symbols are counted, since the model
+ * ignores them.
+ */
+void validate_symbol_span( SYMBOL_SPAN *span ){
+	long i;
+
+	span->file_symbols = (long) (span->size / sizeof( SYMBOL_TYPE));
+	span->trailing_bytes = (int) (span->size % sizeof( SYMBOL_TYPE));
+	span->skipped_symbols = 0;
+	for (i = 0; i < span->file_symbols; i++) {
+		if (span->s[ i ] >= 0)
+			continue;
+		if (span->s[ i ] == DONE)
+			break;
+		span->skipped_symbols++;
+	}
+	span->length = i;
+}
+
+/* free_symbol_span - unmap or free the symbols */
+void free_symbol_span( SYMBOL_SPAN *span ){
+#ifdef HAVE_MMAP
+	if (span->mapped) {
+		munmap( (void *) span->s, span->size);
+		span->s = NULL;
+		return;
+	}
+#endif
+	free( span->s);
+	span->s = NULL;
+}
@@ -0,0 +1,34 @@
+/**************************************************
+ * ingest.h
+ *
+ * Bulk loading of binary training files.  Instead of reading
+ * the file one symbol at a time, the whole file is mapped into
+ * memory (or read in large blocks where that isn't possible),
+ * checked once, and handed to the model as one contiguous
+ * array of symbols.
+ *
+ * ************************************************/
+
+#ifndef INGEST_H_
+#define INGEST_H_
+
+#include <stdio.h>		// for FILE
+#include "string16.h"	// for SYMBOL_TYPE
+
+#define INGEST_BLOCK_SIZE	( 1024 * 1024 )	// bytes per read when the file can't be mapped
+
+typedef struct {
+	SYMBOL_TYPE *s;			// the symbols (points into the mapping or buffer)
+	long length;			// number of symbols to train on
+	long file_symbols;		// number of whole symbols in the file
+	long skipped_symbols;	// negative symbols, which the model ignores
+	int trailing_bytes;		// bytes at the end of the file that aren't a whole symbol
+	int mapped;				// true if s points to a memory mapping of the file
+	size_t size;			// size of the mapping or buffer, in bytes
+} SYMBOL_SPAN;
+
+/* Function Prototypes */
+int load_symbol_span( SYMBOL_SPAN *span, FILE *src_file );
+void free_symbol_span( SYMBOL_SPAN *span );
+
+#endif /*INGEST_H_*/
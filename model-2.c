@@ -10,131 +10,231 @@
  *
  * Each context is stored in a special CONTEXT structure, which is
  * documented below.  Context tables are not created until the
- * context is seen, and they are never destroyed.
+ * context is seen, and they are never destroyed, unless the model
+ * has been set up to decay (see set_model_decay()).
  *
  */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>	// for isprint() declaration
-#include <math.h>		// for log10() function;
+#include <math.h>		// for log2() function;
 #include "coder.h"
 #include "model.h"
 #include "string16.h"	// for handling 16-bit char 'strings'
+#include "arena.h"		// for the model's memory arena
+#include "image.h"		// for freeze_model()
+#include "counters.h"	// for COUNT()
 /*
- * max_order is the maximum order that will be maintained by this
- * program.  EXPAND-2 and COMP-2 both will modify this int based
- * on command line parameters.
+ * There are no global variables in this module.  Everything that
+ * belongs to a model (its tables, the current training contexts and
+ * order, and the arena its memory comes from) is kept in a MODEL, and
+ * the scratch space used while looking things up in a model (the
+ * contexts[] found by traverse_tree(), the order being used, and the
+ * totals[] and scoreboard[] arrays) is kept in a MODEL_CURSOR.  See
+ * model.h for the details.  Each thread that queries a model needs a
+ * cursor of its own.
  */
-int max_order=3;
 /*
- * *contexts[] is an array of current contexts.  If I want to find
- * the order 0 context for the current state of the model, I just
- * look at contexts[0].  This array of context pointers is set up
- * every time the model is updated.
+ * Smallest number of entries allocated for a stats/links array,
+ * once a table has outgrown its INLINE_SYMBOLS (see model.h).  The
+ * arrays double in size from there.
  */
-CONTEXT **contexts;
+#define MIN_TABLE_CAPACITY	2
 /*
- * current_order contains the current order of the model.  It starts
- * at max_order, and is decremented every time an ESCAPE is sent.  It
- * will only go down to -1 for normal symbols, but can go to -2 for
- * EOF and FLUSH.
+ * Tables with fewer than HASH_THRESHOLD symbols are searched linearly,
+ * bigger ones get a hash index (see the CONTEXT comments in model.h).
+ * The index is kept at most half full.
  */
-int current_order;
+#define HASH_THRESHOLD	8
 /*
- * This variable tells COMP-2.C that the FLUSH symbol can be
- * sent using this model.
+ * Tables with DENSE_THRESHOLD symbols or more get a dense index
+ * instead, unless too many of their symbols are outside its range.
+ * A dense index takes a 16K block from the arena, as much as a hash
+ * index for 512 - 1023 symbols, but only the root and the busiest
+ * order-1 tables get this big.
  */
-int flushing_enabled=0;
+#define DENSE_THRESHOLD	256
+#define HASH_SYMBOL( s )	( ( (unsigned int) (unsigned short) (s) * 2654435761u ) >> 16 )
 /*
- * This table contains the cumulative totals for the current context.
- * Because this program is using exclusion, totals has to be calculated
- * every time a context is used.  The scoreboard array keeps track of
- * symbols that have appeared in higher order models, so that they
- * can be excluded from lower order context total calculations.
+ * A model with a memory limit starts decaying once DECAY_LOW_WATER of
+ * the limit is in use, at DECAY_MIN_BURST tables per symbol.  While it
+ * is over the limit, the number of tables per symbol doubles with each
+ * symbol, up to DECAY_MAX_BURST, and after each symbol it keeps going
+ * (up to DECAY_MAX_BURST more tables) until it is back under the limit.
  */
-short int totals[ RANGE_OF_SYMBOLS+2 ];
-char scoreboard[ RANGE_OF_SYMBOLS ];
-int alloc_count=0;		// number of CONTEXT structs allocated.
+#define DECAY_LOW_WATER( limit )	( (limit) - (limit) / 4 )
+#define DECAY_MIN_BURST	16
+#define DECAY_MAX_BURST	4096
+/*
+ * predict_next_batch() works on up to PREDICT_LANES context strings
+ * at a time, and PREFETCH() asks for memory it will need on its next
+ * pass through them.  That only pays when the lookups miss the cache:
+ * with a model smaller than PREDICT_BATCH_MIN_BYTES, or only one
+ * string, it is slower than calling predict_next() (0.4 - 0.9 times
+ * the speed in bench_batch), so it does that instead.
+ */
+#define PREDICT_LANES	16
+#define PREDICT_BATCH_MIN_BYTES	( 4 * 1024 * 1024 )
+#if defined( __GNUC__ )
+#define PREFETCH( p )	__builtin_prefetch( p )
+#else
+#define PREFETCH( p )
+#endif
+
+/*
+ * One context string being looked up by predict_next_batch().  table
+ * is the table for the longest suffix of the first pos symbols that is
+ * in the model, and order is its order.  child is a table that the
+ * next symbol leads to, which is only taken once it has been checked
+ * that it isn't empty.
+ */
+typedef struct {
+    SYMBOL_TYPE *s;
+    int length;
+    int pos;
+    int order;
+    CONTEXT *table;
+    CONTEXT *child;
+} PREDICT_LANE;
 
 
 /*
  * Local procedure declarations.
  */
 void error_exit( char *message );
-void update_table( CONTEXT *table, SYMBOL_TYPE symbol );
-void rescale_table( CONTEXT *table );
-void totalize_table( CONTEXT *table );
-CONTEXT *shift_to_next_context( CONTEXT *table, SYMBOL_TYPE c, int order);
-CONTEXT *allocate_next_order_table( CONTEXT *table,
+void update_table( MODEL *model, CONTEXT *table, SYMBOL_TYPE symbol );
+void rescale_table( MODEL *model, CONTEXT *table );
+void totalize_table( MODEL_CURSOR *cursor, CONTEXT *table );
+CONTEXT *shift_to_next_context( MODEL *model, CONTEXT *table, SYMBOL_TYPE c, int order);
+CONTEXT *allocate_next_order_table( MODEL *model,
+                                    CONTEXT *table,
                                     SYMBOL_TYPE symbol,
                                     CONTEXT *lesser_context );
+CONTEXT *new_context( MODEL *model );
+void grow_table( MODEL *model, CONTEXT *table, int need_links );
+void resize_table( MODEL *model, CONTEXT *table, int new_capacity );
+int find_symbol( CONTEXT *table, SYMBOL_TYPE symbol );
+int *find_slot( CONTEXT *table, SYMBOL_TYPE symbol );
+void index_symbol( MODEL *model, CONTEXT *table, int index );
+void rebuild_index( MODEL *model, CONTEXT *table );
+void free_index( MODEL *model, CONTEXT *table );
+int reclaimable( MODEL *model, CONTEXT *table );
+CONTEXT *follow_suffix( CONTEXT *table, int *order, SYMBOL_TYPE c );
+int lane_step( PREDICT_LANE *lane );
+void lane_miss( PREDICT_LANE *lane );
+void free_context( MODEL *model, CONTEXT *table );
+void decay_model( MODEL *model );
+int decay_step( MODEL *model );
+MODEL *create_model( int max_order );
+void fill_null_table( MODEL *model, CONTEXT *null_table );
+CONTEXT *create_control_table( MODEL *model );
 
 /*
  * This routine has to get everything set up properly so that
  * the model can be maintained properly.  The first step is to create
- * the *contexts[] array used later to find current context tables.
+ * the MODEL, with its arena and the *contexts[] array used later to
+ * find current context tables.
  * The *contexts[] array indices go from -2 up to max_order, so
  * the table needs to be fiddled with a little.  This routine then
  * has to create the special order -2 and order -1 tables by hand,
  * since they aren't quite like other tables.  Then the current
  * context is set to \0, \0, \0, ... and the appropriate tables
  * are built to support that context.  The current order is set
- * to max_order, the scoreboard is cleared, and the system is
- * ready to go.
+ * to max_order, and the system is ready to go.
  */
 
-void initialize_model()
+MODEL *initialize_model( int max_order )
 {
     int i;
+    MODEL *model;
     CONTEXT *null_table;
-    CONTEXT *control_table;
 
-    current_order = max_order;
-    contexts = (CONTEXT **) calloc( sizeof( CONTEXT * ), 10 );
-    alloc_count += 10;
-    if ( contexts == NULL )
-        error_exit( "Failure #1: allocating context table!" );
-    contexts += 2;
-    null_table = (CONTEXT *) calloc( sizeof( CONTEXT ), 1 );
-    alloc_count++;
-    if ( null_table == NULL )
-        error_exit( "Failure #2: allocating null table!" );
-    null_table->max_index = -1;
-    contexts[ -1 ] = null_table;
-    for ( i = 0 ; i <= max_order ; i++ )
-        contexts[ i ] = allocate_next_order_table( contexts[ i-1 ],
+    model = create_model( max_order );
+    null_table = new_context( model );
+    model->contexts[ -1 ] = null_table;
+    for ( i = 0 ; i <= model->max_order ; i++ )
+        model->contexts[ i ] = allocate_next_order_table( model, model->contexts[ i-1 ],
                                                0,
-                                               contexts[ i-1 ] );
-    alloc_count += max_order;
-    handle_free( (char __handle *) null_table->stats );
-    null_table->stats =
-         (STATS __handle *) handle_calloc( sizeof( STATS ) * 256 );
-    if ( null_table->stats == NULL )
-        error_exit( "Failure #3: allocating null table!" );
+                                               model->contexts[ i-1 ] );
+    model->alloc_count += model->max_order;
+    fill_null_table( model, null_table );
+    model->contexts[ -2 ] = create_control_table( model );
+    return( model );
+}
+
+/*
+ * create_model
+ *
+ * Create an empty MODEL, the arena that holds it, and its *contexts[]
+ * array, which is offset by 2 so that it can be indexed from -2 to
+ * max_order.
+ */
+MODEL *create_model( int max_order )
+{
+    MODEL *model;
+
+    model = (MODEL *) calloc( sizeof( MODEL ), 1 );
+    if ( model == NULL )
+        error_exit( "Failure #13: creating model arena!" );
+    model->max_order = max_order;
+    model->current_order = max_order;
+    model->arena = arena_create( ARENA_CHUNK_SIZE );
+    if ( model->arena == NULL )
+        error_exit( "Failure #13: creating model arena!" );
+    model->contexts = (CONTEXT **) arena_alloc( model->arena, sizeof( CONTEXT * ) * 10 );
+    model->alloc_count += 10;
+    if ( model->contexts == NULL )
+        error_exit( "Failure #1: allocating context table!" );
+    model->contexts += 2;
+    return( model );
+}
+
+/*
+ * fill_null_table
+ *
+ * The order -1 table has every symbol from 0 to 255 with a count
+ * of 1.  Its only link is links[ 0 ], which has to be pointing to
+ * the order 0 table before this is called.
+ */
+void fill_null_table( MODEL *model, CONTEXT *null_table )
+{
+    int i;
+
+    resize_table( model, null_table, 256 );
     null_table->max_index = 255;
     for ( i=0 ; i < 256 ; i++ )
     {
         null_table->stats[ i ].symbol = (unsigned char) i;
         null_table->stats[ i ].counts = 1;
     }
+    null_table->total_counts = 256;
+    rebuild_index( model, null_table );
+}
 
-    control_table = (CONTEXT *) calloc( sizeof(CONTEXT), 1 );
-    if ( control_table == NULL )
-        error_exit( "Failure #4: allocating null table!" );
-    alloc_count++;
+/*
+ * create_control_table
+ *
+ * Build the order -2 table, which only holds the FLUSH and DONE
+ * symbols (stored as negative numbers).
+ */
+CONTEXT *create_control_table( MODEL *model )
+{
+    CONTEXT *control_table;
+
+    control_table = new_context( model );
     control_table->stats =
-         (STATS __handle *) handle_calloc( sizeof( STATS ) * 2 );
+         (STATS __handle *) arena_block_alloc( model->arena, sizeof( STATS ) * 2 );
     if ( control_table->stats == NULL )
         error_exit( "Failure #5: allocating null table!" );
-    contexts[ -2 ] = control_table;
+    control_table->capacity = 2;
     control_table->max_index = 1;
     control_table->stats[ 0 ].symbol = -FLUSH;
     control_table->stats[ 0 ].counts = 1;
     control_table->stats[ 1 ].symbol =- DONE;
     control_table->stats[ 1 ].counts = 1;
-
-    clear_scoreboard();
+    control_table->total_counts = 2;
+    return( control_table );
 }
 /*
  * This is a utility routine used to create new tables when a new
@@ -152,48 +252,29 @@ void initialize_model()
  * modifying the stats and links fields in the current context.
  */
 
-CONTEXT *allocate_next_order_table( CONTEXT *table,
+CONTEXT *allocate_next_order_table( MODEL *model,
+                                    CONTEXT *table,
                                     SYMBOL_TYPE symbol,
                                     CONTEXT *lesser_context )
 {
     CONTEXT *new_table;
     int i;
-    unsigned int new_size;
 
-    for ( i = 0 ; i <= table->max_index ; i++ )
-        if ( table->stats[ i ].symbol == symbol )
-            break;
-    if ( i > table->max_index )
+    i = find_symbol( table, symbol );
+    if ( i < 0 )
     {
-        table->max_index++;
-        new_size = sizeof( LINKS );
-        new_size *= table->max_index + 1;
-        if ( table->links == NULL )
-            table->links = (LINKS __handle *) handle_calloc( new_size );
-        else
-            table->links = (LINKS __handle *)
-                 handle_realloc( (char __handle *) table->links, new_size );
-        new_size = sizeof( STATS );
-        new_size *= table->max_index + 1;
-        if ( table->stats == NULL )
-            table->stats = (STATS __handle *) handle_calloc( new_size );
-        else
-            table->stats = (STATS __handle *)
-                handle_realloc( (char __handle *) table->stats, new_size );
-        if ( table->links == NULL )
-            error_exit( "Failure #6: allocating new table" );
-        if ( table->stats == NULL )
-            error_exit( "Failure #7: allocating new table" );
+        i = ++table->max_index;
+        grow_table( model, table, true );
         table->stats[ i ].symbol = symbol;
         table->stats[ i ].counts = 0;
+        index_symbol( model, table, i );
     }
-    new_table = (CONTEXT *) calloc( sizeof( CONTEXT ), 1 );
-    alloc_count++;
-    if ( new_table == NULL )
-        error_exit( "Failure #8: allocating new table" );
-    new_table->max_index = -1;
+    else if ( table->links == NULL )
+        grow_table( model, table, true );
+    new_table = new_context( model );
     table->links[ i ].next = new_table;
     new_table->lesser_context = lesser_context;
+    lesser_context->lesser_refs++;
     return( new_table );
 }
 
@@ -213,14 +294,14 @@ CONTEXT *allocate_next_order_table( CONTEXT *table,
  * 'abracadabra' the counts end up as 'a'=4, 'b'=1, 'r'=1, 'c'=1, 'd'=1
  *
  */
-void update_model( SYMBOL_TYPE symbol )
+void update_model( MODEL *model, SYMBOL_TYPE symbol )
 {
     int local_order;
 
-    if ( current_order < 0 )
+    if ( model->current_order < 0 )
         local_order = 0;
     else
-        local_order = current_order;
+        local_order = model->current_order;
 
     //Ingrid: Override his code
     local_order = 0;		// Ingrid
@@ -229,15 +310,14 @@ void update_model( SYMBOL_TYPE symbol )
 
     if ( symbol >= 0 )
     {
-        while ( local_order <= max_order )
+        while ( local_order <= model->max_order )
         {
             if ( symbol >= 0 )
-                update_table( contexts[ local_order ], symbol );
+                update_table( model, model->contexts[ local_order ], symbol );
             local_order++;
         }
     }
-    current_order = max_order;
-    clear_scoreboard();
+    model->current_order = model->max_order;
 }
 /*
  * This routine is called to update the count for a particular symbol
@@ -254,48 +334,26 @@ void update_model( SYMBOL_TYPE symbol )
  * bytes, if the count reaches 255, the table absolutely must be rescaled
  * to get the counts back down to a reasonable level.
  */
-void update_table( CONTEXT *table, SYMBOL_TYPE symbol )
+void update_table( MODEL *model, CONTEXT *table, SYMBOL_TYPE symbol )
 {
     int i;
     int index;
     SYMBOL_TYPE temp;
     CONTEXT *temp_ptr;
-    unsigned int new_size;
 /*
  * First, find the symbol in the appropriate context table.  The first
  * symbol in the table is the most active, so start there.
  */
-    index = 0;
-    while ( index <= table->max_index &&
-            table->stats[index].symbol != symbol )
-        index++;
-    if ( index > table->max_index )
+    index = find_symbol( table, symbol );
+    if ( index < 0 )
     {
-        table->max_index++;
-        new_size = sizeof( LINKS );
-        new_size *= table->max_index + 1;
-        if ( current_order < max_order )
-        {
-            if ( table->max_index == 0 )
-                table->links = (LINKS __handle *) handle_calloc( new_size );
-            else
-                table->links = (LINKS __handle *)
-                   handle_realloc( (char __handle *) table->links, new_size );
-            if ( table->links == NULL )
-                error_exit( "Error #9: reallocating table space!" );
+        index = ++table->max_index;
+        grow_table( model, table, model->current_order < model->max_order );
+        if ( table->links != NULL )
             table->links[ index ].next = NULL;
-        }
-        new_size = sizeof( STATS );
-        new_size *= table->max_index + 1;
-        if (table->max_index==0)
-            table->stats = (STATS __handle *) handle_calloc( new_size );
-        else
-            table->stats = (STATS __handle *)
-                handle_realloc( (char __handle *) table->stats, new_size );
-        if ( table->stats == NULL )
-            error_exit( "Error #10: reallocating table space!" );
         table->stats[ index ].symbol = symbol;
         table->stats[ index ].counts = 0;
+        index_symbol( model, table, index );
     }
 /*
  * Now I move the symbol to the front of its list.
@@ -306,6 +364,11 @@ void update_table( CONTEXT *table, SYMBOL_TYPE symbol )
         i--;
     if ( i != index )
     {
+        if ( HAS_INDEX( table ) )
+        {
+            *find_slot( table, table->stats[ index ].symbol ) = i + 1;
+            *find_slot( table, table->stats[ i ].symbol ) = index + 1;
+        }
         temp = table->stats[ index ].symbol;
         table->stats[ index ].symbol = table->stats[ i ].symbol;
         table->stats[ i ].symbol = temp;
@@ -321,6 +384,7 @@ void update_table( CONTEXT *table, SYMBOL_TYPE symbol )
  * The switch has been performed, now I can update the counts
  */
     table->stats[ index ].counts++;
+    table->total_counts++;
 //    if ( table->stats[ index ].counts == 255 )	// Ingrid: removed this - it sets level 0 counts to 0
 //        rescale_table( table );
 }
@@ -334,8 +398,8 @@ void update_table( CONTEXT *table, SYMBOL_TYPE symbol )
  * OUTPUTS: current_order set to 0
  * RETURNS: void
  ************************************************/
-void clear_current_order(){
-	current_order = 0;
+void clear_current_order( MODEL *model ){
+	model->current_order = 0;
 	return;
 }
 /*
@@ -353,32 +417,28 @@ void clear_current_order(){
  * instead of unsigned chars.  This insures that no match will every
  * be found for the EOF or FLUSH symbols in any "normal" table.
  */
-int convert_int_to_symbol( SYMBOL_TYPE c, SYMBOL *s )
+int convert_int_to_symbol( MODEL_CURSOR *cursor, SYMBOL_TYPE c, SYMBOL *s )
 {
     int i;
     CONTEXT *table;
 
-    table = contexts[ current_order ];
-    totalize_table( table );
-    s->scale = totals[ 0 ];
-    if ( current_order == -2 )
+    table = cursor->contexts[ cursor->current_order ];
+    totalize_table( cursor, table );
+    s->scale = cursor->totals[ 0 ];
+    if ( cursor->current_order == -2 )
         c = -c;
-    for ( i = 0 ; i <= table->max_index ; i++ )
+    i = find_symbol( table, c );
+    if ( i >= 0 && ( table->stats[ i ].counts >> cursor->shift ) != 0 )
     {
-        if ( c == table->stats[ i ].symbol )
-        {
-            if ( table->stats[ i ].counts == 0 )
-                break;
-            s->low_count = totals[ i+2 ];
-            s->high_count = totals[ i+1 ];
-            return( 0 );
-        }
+        s->low_count = cursor->totals[ i+2 ];
+        s->high_count = cursor->totals[ i+1 ];
+        return( 0 );
     }
 
-    s->low_count = totals[ 1 ];
-    s->high_count = totals[ 0 ];
+    s->low_count = cursor->totals[ 1 ];
+    s->high_count = cursor->totals[ 0 ];
 
-    current_order--;
+    cursor->current_order--;
     return( 1 );
 }
 
@@ -389,13 +449,13 @@ int convert_int_to_symbol( SYMBOL_TYPE c, SYMBOL *s )
  * table, then building the totals table.  Once that is done, the
  * cumulative total table has the symbol scale at element 0.
  */
-void get_symbol_scale( SYMBOL *s )
+void get_symbol_scale( MODEL_CURSOR *cursor, SYMBOL *s )
 {
     CONTEXT *table;
 
-    table = contexts[ current_order ];
-    totalize_table( table );
-    s->scale = totals[ 0 ];
+    table = cursor->contexts[ cursor->current_order ];
+    totalize_table( cursor, table );
+    s->scale = cursor->totals[ 0 ];
 }
 
 /*
@@ -448,16 +508,39 @@ int convert_symbol_to_int( int count, SYMBOL *s)
  * the pointers to "CD" and "C".  The hard work was done in
  * shift_to_context().
  */
-void add_character_to_model( SYMBOL_TYPE c )
+void add_character_to_model( MODEL *model, SYMBOL_TYPE c )
 {
     int i;
-    if ( max_order < 0 || c < 0 )
+    if ( model->max_order < 0 || c < 0 )
        return;
-    contexts[ max_order ] =
-       shift_to_next_context( contexts[ max_order ],
-                              c, max_order );
-    for ( i = max_order-1 ; i > 0 ; i-- )
-        contexts[ i ] = contexts[ i+1 ]->lesser_context;
+    model->contexts[ model->max_order ] =
+       shift_to_next_context( model, model->contexts[ model->max_order ],
+                              c, model->max_order );
+    for ( i = model->max_order-1 ; i > 0 ; i-- )
+        model->contexts[ i ] = model->contexts[ i+1 ]->lesser_context;
+}
+
+/*
+ * train_model
+ *
+ * Train the model on an array of symbols, such as a training file
+ * loaded by load_symbol_span().  For each symbol the counts in all
+ * of the current contexts are updated, and then the model shifts to
+ * the new context.  A decaying model does a little of its decay work
+ * after each symbol.
+ */
+void train_model( MODEL *model, SYMBOL_TYPE *symbols, long length )
+{
+    long i;
+
+    for ( i = 0 ; i < length ; i++ )
+    {
+        clear_current_order( model );
+        update_model( model, symbols[ i ] );
+        add_character_to_model( model, symbols[ i ] );
+        if ( model->decay_interval > 0 || model->memory_limit > 0 )
+            decay_model( model );
+    }
 }
 
 /*
@@ -486,7 +569,7 @@ void add_character_to_model( SYMBOL_TYPE c )
  * the most complicated part of the modeling program, but it is
  * necessary for performance reasons.
  */
-CONTEXT *shift_to_next_context( CONTEXT *table, SYMBOL_TYPE c, int order)
+CONTEXT *shift_to_next_context( MODEL *model, CONTEXT *table, SYMBOL_TYPE c, int order)
 {
     int i;
     CONTEXT *new_lesser;
@@ -502,13 +585,9 @@ CONTEXT *shift_to_next_context( CONTEXT *table, SYMBOL_TYPE c, int order)
     table = table->lesser_context;
     if ( order == 0 )
         return( table->links[ 0 ].next );
-    for ( i = 0 ; i <= table->max_index ; i++ )
-        if ( table->stats[ i ].symbol == c )  {
-            if ( table->links[ i ].next != NULL )
-                return( table->links[ i ].next );
-            else
-                break;
-        }
+    i = find_symbol( table, c );
+    if ( i >= 0 && table->links != NULL && table->links[ i ].next != NULL )
+        return( table->links[ i ].next );
 /*
  * If I get here, it means the new context did not exist.  I have to
  * create the new context, add a link to it here, and add the backwards
@@ -517,15 +596,348 @@ CONTEXT *shift_to_next_context( CONTEXT *table, SYMBOL_TYPE c, int order)
  * creating the new back pointer isn't easy, I duck my responsibility
  * and recurse to myself in order to pick it up.
  */
-    new_lesser = shift_to_next_context( table, c, order-1 );
+    new_lesser = shift_to_next_context( model, table, c, order-1 );
 /*
  * Now that I have the back pointer for this table, I can make a call
  * to a utility to allocate the new table.
  */
-    table = allocate_next_order_table( table, c, new_lesser );
+    table = allocate_next_order_table( model, table, c, new_lesser );
+    return( table );
+}
+
+/*
+ * new_context
+ *
+ * Allocate a new, empty CONTEXT table out of the model arena.  Tables
+ * come from the arena's block pools, so the ones removed from a
+ * decaying model (see free_context()) get used again.
+ */
+CONTEXT *new_context( MODEL *model )
+{
+    CONTEXT *table;
+
+    table = (CONTEXT *) arena_block_alloc( model->arena, sizeof( CONTEXT ) );
+    model->alloc_count++;
+    if ( table == NULL )
+        error_exit( "Failure #8: allocating new table" );
+    table->max_index = -1;
+    table->total_counts = 0;
     return( table );
 }
 
+/*
+ * grow_table
+ *
+ * Called after max_index has been bumped up to make room for a new
+ * symbol.  A table's first symbol goes inline, in the CONTEXT itself,
+ * and once that's full the stats and links arrays are doubled in size
+ * every time they fill up.  If need_links is set and the table doesn't
+ * have links yet, they are added to match the stats.
+ */
+void grow_table( MODEL *model, CONTEXT *table, int need_links )
+{
+    int new_capacity;
+
+    if ( table->max_index >= table->capacity )
+    {
+        new_capacity = table->capacity ? 2 * table->capacity : INLINE_SYMBOLS;
+        if ( new_capacity > INLINE_SYMBOLS && new_capacity < MIN_TABLE_CAPACITY )
+            new_capacity = MIN_TABLE_CAPACITY;
+        resize_table( model, table, new_capacity );
+    }
+    if ( need_links && table->links == NULL )
+    {
+        if ( IS_INLINE( table ) )
+        {
+            memset( table->inline_links, 0, sizeof( table->inline_links ) );
+            table->links = table->inline_links;
+        }
+        else
+        {
+            table->links = (LINKS __handle *)
+                arena_block_alloc( model->arena, sizeof( LINKS ) * table->capacity );
+            if ( table->links == NULL )
+                error_exit( "Error #9: reallocating table space!" );
+        }
+    }
+}
+
+/*
+ * resize_table
+ *
+ * Give the stats array of a table (and its links, if it has any)
+ * room for new_capacity entries, keeping as many of the entries as
+ * fit.  A capacity of INLINE_SYMBOLS or less keeps them inline, and
+ * 0 gets rid of them altogether.  Moving the entries in or out of
+ * the CONTEXT throws away the index, whose space they share, so the
+ * caller has to rebuild it.
+ */
+void resize_table( MODEL *model, CONTEXT *table, int new_capacity )
+{
+    STATS __handle *stats;
+    LINKS __handle *links;
+    int was_inline;
+    int keep;
+
+    if ( new_capacity == table->capacity )
+        return;
+    COUNT( realloc_calls );
+    was_inline = IS_INLINE( table );
+    if ( !was_inline && new_capacity > INLINE_SYMBOLS )
+    {
+        table->stats = (STATS __handle *)
+            arena_block_realloc( model->arena, table->stats,
+                                 sizeof( STATS ) * table->capacity,
+                                 sizeof( STATS ) * new_capacity );
+        if ( table->stats == NULL )
+            error_exit( "Error #10: reallocating table space!" );
+        if ( table->links != NULL )
+        {
+            table->links = (LINKS __handle *)
+                arena_block_realloc( model->arena, table->links,
+                                     sizeof( LINKS ) * table->capacity,
+                                     sizeof( LINKS ) * new_capacity );
+            if ( table->links == NULL )
+                error_exit( "Error #9: reallocating table space!" );
+        }
+        table->capacity = new_capacity;
+        return;
+    }
+/*
+ * The entries are moving in or out of the CONTEXT (or going away).
+ */
+    if ( !was_inline )
+        free_index( model, table );
+    keep = ( new_capacity < table->capacity ) ? new_capacity : table->capacity;
+    if ( new_capacity == 0 )
+    {
+        stats = NULL;
+        links = NULL;
+    }
+    else if ( new_capacity <= INLINE_SYMBOLS )
+    {
+        stats = table->inline_stats;
+        links = ( table->links != NULL ) ? table->inline_links : NULL;
+        new_capacity = INLINE_SYMBOLS;
+    }
+    else
+    {
+        stats = (STATS __handle *) arena_block_alloc( model->arena, sizeof( STATS ) * new_capacity );
+        if ( stats == NULL )
+            error_exit( "Error #10: reallocating table space!" );
+        links = NULL;
+        if ( table->links != NULL )
+        {
+            links = (LINKS __handle *) arena_block_alloc( model->arena, sizeof( LINKS ) * new_capacity );
+            if ( links == NULL )
+                error_exit( "Error #9: reallocating table space!" );
+        }
+    }
+    if ( keep > 0 )
+    {
+        memmove( stats, table->stats, sizeof( STATS ) * keep );
+        if ( links != NULL )
+            memmove( links, table->links, sizeof( LINKS ) * keep );
+    }
+    if ( was_inline )
+    {
+        table->hash = NULL;
+        table->hash_mask = 0;
+    }
+    else
+    {
+        arena_block_free( model->arena, table->stats,
+                          sizeof( STATS ) * table->capacity );
+        arena_block_free( model->arena, table->links,
+                          sizeof( LINKS ) * table->capacity );
+    }
+    table->stats = stats;
+    table->links = links;
+    table->capacity = new_capacity;
+}
+
+/*
+ * find_symbol
+ *
+ * Return the index of symbol in the stats array of the given table,
+ * or -1 if the symbol isn't in the table.  Small tables (and inline
+ * ones) are just scanned from the top (the most active symbols are first), big
+ * tables go through the hash index, and the biggest look the symbol
+ * straight up in their dense index.
+ */
+int find_symbol( CONTEXT *table, SYMBOL_TYPE symbol )
+{
+    int i;
+    int slot;
+    int *hash;
+
+    if ( !HAS_INDEX( table ) )
+    {
+        for ( i = 0 ; i <= table->max_index ; i++ )
+            if ( table->stats[ i ].symbol == symbol )
+                return( i );
+        return( -1 );
+    }
+    hash = table->hash;
+    if ( table->hash_mask == DENSE_INDEX )
+    {
+        if ( IN_DENSE_RANGE( symbol ) )
+            return( hash[ DENSE_SLOT( symbol ) ] - 1 );
+        for ( i = 1 ; i <= hash[ DENSE_SLOTS ] ; i++ )
+            if ( table->stats[ hash[ DENSE_SLOTS + i ] - 1 ].symbol == symbol )
+                return( hash[ DENSE_SLOTS + i ] - 1 );
+        return( -1 );
+    }
+    slot = HASH_SYMBOL( symbol ) & table->hash_mask;
+    while ( hash[ slot ] != 0 )
+    {
+        if ( table->stats[ hash[ slot ] - 1 ].symbol == symbol )
+            return( hash[ slot ] - 1 );
+        slot = ( slot + 1 ) & table->hash_mask;
+    }
+    return( -1 );
+}
+
+/*
+ * find_slot
+ *
+ * Return a pointer to the index slot holding the given symbol.  The
+ * symbol has to be in the table, and the table has to have an index.
+ */
+int *find_slot( CONTEXT *table, SYMBOL_TYPE symbol )
+{
+    int slot;
+
+    if ( table->hash_mask == DENSE_INDEX )
+    {
+        if ( IN_DENSE_RANGE( symbol ) )
+            return( &table->hash[ DENSE_SLOT( symbol ) ] );
+        slot = DENSE_SLOTS + 1;
+        while ( table->stats[ table->hash[ slot ] - 1 ].symbol != symbol )
+            slot++;
+        return( &table->hash[ slot ] );
+    }
+    slot = HASH_SYMBOL( symbol ) & table->hash_mask;
+    while ( table->stats[ table->hash[ slot ] - 1 ].symbol != symbol )
+        slot = ( slot + 1 ) & table->hash_mask;
+    return( &table->hash[ slot ] );
+}
+
+/*
+ * index_symbol
+ *
+ * Add the symbol just stored at stats[index] to the index.  If the
+ * table just got big enough to need an index (or a dense one), the
+ * hash index is getting too full, or the dense index has no room
+ * left for a symbol outside its range, the whole thing is rebuilt
+ * instead.
+ */
+void index_symbol( MODEL *model, CONTEXT *table, int index )
+{
+    int slot;
+    SYMBOL_TYPE symbol = table->stats[ index ].symbol;
+
+    if ( !HAS_INDEX( table ) )
+    {
+        if ( table->max_index + 1 >= HASH_THRESHOLD )
+            rebuild_index( model, table );
+        return;
+    }
+    if ( table->hash_mask == DENSE_INDEX )
+    {
+        if ( IN_DENSE_RANGE( symbol ) )
+            table->hash[ DENSE_SLOT( symbol ) ] = index + 1;
+        else if ( table->hash[ DENSE_SLOTS ] < DENSE_SPILL )
+            table->hash[ DENSE_SLOTS + ++table->hash[ DENSE_SLOTS ] ] = index + 1;
+        else
+            rebuild_index( model, table );
+        return;
+    }
+    if ( 2 * ( table->max_index + 1 ) > table->hash_mask + 1 ||
+         table->max_index + 1 == DENSE_THRESHOLD )
+    {
+        rebuild_index( model, table );
+        return;
+    }
+    slot = HASH_SYMBOL( symbol ) & table->hash_mask;
+    while ( table->hash[ slot ] != 0 )
+        slot = ( slot + 1 ) & table->hash_mask;
+    table->hash[ slot ] = index + 1;
+}
+
+/*
+ * rebuild_index
+ *
+ * Throw away the index for a table and build a new one for the
+ * current number of symbols: a dense index if there are enough of
+ * them and no more than DENSE_SPILL are outside its range, otherwise
+ * a hash index sized for them.
+ * Tables that have dropped below HASH_THRESHOLD go back to being
+ * searched linearly, and inline tables never have an index.
+ */
+void rebuild_index( MODEL *model, CONTEXT *table )
+{
+    int i;
+    int slot;
+    int size;
+    int spill;
+
+    if ( IS_INLINE( table ) )
+        return;
+    free_index( model, table );
+    if ( table->max_index + 1 < HASH_THRESHOLD )
+        return;
+    if ( table->max_index + 1 >= DENSE_THRESHOLD )
+    {
+        spill = 0;
+        for ( i = 0 ; i <= table->max_index && spill <= DENSE_SPILL ; i++ )
+            if ( !IN_DENSE_RANGE( table->stats[ i ].symbol ) )
+                spill++;
+        if ( spill <= DENSE_SPILL )
+        {
+            table->hash_mask = DENSE_INDEX;
+            table->hash = (int *) arena_block_alloc( model->arena,
+                                                     sizeof( int ) * INDEX_SLOTS( table ) );
+            if ( table->hash == NULL )
+                error_exit( "Failure #12: allocating hash index" );
+            for ( i = 0 ; i <= table->max_index ; i++ )
+                if ( IN_DENSE_RANGE( table->stats[ i ].symbol ) )
+                    table->hash[ DENSE_SLOT( table->stats[ i ].symbol ) ] = i + 1;
+                else
+                    table->hash[ DENSE_SLOTS + ++table->hash[ DENSE_SLOTS ] ] = i + 1;
+            return;
+        }
+    }
+    for ( size = 16 ; size < 4 * ( table->max_index + 1 ) ; size *= 2 )
+        ;
+    table->hash = (int *) arena_block_alloc( model->arena, sizeof( int ) * size );
+    if ( table->hash == NULL )
+        error_exit( "Failure #12: allocating hash index" );
+    table->hash_mask = size - 1;
+    for ( i = 0 ; i <= table->max_index ; i++ )
+    {
+        slot = HASH_SYMBOL( table->stats[ i ].symbol ) & table->hash_mask;
+        while ( table->hash[ slot ] != 0 )
+            slot = ( slot + 1 ) & table->hash_mask;
+        table->hash[ slot ] = i + 1;
+    }
+}
+
+/*
+ * free_index
+ *
+ * Throw away the index of a table, if it has one.
+ */
+void free_index( MODEL *model, CONTEXT *table )
+{
+    if ( !HAS_INDEX( table ) )
+        return;
+    arena_block_free( model->arena, table->hash,
+                      sizeof( int ) * INDEX_SLOTS( table ) );
+    table->hash = NULL;
+    table->hash_mask = 0;
+}
+
 /*
  * Rescaling the table needs to be done for one of three reasons.
  * First, if the maximum count for the table has exceeded 16383, it
@@ -536,38 +948,102 @@ CONTEXT *shift_to_next_context( CONTEXT *table, SYMBOL_TYPE c, int order)
  * want to rescale all tables in order to give more weight to newer
  * statistics.  All this routine does is divide each count by 2.
  * If any counts drop to 0, the counters can be removed from the
- * stats table, but only if this is a leaf context.  Otherwise, we
- * might cut a link to a higher order table.
+ * stats table, but only if they don't have a link to a higher order
+ * table.  Otherwise, we might cut a link to a higher order table.
+ * A higher order table that has emptied out is removed first, if
+ * nothing else needs it (see reclaimable()), and then its counter
+ * can go too.
  */
-void rescale_table( CONTEXT *table )
+void rescale_table( MODEL *model, CONTEXT *table )
 {
     int i;
+    int j;
+    int new_capacity;
+    CONTEXT *next;
 
-    printf("rescaling table!\n");
     if ( table->max_index == -1 )
         return;
+    COUNT( rescale_table_calls );
+    table->total_counts = 0;
     for ( i = 0 ; i <= table->max_index ; i++ )
+    {
         table->stats[ i ].counts /= 2;
-    if ( table->stats[ table->max_index ].counts == 0 &&
-         table->links == NULL )
+        table->total_counts += table->stats[ i ].counts;
+    }
+    if ( table->stats[ table->max_index ].counts != 0 )
+        return;
+/*
+ * The counts are in decreasing order, so the zeros are all at the end.
+ */
+    for ( i = j = 0 ; i <= table->max_index ; i++ )
     {
-        while ( table->stats[ table->max_index ].counts == 0 &&
-                table->max_index >= 0 )
-            table->max_index--;
-        if ( table->max_index == -1 )
-        {
-            handle_free( (char __handle *) table->stats );
-            table->stats = NULL;
-        }
-        else
+        next = ( table->links != NULL ) ? table->links[ i ].next : NULL;
+        if ( table->stats[ i ].counts == 0 && next != NULL &&
+             reclaimable( model, next ) )
         {
-            table->stats = (STATS __handle *)
-                handle_realloc( (char __handle *) table->stats,
-                                 sizeof( STATS ) * ( table->max_index + 1 ) );
-            if ( table->stats == NULL )
-                error_exit( "Error #11: reallocating stats space!" );
+            free_context( model, next );
+            next = NULL;
         }
+        if ( table->stats[ i ].counts == 0 && next == NULL )
+            continue;
+        table->stats[ j ] = table->stats[ i ];
+        if ( table->links != NULL )
+            table->links[ j ].next = next;
+        j++;
+    }
+    if ( j == table->max_index + 1 )
+        return;
+    table->max_index = j - 1;
+    if ( table->max_index == -1 )
+        new_capacity = 0;
+    else if ( table->max_index + 1 <= INLINE_SYMBOLS )
+        new_capacity = INLINE_SYMBOLS;
+    else
+    {
+        new_capacity = table->capacity;
+        while ( new_capacity > MIN_TABLE_CAPACITY &&
+                new_capacity / 2 >= table->max_index + 1 )
+            new_capacity /= 2;
+    }
+    resize_table( model, table, new_capacity );
+    rebuild_index( model, table );
+}
+
+/*
+ * reclaimable
+ *
+ * A table can be removed from the model once all of its counters are
+ * gone, as long as no other table has it as a lesser_context, and it
+ * isn't the current training context.  (The lower order training
+ * contexts are all lesser contexts of the one above them.)
+ */
+int reclaimable( MODEL *model, CONTEXT *table )
+{
+    return( table->max_index == -1 &&
+            table->lesser_refs == 0 &&
+            table != model->contexts[ model->max_order ] );
+}
+
+/*
+ * free_context
+ *
+ * Give a table that is no longer needed back to the arena, along
+ * with whatever arrays it still has.  The caller has to clear the
+ * link that led to it.
+ */
+void free_context( MODEL *model, CONTEXT *table )
+{
+    if ( !IS_INLINE( table ) )
+    {
+        free_index( model, table );
+        arena_block_free( model->arena, table->stats,
+                          sizeof( STATS ) * table->capacity );
+        arena_block_free( model->arena, table->links,
+                          sizeof( LINKS ) * table->capacity );
     }
+    table->lesser_context->lesser_refs--;
+    arena_block_free( model->arena, table, sizeof( CONTEXT ) );
+    model->alloc_count--;
 }
 
 /*
@@ -581,34 +1057,50 @@ void rescale_table( CONTEXT *table )
  * and it adds all new symbols found here to the scoreboard.  This
  * allows us to exclude counts of symbols that have already appeared in
  * higher order contexts, improving compression quite a bit.
+ *
+ * If the total gets too big for the coder, the counts are halved
+ * (shifted down) as they are added up, the way rescale_table() would
+ * halve them, but the table itself is left alone: a cursor only ever
+ * reads the model.  The counters rescale_table() would drop (the ones
+ * that are down to 0 and don't lead anywhere) aren't counted for the
+ * escape either.  cursor->shift says how far the counts were shifted.
  */
-void totalize_table( CONTEXT *table )
+void totalize_table( MODEL_CURSOR *cursor, CONTEXT *table )
 {
     int i;
+    int counts;
+    int shift = 0;
+    int kept;
     unsigned char max;
 //    int num_excluded_symbols = 0;	// Ingrid - count excluded symbols
 
     for ( ; ; )
     {
         max = 0;
+        kept = 0;
         i = table->max_index + 2;
-        totals[ i ] = 0;
+        cursor->totals[ i ] = 0;
         for ( ; i > 1 ; i-- )
         {
-            totals[ i-1 ] = totals[ i ];
-            if ( table->stats[ i-2 ].counts )
-                if ( ( current_order == -2 ) ||
-                     scoreboard[ table->stats[ i-2 ].symbol - LOWEST_SYMBOL ] == 0 )
-                     totals[ i-1 ] += table->stats[ i-2 ].counts;
-            if ( table->stats[ i-2 ].counts > max )
-                max = table->stats[ i-2 ].counts;
+            counts = table->stats[ i-2 ].counts >> shift;
+            cursor->totals[ i-1 ] = cursor->totals[ i ];
+            if ( counts )
+                if ( ( cursor->current_order == -2 ) ||
+                     !ON_SCOREBOARD( table->stats[ i-2 ].symbol ) ||
+                     !SCOREBOARD_HAS( cursor, table->stats[ i-2 ].symbol ) )
+                     cursor->totals[ i-1 ] += counts;
+            if ( counts > max )
+                max = counts;
+            if ( counts || shift == 0 ||
+                 ( table->links != NULL && table->links[ i-2 ].next != NULL ) )
+                kept++;
         }
 /*
  * Here is where the escape calculation needs to take place.
  */
 
         if ( max == 0 )
-            totals[ 0 ] = 1;
+            cursor->totals[ 0 ] = 1;
         else
         {
         	/* Ingrid - I commented out this code because I'm not sure what he's doing!
@@ -622,22 +1114,23 @@ void totalize_table( CONTEXT *table )
 *            totals[ 0 ] += totals[ 1 ];
 ********    end of original code	*/
         	/* Start of Ingrid's code */
-        	if (current_order == 0)
-        		totals[0] = totals[1] + table->max_index;
+        	if (cursor->current_order == 0)
+        		cursor->totals[0] = cursor->totals[1] + kept - 1;
         	else
-           		totals[0] = totals[1] + table->max_index + 1;
+           		cursor->totals[0] = cursor->totals[1] + kept;
         	/* End of Ingrid's changes  */
         }
-        if ( totals[ 0 ] < MAXIMUM_SCALE )
+        if ( cursor->totals[ 0 ] < MAXIMUM_SCALE )
             break;
-        rescale_table( table );			// This should never get called. (IT will print a message if it does.)
+        shift++;			// This should hardly ever happen
     }
+    cursor->shift = shift;
     for ( i = 0 ; i < table->max_index ; i++ )		// Ingrid - changed to <= (was <)
     		// Careful: if it runs through the whole loop it will cause an ACCESS_VIOLATION
-    	if (table->stats[i].counts != 0) {
+    	if ( ( table->stats[i].counts >> shift ) != 0 ) {
     		// This is a bug fix hack -- don't know why we can sometimes get a table where this is not true:
-    		if (table->stats[i].symbol >= LOWEST_SYMBOL)
-    			scoreboard[ table->stats[ i ].symbol - LOWEST_SYMBOL ] = 1;
+    		if (ON_SCOREBOARD( table->stats[i].symbol))
+    			SCOREBOARD_ADD( cursor, table->stats[ i ].symbol );
             //printf("i=%d, max_index=%d, brackets=%d, max=%d\n", i, table->max_index, table->stats[ i ].symbol - LOWEST_SYMBOL, RANGE_OF_SYMBOLS);
     		}	
 }
@@ -650,15 +1143,15 @@ void totalize_table( CONTEXT *table )
  * rescale every table in its list of links.  The table itself
  * is then rescaled.
  */
-void recursive_flush( CONTEXT *table )
+void recursive_flush( MODEL *model, CONTEXT *table )
 {
     int i;
 
     if ( table->links != NULL )
         for ( i = 0 ; i <= table->max_index ; i++ )
             if ( table->links[ i ].next != NULL )
-                recursive_flush( table->links[ i ].next );
-    rescale_table( table );
+                recursive_flush( model, table->links[ i ].next );
+    rescale_table( model, table );
 }
 
 /*
@@ -666,50 +1159,175 @@ void recursive_flush( CONTEXT *table )
  * by calling the recursive flush routine starting at the order 0
  * table.
  */
-void flush_model()
-{
-    recursive_flush( contexts[ 0 ] );
-}
-
-void error_exit( char *message)
+void flush_model( MODEL *model )
 {
-    putc( '\n', stdout );
-    puts( message );
-    exit( -1 );
+    model->decay.depth = 0;
+    recursive_flush( model, model->contexts[ 0 ] );
 }
 
-
 /*
- * print_model
+ * set_model_decay
  *
- * This routine is called when the entire model is to be printed.
+ * Set a model up to forget old statistics as it trains, so that it
+ * can keep learning from a stream forever in a bounded amount of
+ * memory.  Decaying the model works just like flushing it, except that
+ * the work is spread out over the symbols being trained on, a few
+ * tables after each symbol, so training never stops for a walk over
+ * the whole tree.  Every table gets rescaled once per pass, and the
+ * tables and counters whose counts reach 0 are given back to the arena
+ * to be used again.
+ *
+ * With a decay_interval, a pass starts every decay_interval symbols,
+ * and is paced to finish in about that many symbols, so counts have a
+ * half-life of decay_interval symbols.  With a memory_limit, passes
+ * run back to back whenever the arena is near the limit, faster the
+ * further over it is, until enough has been removed.  Either one can
+ * be 0 (not used).
  */
-void print_model()
+void set_model_decay( MODEL *model, int decay_interval, size_t memory_limit )
 {
-    recursive_print( 0, contexts[ 0 ] );
+    model->decay_interval = decay_interval;
+    model->memory_limit = memory_limit;
+    model->symbols_since_decay = 0;
+    model->decay.depth = 0;
+    model->decay.burst = DECAY_MIN_BURST;
 }
 
 /*
- * recursive_print
- * Walk through the tables, and print what you find.
- * Print the given table, and then print it's children.
- *
- * Inputs: depth = level (how many tabs to print)
- * 		   table = points to the table to print
+ * decay_model
  *
+ * Called after every symbol a decaying model is trained on, to do the
+ * next few steps of the decay pass.
  */
-void recursive_print(int depth,  CONTEXT *table )
+void decay_model( MODEL *model )
 {
-    int i;
-	char tabs[] = "\t\t\t\t";
-
-	/* print tabs to create nested table */
-	tabs[ depth ] = '\0';	/* create tab string */
+    DECAY_CURSOR *decay = &model->decay;
+    int steps = 0;
 
-	if (table->max_index == -1)
-		return;
-
-	/* Print this table's information */
+    model->symbols_since_decay++;
+    if ( model->decay_interval > 0 &&
+         ( decay->depth > 0 || model->symbols_since_decay >= model->decay_interval ) )
+    {
+        if ( decay->depth == 0 )
+            decay->steps = model->alloc_count / model->decay_interval + 1;
+        steps = decay->steps;
+    }
+    if ( model->memory_limit > 0 )
+    {
+        if ( model->arena->bytes_in_use > model->memory_limit )
+        {
+            if ( decay->burst < DECAY_MAX_BURST )
+                decay->burst *= 2;
+        }
+        else if ( decay->burst > DECAY_MIN_BURST )
+            decay->burst /= 2;
+        if ( model->arena->bytes_in_use >= DECAY_LOW_WATER( model->memory_limit ) )
+            steps += decay->burst;
+    }
+    while ( steps-- > 0 )
+    {
+        if ( decay->depth == 0 )
+            model->symbols_since_decay = 0;
+        if ( decay_step( model ) &&
+             ( model->memory_limit == 0 ||
+               model->arena->bytes_in_use < DECAY_LOW_WATER( model->memory_limit ) ) )
+            break;
+    }
+    for ( steps = 0 ;
+          model->memory_limit > 0 && model->arena->bytes_in_use > model->memory_limit &&
+          steps < DECAY_MAX_BURST ;
+          steps++ )
+    {
+        if ( decay->depth == 0 )
+            model->symbols_since_decay = 0;
+        decay_step( model );
+    }
+}
+
+/*
+ * decay_step
+ *
+ * Rescale the next table of the decay pass, starting a new pass if
+ * there isn't one going.  The tables are visited in the same order
+ * recursive_flush() uses, each one after all of the tables above it,
+ * so that the empty ones can be removed when their parent is rescaled.
+ * Training can move the links around in the tables on the path between
+ * steps, so a table may now and then get skipped, or rescaled twice,
+ * in one pass.  Only the table being rescaled can lose its links, and
+ * the tables below it are done by then.
+ * Returns true when the pass is finished.
+ */
+int decay_step( MODEL *model )
+{
+    DECAY_CURSOR *decay = &model->decay;
+    CONTEXT *table;
+    CONTEXT *next;
+    int *i;
+
+    if ( decay->depth == 0 )
+    {
+        decay->tables[ 0 ] = model->contexts[ 0 ];
+        decay->next_link[ 0 ] = 0;
+        decay->depth = 1;
+    }
+    for ( ; ; )
+    {
+        table = decay->tables[ decay->depth - 1 ];
+        i = &decay->next_link[ decay->depth - 1 ];
+        if ( table->links == NULL || *i > table->max_index )
+            break;
+        next = table->links[ ( *i )++ ].next;
+        if ( next != NULL && decay->depth < MAX_DEPTH )
+        {
+            decay->tables[ decay->depth ] = next;
+            decay->next_link[ decay->depth ] = 0;
+            decay->depth++;
+        }
+    }
+    rescale_table( model, table );
+    decay->depth--;
+    return( decay->depth == 0 );
+}
+
+void error_exit( char *message)
+{
+    putc( '\n', stdout );
+    puts( message );
+    exit( -1 );
+}
+
+
+/*
+ * print_model
+ *
+ * This routine is called when the entire model is to be printed.
+ */
+void print_model( MODEL *model )
+{
+    recursive_print( model, 0, model->contexts[ 0 ] );
+}
+
+/*
+ * recursive_print
+ * Walk through the tables, and print what you find.
+ * Print the given table, and then print it's children.
+ *
+ * Inputs: depth = level (how many tabs to print)
+ * 		   table = points to the table to print
+ *
+ */
+void recursive_print( MODEL *model, int depth,  CONTEXT *table )
+{
+    int i;
+	char tabs[] = "\t\t\t\t";
+
+	/* print tabs to create nested table */
+	tabs[ depth ] = '\0';	/* create tab string */
+
+	if (table->max_index == -1)
+		return;
+
+	/* Print this table's information */
 	for (i=0; i <= table->max_index; i++)  {
 		printf("%sSymbol: 0x%04x, counts: %d\n",
 			tabs,
@@ -717,8 +1335,8 @@ void recursive_print(int depth,  CONTEXT *table )
 			table->stats[i].counts);
 
 		/* If this table has links, print them */
-    	if ( table->links != NULL && depth < max_order )
-			recursive_print( depth+1, table->links[i].next);
+    	if ( table->links != NULL && depth < model->max_order )
+			recursive_print( model, depth+1, table->links[i].next);
 		}
 }
 /**************************
@@ -735,7 +1353,7 @@ void recursive_print(int depth,  CONTEXT *table )
 ** RETURNS: probability (as a number between 0 and 1)
 **  Note that ESCAPE probability is NOT included.
 */
-float probability( SYMBOL_TYPE c, STRING16 * context_string, char verbose)
+float probability( MODEL_CURSOR *cursor, SYMBOL_TYPE c, STRING16_VIEW * context_string, char verbose)
 {
 	int i;
 	CONTEXT *table;
@@ -746,25 +1364,22 @@ float probability( SYMBOL_TYPE c, STRING16 * context_string, char verbose)
 
 	while (!done){
 		// Traverse the tree, trying to find the context string.
-		if (current_order >= 0)
-			traverse_tree(context_string);
-		table = contexts[current_order];	// point to best context
+		if (cursor->current_order >= 0)
+			traverse_tree( cursor, context_string);
+		table = cursor->contexts[cursor->current_order];	// point to best context
 
 		// now find the character we want the probability of
-		i = 0;
-		while (i <= table->max_index &&
-				table->stats[i].symbol != c)
-			i++;
+		i = find_symbol( table, c );
 
-		if (i > table->max_index)	{
+		if (i < 0)	{
 			// If you got here, it means that you found the context string (or part of it)
 			// in the table, but can't find the test character c anywhere.  You can try a shorter
 			// context or stop at level -1.
-			if (current_order > 0)
-				shorten_string16( context_string );	// remove the first character from the context string and try again
+			if (cursor->current_order > 0)
+				shorten_view16( context_string );	// remove the first character from the context string and try again
 			else {
 				// This character wasn't found in the training data, so fall back to level -1
-				current_order = -1;
+				cursor->current_order = -1;
 				}
 			}
 		else
@@ -785,7 +1400,7 @@ float probability( SYMBOL_TYPE c, STRING16 * context_string, char verbose)
 		prob_denominator += table->stats[i].counts;
 
 	fl_prob = (float) prob_numerator/(float) prob_denominator;
-	printf("Pr( 0x%04x | %s) = %d/%d = %f\n", c, format_string16(context_string),
+	printf("Pr( 0x%04x | %s) = %d/%d = %f\n", c, format_view16(context_string),
 		prob_numerator,
 		prob_denominator,
 		fl_prob);
@@ -807,11 +1422,8 @@ float probability( SYMBOL_TYPE c, STRING16 * context_string, char verbose)
 ** OUTPUTS: symbol is filled in with interval information
 ** RETURNS:
 */
-unsigned char predict_next( STRING16 * context_string, STRUCT_PREDICTION * results)
+unsigned char predict_next( MODEL_CURSOR *cursor, STRING16_VIEW * context_string, STRUCT_PREDICTION * results)
 {
-	int i;
-	CONTEXT *table;
-	int max_counts;		// maximum value for 'counts' found
 
 	// Traverse the tree, trying to find the context string.
 	// If the entire context string can't be found,
@@ -821,18 +1433,167 @@ unsigned char predict_next( STRING16 * context_string, STRUCT_PREDICTION * resul
 	//	(example: context[1] points to the "a" context and
 	//  context[2] points to the "ab" context.
 	//  local_order is set to the depth where the context was found
-	traverse_tree( context_string);
-	if (current_order < 0)		// if the last char wasn't found at all, don't back down all the way to -1
-		current_order = 0;
-	table = contexts[ current_order ];
+	traverse_tree( cursor, context_string);
+	if (cursor->current_order < 0)		// if the last char wasn't found at all, don't back down all the way to -1
+		cursor->current_order = 0;
 
 	/* At this point, we have traversed the tree and we are
 	 * pointing to the best context that we can find.
-	 * table points to this context table
 	 * local_order is the depth (or order) of this model
 	 */
+	return( predict_in_context( cursor, cursor->current_order, results));
+}
+
+/*************************************************************
+ * predict_next_batch
+ *
+ * Same as calling predict_next() for each of the n context strings,
+ * putting the predictions for context_strings[ k ] in results[ k ],
+ * but the lookups are interleaved.  Finding a context is a chain of
+ * dependent loads (table, then its hash or stats, then the link to
+ * the next table), and on a big model most of them miss the cache.
+ * Here the lookups are run a step at a time, PREDICT_LANES strings
+ * at once, and each step prefetches what that string needs next, so
+ * the misses for the different strings are waited for together
+ * instead of one after the other.  Small models and single strings
+ * just go through predict_next() (see PREDICT_BATCH_MIN_BYTES).
+ * (The context strings aren't shortened the way predict_next()
+ * shortens them.)
+ *************************************************************/
+void predict_next_batch( MODEL_CURSOR *cursor, int n, STRING16_VIEW *context_strings, STRUCT_PREDICTION *results )
+{
+	PREDICT_LANE lanes[ PREDICT_LANES ];
+	int lane_string[ PREDICT_LANES ];	// which context string each lane has
+	STRING16_VIEW str_sub;
+	int next_string = 0;
+	int active = 0;
+	int k;
+
+	if (n < 2 || cursor->model->arena->bytes_in_use < PREDICT_BATCH_MIN_BYTES)	{
+		for (k = 0; k < n; k++)	{
+			str_sub = context_strings[ k ];		// (predict_next() shortens it)
+			predict_next( cursor, &str_sub, &results[ k ]);
+			}
+		return;
+		}
+	for ( ; ; )	{
+		// Fill the empty lanes with the next strings
+		while (active < PREDICT_LANES && next_string < n)	{
+			lanes[ active ].s = context_strings[ next_string ].s;
+			lanes[ active ].length = context_strings[ next_string ].length;
+			lanes[ active ].pos = 0;
+			lanes[ active ].order = 0;
+			lanes[ active ].table = cursor->model->contexts[ 0 ];
+			lanes[ active ].child = NULL;
+			lane_string[ active++ ] = next_string++;
+			}
+		if (active == 0)
+			break;
+		for (k = 0; k < active; )	{
+			if (lane_step( &lanes[ k ] ))	{
+				k++;
+				continue;
+				}
+			// This one has found its context, so make the predictions,
+			// and move the last lane into its place.
+			cursor->contexts[ lanes[ k ].order ] = lanes[ k ].table;
+			cursor->current_order = lanes[ k ].order;
+			predict_in_context( cursor, lanes[ k ].order, &results[ lane_string[ k ] ]);
+			lanes[ k ] = lanes[ --active ];
+			lane_string[ k ] = lane_string[ active ];
+			}
+		}
+}
+
+/*
+ * lane_step
+ *
+ * Take one step of the lookup for a predict_next_batch() lane: the
+ * same thing follow_suffix() does, split at the loads that are likely
+ * to miss.  Whatever the next step will look at is prefetched.
+ * RETURNS: true while the lane still has work to do
+ */
+int lane_step( PREDICT_LANE *lane )
+{
+	CONTEXT *table;
+	int i;
+
+	if (lane->pos == lane->length)
+		return( false );
+	if (lane->child != NULL)	{
+		// The child was prefetched last time.  A table that was never
+		// followed by anything doesn't count as found.
+		table = lane->child;
+		lane->child = NULL;
+		if (table->max_index != -1)	{
+			lane->table = table;
+			lane->order++;
+			lane->pos++;
+			}
+		else
+			lane_miss( lane );
+		}
+	else	{
+		table = lane->table;
+		i = find_symbol( table, lane->s[ lane->pos ] );
+		if (i >= 0 && table->links != NULL && table->links[ i ].next != NULL)	{
+			lane->child = table->links[ i ].next;
+			PREFETCH( lane->child );
+			return( true );
+			}
+		lane_miss( lane );
+		}
+	if (lane->pos == lane->length)
+		return( false );
+	table = lane->table;
+	if (!HAS_INDEX( table ))
+		PREFETCH( table->stats );
+	else if (table->hash_mask != DENSE_INDEX)
+		PREFETCH( &table->hash[ HASH_SYMBOL( lane->s[ lane->pos ] ) & table->hash_mask ] );
+	else if (IN_DENSE_RANGE( lane->s[ lane->pos ] ))
+		PREFETCH( &table->hash[ DENSE_SLOT( lane->s[ lane->pos ] ) ] );
+	else
+		PREFETCH( &table->hash[ DENSE_SLOTS ] );
+	return( true );
+}
+
+/*
+ * lane_miss
+ *
+ * The next symbol can't be followed from the lane's table, so fall
+ * back one order, or, at order 0, give up on the symbol.
+ */
+void lane_miss( PREDICT_LANE *lane )
+{
+	if (lane->order == 0)
+		lane->pos++;		// not even this symbol on its own is in the model
+	else	{
+		lane->table = lane->table->lesser_context;
+		lane->order--;
+		}
+}
+
+/*************************************************************
+ * predict_in_context
+ *
+ * The second half of predict_next(): make the predictions from
+ * the context table cursor->contexts[ order ], which has already
+ * been found by traverse_tree() or suffix_contexts().
+ * INPUTS:  order of the context to use (0 if it's less than 0)
+ *			pointer to where results will be stored
+ * RETURNS: the most likely next symbol
+ *************************************************************/
+unsigned char predict_in_context( MODEL_CURSOR *cursor, int order, STRUCT_PREDICTION * results)
+{
+	int i;
+	CONTEXT *table;
+	int max_counts;		// maximum value for 'counts' found
+
+	if (order < 0)
+		order = 0;
+	table = cursor->contexts[ order ];
 //	strcpy( results->context_string_used, &context_string[start_of_string]);
-	results->depth = current_order;
+	results->depth = order;
 
 	/* Find the symbols with the highest probability, given
 	 * this context.
@@ -844,10 +1605,13 @@ unsigned char predict_next( STRING16 * context_string, STRUCT_PREDICTION * resul
 
 	// Demoninator has two parts, it's the sum of all the counts + the number of elements in the table
 	// (His context[0] table has an extra entry in it, so don't add the extra '1'
-	if (current_order == 0)
+	// The sum of the counts is kept in the table, so only the predictions
+	// have to be looked at.
+	if (order == 0)
 		results->prob_denominator = table->max_index;
 	else
 		results->prob_denominator = table->max_index + 1;	// this is the number of elements in the table.
+	results->prob_denominator += table->total_counts;
 
 	max_counts = table->stats[0].counts;	// max value for 'counts' is in first element
 	// go through the table and store all symbols with the same value for 'counts' as the
@@ -860,19 +1624,13 @@ unsigned char predict_next( STRING16 * context_string, STRUCT_PREDICTION * resul
 		// store information about this symbol
 		results->sym[i].symbol = table->stats[i].symbol;
 		results->sym[i].prob_numerator = table->stats[i].counts;
-		results->prob_denominator += table->stats[i].counts;
 		}
 	results->num_predictions = i;
 
-	// Add up the rest of the counts in the table for the denominator
-	for ( ; i <= table->max_index; i++)	{
-		results->prob_denominator += table->stats[i].counts;
-		}
-
 	/* print results
 	 */
 /**************
-	printf("predict_next: given context_string = \"%s\".\n", format_string16(context_string));
+	printf("predict_next: given context_string = \"%s\".\n", format_view16(context_string));
 	printf("\tdepth = %d, denominator=%d, number of predictions = %d\n",
 			results->depth,
 			results->prob_denominator,
@@ -889,111 +1647,722 @@ unsigned char predict_next( STRING16 * context_string, STRUCT_PREDICTION * resul
 /** print_model_allocation
  *  print out the statistics on memory usage
  */
-void print_model_allocation()
+void print_model_allocation( MODEL *model )
+{
+	printf("%d CONTEXT tables allocated.\n", model->alloc_count);
+	arena_report( model->arena, stdout);
+}
+
+/** free_model
+ *  Give all of the memory used by the model back to the system.
+ *  Every table lives in the model arena, so this is a single call
+ *  instead of a walk through the tree.
+ */
+void free_model( MODEL *model )
+{
+	arena_destroy( model->arena);
+	free( model);
+}
+
+/** model_cursor
+ *  Create a cursor for looking things up in the given model.  The
+ *  cursor starts out with the order -2, -1 and 0 tables, which are
+ *  where every search starts.
+ *  NULL means error.
+ */
+MODEL_CURSOR *model_cursor( MODEL *model )
+{
+	MODEL_CURSOR *cursor;
+
+	cursor = (MODEL_CURSOR *) calloc( sizeof( MODEL_CURSOR), 1);
+	if (cursor == NULL)
+		return NULL;
+	cursor->model = model;
+	cursor->contexts = cursor->context_tables + 2;
+	cursor->contexts[ -2 ] = model->contexts[ -2 ];
+	cursor->contexts[ -1 ] = model->contexts[ -1 ];
+	cursor->contexts[ 0 ] = model->contexts[ 0 ];
+	cursor->current_order = model->max_order;
+	cursor->epoch = 1;				// (an empty scoreboard is all zeros)
+	return( cursor);
+}
+
+/** delete_model_cursor
+ *  Free a cursor.  The model isn't touched.
+ */
+void delete_model_cursor( MODEL_CURSOR *cursor )
+{
+	free( cursor);
+}
+
+/*
+ * Model snapshots
+ *
+ * save_model() writes the whole trie out to a flat binary file, and
+ * load_model() reads it back in, so a model only has to be trained
+ * once and can then be tested against any number of test files.
+ * The file is laid out as:
+ *
+ *     SNAPSHOT_HEADER
+ *     SNAPSHOT_TABLE   tables[ num_tables ]
+ *     SNAPSHOT_ENTRY   entries[ num_entries ]
+ *
+ * The tables are numbered in the order they are met in a depth first
+ * walk starting from the order 0 table, so table 0 is always the
+ * order 0 table.  Pointers to other tables (links and lesser_context)
+ * are stored as table numbers, with -1 for NULL.  The only table with
+ * a lesser context of -1 is the order 0 table, because it points to
+ * the null table.  The order -1 and -2 tables are always the same,
+ * so they aren't saved at all, they are just rebuilt on loading.  The
+ * entries for each table follow those of the previous table, in the
+ * same order as its stats array.  The header also holds the numbers
+ * of the tables in contexts[ 0 ] to contexts[ max_order ], so training
+ * can pick up where it left off.
+ *
+ * Everything is written in the machine's own byte order.  byte_order
+ * lets a file written on a machine of the other kind be recognized.
+ * SNAPSHOT_VERSION has to be changed whenever the layout changes.
+ */
+#define SNAPSHOT_MAGIC		"PMELTMDL"
+#define SNAPSHOT_VERSION	1
+#define SNAPSHOT_BYTE_ORDER	0x01020304
+#define SNAPSHOT_MAX_ORDER	( MAX_DEPTH - 3 )	// contexts[] only goes up to 7
+
+typedef struct {
+                char magic[ 8 ];
+                int version;
+                int byte_order;
+                int max_order;
+                int num_tables;
+                int num_entries;
+                int current[ SNAPSHOT_MAX_ORDER + 1 ];	// contexts[ 0..max_order ]
+               } SNAPSHOT_HEADER;
+
+typedef struct {
+                int max_index;
+                int lesser;			// table number of lesser_context
+                int has_links;		// true if the table has a links array
+               } SNAPSHOT_TABLE;
+
+typedef struct {
+                SYMBOL_TYPE symbol;
+                int counts;
+                int next;			// table number of links[].next
+               } SNAPSHOT_ENTRY;
+
+/*
+ * To turn pointers into table numbers, save_model() keeps a hash
+ * table of all the CONTEXT pointers it has numbered.
+ */
+typedef struct {
+                CONTEXT **tables;		// tables in depth first order
+                int count;
+                int size;
+                CONTEXT **keys;			// open-addressing hash of the tables
+                int *ids;
+                int mask;
+               } TABLE_NUMBERS;
+
+#define HASH_POINTER( p )	( (unsigned int) ( ( (size_t) (p) >> 4 ) * 2654435761u ) )
+
+void number_model( MODEL *model, TABLE_NUMBERS *numbers );
+void free_table_numbers( TABLE_NUMBERS *numbers );
+void number_tables( TABLE_NUMBERS *numbers, CONTEXT *table );
+int table_number( TABLE_NUMBERS *numbers, CONTEXT *table );
+int compare_image_keys( const void *a, const void *b );
+
+/*
+ * number_model
+ *
+ * Number all of the tables in the model, starting from the order 0
+ * table, and build the hash table used by table_number().
+ */
+void number_model( MODEL *model, TABLE_NUMBERS *numbers )
+{
+    unsigned int slot;
+    int size;
+    int i;
+
+    memset( numbers, 0, sizeof( TABLE_NUMBERS ) );
+    number_tables( numbers, model->contexts[ 0 ] );
+    for ( size = 16 ; size < 2 * numbers->count ; size *= 2 )
+        ;
+    numbers->keys = (CONTEXT **) calloc( size, sizeof( CONTEXT * ) );
+    numbers->ids = (int *) calloc( size, sizeof( int ) );
+    if ( numbers->keys == NULL || numbers->ids == NULL )
+        error_exit( "Failure #14: numbering the model tables!" );
+    numbers->mask = size - 1;
+    for ( i = 0 ; i < numbers->count ; i++ )
+    {
+        slot = HASH_POINTER( numbers->tables[ i ] ) & numbers->mask;
+        while ( numbers->keys[ slot ] != NULL )
+            slot = ( slot + 1 ) & numbers->mask;
+        numbers->keys[ slot ] = numbers->tables[ i ];
+        numbers->ids[ slot ] = i;
+    }
+}
+
+void free_table_numbers( TABLE_NUMBERS *numbers )
+{
+    free( numbers->ids );
+    free( numbers->keys );
+    free( numbers->tables );
+}
+
+/*
+ * number_tables
+ *
+ * Add table and everything below it to the list of tables, depth first.
+ */
+void number_tables( TABLE_NUMBERS *numbers, CONTEXT *table )
+{
+    int i;
+
+    if ( numbers->count == numbers->size )
+    {
+        numbers->size = numbers->size ? 2 * numbers->size : 1024;
+        numbers->tables = (CONTEXT **)
+            realloc( numbers->tables, sizeof( CONTEXT * ) * numbers->size );
+        if ( numbers->tables == NULL )
+            error_exit( "Failure #14: numbering the model tables!" );
+    }
+    numbers->tables[ numbers->count++ ] = table;
+    if ( table->links != NULL )
+        for ( i = 0 ; i <= table->max_index ; i++ )
+            if ( table->links[ i ].next != NULL )
+                number_tables( numbers, table->links[ i ].next );
+}
+
+/*
+ * table_number
+ *
+ * Look up the number given to a table.  NULL, or a table that isn't
+ * in the list (the null table), is -1.
+ */
+int table_number( TABLE_NUMBERS *numbers, CONTEXT *table )
+{
+    unsigned int slot;
+
+    if ( table == NULL )
+        return( -1 );
+    slot = HASH_POINTER( table ) & numbers->mask;
+    while ( numbers->keys[ slot ] != NULL )
+    {
+        if ( numbers->keys[ slot ] == table )
+            return( numbers->ids[ slot ] );
+        slot = ( slot + 1 ) & numbers->mask;
+    }
+    return( -1 );
+}
+
+/*
+ * save_model
+ *
+ * Write the model out to the given file (opened "wb").
+ * RETURNS: 0 if all went well, -1 if the file couldn't be written.
+ */
+int save_model( MODEL *model, FILE *file )
+{
+    SNAPSHOT_HEADER header;
+    SNAPSHOT_TABLE *table_records;
+    SNAPSHOT_ENTRY *entry_records;
+    TABLE_NUMBERS numbers;
+    CONTEXT *table;
+    int i, j, n;
+    int result = 0;
+
+    number_model( model, &numbers );
+
+    memset( &header, 0, sizeof( header ) );
+    memcpy( header.magic, SNAPSHOT_MAGIC, sizeof( header.magic ) );
+    header.version = SNAPSHOT_VERSION;
+    header.byte_order = SNAPSHOT_BYTE_ORDER;
+    header.max_order = model->max_order;
+    header.num_tables = numbers.count;
+    for ( i = 0 ; i <= SNAPSHOT_MAX_ORDER ; i++ )
+        header.current[ i ] = ( i <= model->max_order ) ? table_number( &numbers, model->contexts[ i ] ) : -1;
+
+    table_records = (SNAPSHOT_TABLE *) calloc( numbers.count, sizeof( SNAPSHOT_TABLE ) );
+    if ( table_records == NULL )
+        error_exit( "Failure #15: allocating snapshot buffers!" );
+    for ( i = 0 ; i < numbers.count ; i++ )
+    {
+        table = numbers.tables[ i ];
+        table_records[ i ].max_index = table->max_index;
+        table_records[ i ].lesser = table_number( &numbers, table->lesser_context );
+        table_records[ i ].has_links = ( table->links != NULL );
+        header.num_entries += table->max_index + 1;
+    }
+    entry_records = (SNAPSHOT_ENTRY *) calloc( header.num_entries + 1, sizeof( SNAPSHOT_ENTRY ) );
+    if ( entry_records == NULL )
+        error_exit( "Failure #15: allocating snapshot buffers!" );
+    for ( i = 0, n = 0 ; i < numbers.count ; i++ )
+    {
+        table = numbers.tables[ i ];
+        for ( j = 0 ; j <= table->max_index ; j++, n++ )
+        {
+            entry_records[ n ].symbol = table->stats[ j ].symbol;
+            entry_records[ n ].counts = table->stats[ j ].counts;
+            entry_records[ n ].next = ( table->links != NULL ) ?
+                    table_number( &numbers, table->links[ j ].next ) : -1;
+        }
+    }
+
+    if ( fwrite( &header, sizeof( header ), 1, file ) != 1 ||
+         fwrite( table_records, sizeof( SNAPSHOT_TABLE ), numbers.count, file ) != (size_t) numbers.count ||
+         fwrite( entry_records, sizeof( SNAPSHOT_ENTRY ), header.num_entries, file ) != (size_t) header.num_entries ||
+         fflush( file ) != 0 )
+        result = -1;
+
+    free( entry_records );
+    free( table_records );
+    free_table_numbers( &numbers );
+    return( result );
+}
+
+/*
+ * load_model
+ *
+ * Build a model from a file written by save_model().  This takes the
+ * place of initialize_model(), and the model gets the max_order it
+ * was trained with.  The file is checked as it is read, so a damaged
+ * file is refused instead of producing a broken trie.
+ * RETURNS: the model, or NULL if the file isn't a good snapshot.
+ */
+MODEL *load_model( FILE *file )
+{
+    MODEL *model = NULL;
+    SNAPSHOT_HEADER header;
+    SNAPSHOT_TABLE *table_records = NULL;
+    SNAPSHOT_ENTRY *entry_records = NULL;
+    CONTEXT **tables = NULL;
+    CONTEXT *table;
+    CONTEXT *null_table;
+    long total;
+    int i, j, n;
+
+    if ( fread( &header, sizeof( header ), 1, file ) != 1 ||
+         memcmp( header.magic, SNAPSHOT_MAGIC, sizeof( header.magic ) ) != 0 )
+        return( NULL );
+    if ( header.byte_order != SNAPSHOT_BYTE_ORDER || header.version != SNAPSHOT_VERSION )
+    {
+        fprintf( stderr, "Model file is version %d, expecting version %d (native byte order)\n",
+                 header.byte_order == SNAPSHOT_BYTE_ORDER ? header.version : -1,
+                 SNAPSHOT_VERSION );
+        return( NULL );
+    }
+    if ( header.max_order < 0 || header.max_order > SNAPSHOT_MAX_ORDER ||
+         header.num_tables < 1 || header.num_entries < 0 )
+        return( NULL );
+
+    table_records = (SNAPSHOT_TABLE *) malloc( sizeof( SNAPSHOT_TABLE ) * header.num_tables );
+    entry_records = (SNAPSHOT_ENTRY *) malloc( sizeof( SNAPSHOT_ENTRY ) * ( header.num_entries + 1 ) );
+    tables = (CONTEXT **) malloc( sizeof( CONTEXT * ) * header.num_tables );
+    if ( table_records == NULL || entry_records == NULL || tables == NULL )
+        error_exit( "Failure #15: allocating snapshot buffers!" );
+    if ( fread( table_records, sizeof( SNAPSHOT_TABLE ), header.num_tables, file )
+                != (size_t) header.num_tables ||
+         fread( entry_records, sizeof( SNAPSHOT_ENTRY ), header.num_entries, file )
+                != (size_t) header.num_entries )
+        goto done;
+/*
+ * Check that all of the table numbers are in range, and that the
+ * tables account for all of the entries, before building anything.
+ */
+    for ( i = 0, total = 0 ; i < header.num_tables ; i++ )
+    {
+        if ( table_records[ i ].max_index < -1 ||
+             table_records[ i ].lesser < -1 ||
+             table_records[ i ].lesser >= header.num_tables ||
+             ( table_records[ i ].lesser == -1 ) != ( i == 0 ) )
+            goto done;
+        total += table_records[ i ].max_index + 1;
+    }
+    if ( total != header.num_entries )
+        goto done;
+    for ( n = 0 ; n < header.num_entries ; n++ )
+        if ( entry_records[ n ].next < -1 || entry_records[ n ].next >= header.num_tables )
+            goto done;
+    for ( i = 0 ; i <= header.max_order ; i++ )
+        if ( header.current[ i ] < 0 || header.current[ i ] >= header.num_tables )
+            goto done;
+
+    model = create_model( header.max_order );
+    for ( i = 0 ; i < header.num_tables ; i++ )
+        tables[ i ] = new_context( model );
+    null_table = new_context( model );
+    for ( i = 0, n = 0 ; i < header.num_tables ; i++ )
+    {
+        table = tables[ i ];
+        table->max_index = table_records[ i ].max_index;
+        do
+            grow_table( model, table, table_records[ i ].has_links );
+        while ( table->capacity <= table->max_index );
+        for ( j = 0 ; j <= table->max_index ; j++, n++ )
+        {
+            table->stats[ j ].symbol = entry_records[ n ].symbol;
+            table->stats[ j ].counts = entry_records[ n ].counts;
+            table->total_counts += entry_records[ n ].counts;
+            if ( table->links != NULL && entry_records[ n ].next >= 0 )
+                table->links[ j ].next = tables[ entry_records[ n ].next ];
+        }
+        table->lesser_context = ( i == 0 ) ? null_table : tables[ table_records[ i ].lesser ];
+        table->lesser_context->lesser_refs++;
+        rebuild_index( model, table );
+    }
+/*
+ * The null table gets its link to the order 0 table first, just like
+ * it does in initialize_model(), and then gets filled in.
+ */
+    null_table->max_index = 0;
+    grow_table( model, null_table, true );
+    null_table->links[ 0 ].next = tables[ 0 ];
+    fill_null_table( model, null_table );
+    model->contexts[ -1 ] = null_table;
+    model->contexts[ -2 ] = create_control_table( model );
+    for ( i = 0 ; i <= model->max_order ; i++ )
+        model->contexts[ i ] = tables[ header.current[ i ] ];
+
+done:
+    free( tables );
+    free( entry_records );
+    free( table_records );
+    return( model );
+}
+
+/*
+ * freeze_model
+ *
+ * Write the model out as a read-only image (see image.h) that can be
+ * mapped into memory and queried without rebuilding the trie.  The
+ * nodes are numbered the same way as in a snapshot, with the null
+ * table added at the end.
+ * RETURNS: 0 if all went well, -1 if the file couldn't be written.
+ */
+int freeze_model( MODEL *model, FILE *file )
+{
+    IMAGE_HEADER header;
+    IMAGE_NODE *nodes;
+    IMAGE_ENTRY *entries;
+    IMAGE_KEY *keys;
+    TABLE_NUMBERS numbers;
+    CONTEXT *table;
+    double num_entries;
+    double entries_offset;
+    double keys_offset;
+    double image_size;
+    int i, j, n;
+    int result = 0;
+
+    number_model( model, &numbers );
+    memset( &header, 0, sizeof( header ) );
+    memcpy( header.magic, IMAGE_MAGIC, sizeof( header.magic ) );
+    header.version = IMAGE_VERSION;
+    header.byte_order = IMAGE_BYTE_ORDER;
+    header.max_order = model->max_order;
+    header.num_nodes = numbers.count + 1;
+    header.root = 0;
+    header.null_node = numbers.count;
+/*
+ * The sizes are all worked out in double first, so a model too big
+ * for the int offsets in the header is turned away instead of having
+ * them wrap around.
+ */
+    num_entries = model->contexts[ -1 ]->max_index + 1;
+    for ( i = 0 ; i < numbers.count ; i++ )
+        num_entries += numbers.tables[ i ]->max_index + 1;
+    entries_offset = sizeof( IMAGE_HEADER ) + (double) header.num_nodes * sizeof( IMAGE_NODE );
+    keys_offset = entries_offset + num_entries * sizeof( IMAGE_ENTRY );
+    image_size = keys_offset + num_entries * sizeof( IMAGE_KEY );
+    if ( image_size > 0x7fffffff )
+    {
+        free_table_numbers( &numbers );
+        return( -1 );
+    }
+    header.num_entries = (int) num_entries;
+    header.nodes_offset = sizeof( IMAGE_HEADER );
+    header.entries_offset = (int) entries_offset;
+    header.keys_offset = (int) keys_offset;
+    header.image_size = (int) image_size;
+
+    nodes = (IMAGE_NODE *) calloc( header.num_nodes, sizeof( IMAGE_NODE ) );
+    entries = (IMAGE_ENTRY *) calloc( header.num_entries + 1, sizeof( IMAGE_ENTRY ) );
+    keys = (IMAGE_KEY *) calloc( header.num_entries + 1, sizeof( IMAGE_KEY ) );
+    if ( nodes == NULL || entries == NULL || keys == NULL )
+        error_exit( "Failure #15: allocating snapshot buffers!" );
+    for ( i = 0, n = 0 ; i < header.num_nodes ; i++ )
+    {
+        table = ( i == header.null_node ) ? model->contexts[ -1 ] : numbers.tables[ i ];
+        nodes[ i ].first = n;
+        nodes[ i ].count = table->max_index + 1;
+        if ( i == header.null_node )
+            nodes[ i ].lesser = -1;
+        else if ( i == header.root )
+            nodes[ i ].lesser = header.null_node;
+        else
+            nodes[ i ].lesser = table_number( &numbers, table->lesser_context );
+        nodes[ i ].has_links = ( table->links != NULL );
+        nodes[ i ].total = table->total_counts;
+        for ( j = 0 ; j <= table->max_index ; j++, n++ )
+        {
+            entries[ n ].symbol = table->stats[ j ].symbol;
+            entries[ n ].counts = table->stats[ j ].counts;
+            entries[ n ].next = ( table->links != NULL ) ?
+                    table_number( &numbers, table->links[ j ].next ) : -1;
+            keys[ n ].symbol = table->stats[ j ].symbol;
+            keys[ n ].index = j;
+        }
+        qsort( keys + nodes[ i ].first, nodes[ i ].count, sizeof( IMAGE_KEY ),
+               compare_image_keys );
+    }
+
+    if ( fwrite( &header, sizeof( header ), 1, file ) != 1 ||
+         fwrite( nodes, sizeof( IMAGE_NODE ), header.num_nodes, file ) != (size_t) header.num_nodes ||
+         fwrite( entries, sizeof( IMAGE_ENTRY ), header.num_entries, file ) != (size_t) header.num_entries ||
+         fwrite( keys, sizeof( IMAGE_KEY ), header.num_entries, file ) != (size_t) header.num_entries ||
+         fflush( file ) != 0 )
+        result = -1;
+
+    free( keys );
+    free( entries );
+    free( nodes );
+    free_table_numbers( &numbers );
+    return( result );
+}
+
+/*
+ * Sort keys by symbol, for freeze_model().
+ */
+int compare_image_keys( const void *a, const void *b )
 {
-	printf("%d CONTEXT tables allocated.\n", alloc_count);
+    return( ( (const IMAGE_KEY *) a )->symbol - ( (const IMAGE_KEY *) b )->symbol );
 }
 
 /*************************************************************
  * traverse_tree
  * Given a context string, traverse the tree.
  * Assumes context_string length < max_order
- * INPUTS: context string (it may be empty, that's oK)
+ * Finds the longest suffix of the context string that is in the
+ * model.  Instead of searching down from the order 0 table for
+ * each shorter suffix until one is found, this reads the context
+ * once, from left to right, keeping the table for the longest
+ * suffix (of what has been read so far) that is in the model.  When
+ * the next symbol can't be followed from there, it falls back to
+ * the next shorter suffix with the table's lesser_context pointer,
+ * the same way add_character_to_model() moves the training
+ * contexts along.  This works because a context is only in the
+ * model if its suffixes are.
+ * INPUTS: context string (it may be empty, that's oK).  It is
+ * 		shortened to the suffix that was found (or to its last
+ * 		symbol if not even that was found).
  * OUTPUTS: current_order is set to largest order where context
- * 		was found
- * 		contexts[] pointers set up (valid from 0 to current_order)
+ * 		was found (-1 if even the last symbol wasn't found)
+ * 		contexts[] pointers set up (valid from 0 to current_order):
+ * 		contexts[ j ] is the table for the last j symbols
  * RETURNS: void
  *
  *************************************************************/
-void traverse_tree( STRING16 * context_string) {
-	int i;
-	CONTEXT *table;
-	SYMBOL_TYPE test_char;	// char we are currently looking for in tree
-	int local_order;
-	int index_into_string;
-	int done = false;
-
-	// Traverse the tree, trying to find the context string.
-	// If the entire context string can't be found,
-	// trim the first char off of the context string and try again.
-	// At the end of this section,
-	//  the context[] array points to the current context
-	//	(example: context[1] points to the "a" context and
-	//  context[2] points to the "ab" context.
-	//  local_order is set to the depth where the context was found
-	local_order= 0;		// Start with the order-0 model
-
-	// initialize our moving index into the string.  This
-	// index is used to pull characters out of the string.
-	index_into_string = 0;
-	//printf("traverse_tree: context_string=\"%s\"\n", format_string16(context_string);
-
-	// Slimy test for the blank string
-	if (strlen16(context_string) == 0)
-		done = true;
-
-	while (!done)	{		// traversing tree
-		test_char = get_symbol(context_string, index_into_string );
-		table = contexts[ local_order ];
-		// Search this table for this character
-		i = 0;
-		while (i <= table->max_index &&
-			table->stats[i].symbol != test_char &&
-			table->max_index >= 0)
-			{
-			i++;
-			}
-		if ((i > table->max_index) ||			// didn't find this symbol in the table
-				((table->links[i].next)->max_index == -1)) // there is no further symbols for this context
-												// (this second case only happens for
-												// the very end of the training
-												// string.  You could have a branch
-												// of the tree that is only a few
-												// links long, so you can't assume you
-												// can always traverse down to
-												// a depth of max-order.
-			{
-			// didn't find it
-
-			// if we are at the end of the string, we are out of luck
-			if (strlen16( context_string) == 1)	{
-	//			printf("prob: couldn't find this char, going to level -1\n");
-				local_order = -1;
-				break;					// stop traversing tree
-				}
-			else {
-				shorten_string16( context_string);
-				index_into_string = 0;		// start over at beginning of shorter string
-				local_order= 0;
-				}
-			continue;
-			}
-
-		// Found this character, go onto the next char
-		if (++index_into_string == strlen16( context_string))
-			done = true;
-		local_order++;
-		contexts[local_order] = table->links[i].next;
+void traverse_tree( MODEL_CURSOR *cursor, STRING16_VIEW * context_string) {
+	int j;
+	CONTEXT *table;		// table for the longest suffix found so far
+	int local_order;	// length of the longest suffix found so far
+	int length;
+
+	length = context_string->length;
+	table = cursor->contexts[ 0 ];		// Start with the order-0 model
+	local_order = 0;
+	for (j = 0; j < length; j++)
+		table = follow_suffix( table, &local_order, context_string->s[ j ]);
+
+	if (local_order == 0 && length > 0)	{
+		// didn't find even the last char, going to level -1
+		tail_view16( context_string, 1);
+		local_order = -1;
+		}
+	else	{
+		tail_view16( context_string, local_order);
+		cursor->contexts[ local_order ] = table;
+		for (j = local_order; j > 0; j--)
+			cursor->contexts[ j-1 ] = cursor->contexts[ j ]->lesser_context;
 		}
-	table = contexts[ local_order ];
-	current_order = local_order;
+	cursor->current_order = local_order;
+	COUNT( traverse_calls);
+	COUNT_HISTOGRAM( traverse_fallback, length - local_order);
 
 	/* At this point, we have traversed the tree and we are
 	 * pointing to the best context that we can find.
-	 * table points to this context table
+	 * contexts[ current_order ] points to this context table
 	 * current_order is the depth (or order) of this model
 	 */
 	return;
 }
+
+/*************************************************************
+ * follow_suffix
+ * One step of traverse_tree() and advance_context(): given the
+ * table for the longest suffix (of order *order) of what has been
+ * read so far that is in the model, find the table for the longest
+ * suffix once the symbol c has been read, falling back along the
+ * lesser_context pointers until c can be followed.  A table that was
+ * never followed by anything (the very end of the training string)
+ * doesn't count as found.
+ * RETURNS: the new table (the order 0 table if not even c on its
+ * 		own is in the model), and *order is updated to match
+ *************************************************************/
+CONTEXT *follow_suffix( CONTEXT *table, int *order, SYMBOL_TYPE c) {
+	int i;
+	CONTEXT *next;
+
+	for ( ; ; )	{
+		i = find_symbol( table, c );
+		next = (i >= 0 && table->links != NULL) ? table->links[i].next : NULL;
+		if (next != NULL && next->max_index != -1)	{
+			(*order)++;
+			return( next);
+			}
+		if (*order == 0)
+			return( table);		// not even c on its own is in the model
+		table = table->lesser_context;	// fall back one order
+		(*order)--;
+		}
+}
+
+/*************************************************************
+ * suffix_contexts
+ * Look up a context string once, and find the tables for all of
+ * its shorter suffixes as well.  traverse_tree() finds the longest
+ * suffix of the context that is in the model, and follows the
+ * lesser_context pointers from there to the tables for the
+ * suffixes one symbol shorter, all the way down to order 0.
+ *
+ * Every suffix of a context that is in the model is in the model
+ * too, so the table that traverse_tree() would find for the last
+ * k symbols of the context is contexts[ min( depth, k ) ].  This
+ * lets one descent answer for every order up to the length of
+ * the context string.
+ * INPUTS: context string (it is shortened, like traverse_tree())
+ * OUTPUTS: contexts[ j ] is the table for the last j symbols of
+ * 		the context, for j from 0 to the depth returned
+ * RETURNS: the depth (order) of the longest suffix found, -1 if
+ * 		not even the last symbol was found
+ *************************************************************/
+int suffix_contexts( MODEL_CURSOR *cursor, STRING16_VIEW * context_string) {
+	traverse_tree( cursor, context_string);
+	return( cursor->current_order);
+}
+
+/*************************************************************
+ * current_contexts
+ * Set the cursor up to predict from the model's own current
+ * context: the last max_order symbols given to
+ * add_character_to_model().  The model already points to the
+ * tables for that context and each of its suffixes, so instead
+ * of searching down from the root like traverse_tree(), this
+ * just takes the longest of them that has been seen before.
+ * That's the same table traverse_tree() would find, and it only
+ * takes O(max_order).
+ * OUTPUTS: current_order is set to the order of that table, and
+ * 		contexts[] pointers set up (valid from 0 to current_order)
+ * RETURNS: current_order (-1 if even the order 1 context is new)
+ *************************************************************/
+int current_contexts( MODEL_CURSOR *cursor ) {
+	MODEL *model = cursor->model;
+	int order;
+	int j;
+
+	for (order = model->max_order; order > 0 && model->contexts[ order ]->max_index < 0; order--)
+		;
+	for (j = 0; j <= order; j++)
+		cursor->contexts[ j ] = model->contexts[ j ];
+	if (order == 0 && model->max_order > 0)
+		order = -1;			// like traverse_tree(), when the last symbol isn't found
+	cursor->current_order = order;
+	return( order);
+}
+
+/*************************************************************
+ * start_context, advance_context
+ * Walk along a string of symbols (such as a test string) one
+ * symbol at a time, keeping track of the context made up of the
+ * last max_order symbols.  This works just like the way
+ * add_character_to_model() moves the training contexts along, but
+ * it only reads the model: from the table for the longest suffix
+ * of the context that is in the model, each new symbol is followed
+ * through the links, falling back through lesser_context when it
+ * can't be (see follow_suffix()).  So reading a string of n symbols
+ * costs O(n), instead of a traverse_tree() for every position.
+ *
+ * After each symbol, current_order and contexts[ current_order ]
+ * are the same as traverse_tree() would set them for the last
+ * max_order symbols read (current_order is -1 if not even the
+ * last symbol is in the model).  The lower contexts[] aren't set.
+ * max_order has to be the same for every symbol in a walk.
+ * RETURNS: current_order
+ *************************************************************/
+void start_context( MODEL_CURSOR *cursor ) {
+	cursor->walk_table = cursor->model->contexts[ 0 ];
+	cursor->walk_order = 0;
+	cursor->contexts[ 0 ] = cursor->walk_table;
+	cursor->current_order = 0;
+}
+int advance_context( MODEL_CURSOR *cursor, SYMBOL_TYPE c, int max_order ) {
+	CONTEXT *table = cursor->walk_table;
+	int order = cursor->walk_order;
+
+	if (max_order <= 0)
+		return( cursor->current_order = 0);		// the context is always empty
+	if (order == max_order)	{		// the oldest symbol drops out of the context
+		table = table->lesser_context;
+		order--;
+		}
+	table = follow_suffix( table, &order, c);
+	cursor->walk_table = table;
+	cursor->walk_order = order;
+	cursor->contexts[ order ] = table;
+	cursor->current_order = (order == 0) ? -1 : order;
+	return( cursor->current_order);
+}
+
+/*************************************************************
+ * symbol_probability
+ * Return the probability of the symbol c, starting in the context
+ * table cursor->contexts[ order ] and escaping down to the lower
+ * order tables (with exclusion) until it's found.  This is the
+ * same probability that compute_logloss() works out for a context
+ * string whose longest suffix in the model has this order, but
+ * the tables have to be set up already (see suffix_contexts()).
+ * Like compute_logloss(), it doesn't escape below order 1.
+ * INPUTS: symbol c
+ * 		order of the first table to try (-1 for the null table)
+ * RETURNS: the probability
+ *************************************************************/
+float symbol_probability( MODEL_CURSOR *cursor, SYMBOL_TYPE c, int order) {
+	SYMBOL s;		// interval information
+	int escaped;	// true if we hit ESCAPE situation.
+	double prob_numerator = 1, prob_denominator = 1;
+
+	clear_scoreboard( cursor );
+	do {
+		cursor->current_order = order;
+		escaped = convert_int_to_symbol( cursor, c, &s);
+		if (s.scale != 0) {
+			prob_numerator *= (s.high_count - s.low_count);
+			prob_denominator *= s.scale;
+			}
+	} while (escaped && --order >= 1);
+	return( (float) prob_numerator/(float) prob_denominator);
+}
 /****************************************************8
  * clear_scoreboard
- * Clear the scoreboard
+ * Clear the scoreboard, by starting a new epoch.  Once every
+ * 65535 times the epoch wraps around, and the old marks really
+ * do have to be erased.
  ******************************************************/
-void clear_scoreboard() {
-	int i;
-
-    for ( i = 0 ; i < RANGE_OF_SYMBOLS ; i++ )
-        scoreboard[ i ] = 0;
+void clear_scoreboard( MODEL_CURSOR *cursor ) {
+	if (++cursor->epoch == 0) {
+		memset( cursor->scoreboard, 0, sizeof( cursor->scoreboard));
+		cursor->epoch = 1;
+		}
 }
 
 
@@ -1003,92 +2372,151 @@ void clear_scoreboard() {
  * Given a test string, calculate the average
  * log-loss for encoding the string.
  *
+ * The probability of each symbol is worked out the same way
+ * the encoder would: starting from the longest suffix of the
+ * max_order symbols before it that is in the model, ESCAPE
+ * down through shorter contexts until the symbol is found,
+ * excluding the symbols already seen at higher orders (the
+ * scoreboard).  The contexts come from a cursor walking along
+ * the test string (see advance_context()), and the escapes
+ * walk down the lesser_context pointers from there, so each
+ * context is only found once.  As before, an ESCAPE from an
+ * order 1 context gives up rather than going on to order 0.
+ *
  * INPUTS:
  * 	  test_string = pointer to string to test.
  *
- * RETURNS: nothing
+ * RETURNS: the average log-loss (in bits per symbol)
+ * *********************************************/
+float compute_logloss( MODEL_CURSOR *cursor, STRING16 * test_string, int verbose){
+	int length = strlen16( test_string);
+	double summation;
+
+	start_context( cursor);
+	summation = logloss_sum( cursor, test_string, 0, 0, verbose);
+	return( average_logloss( summation, length, verbose));
+}
+
+/*******************************************
+ * compute_logloss_file
+ *
+ * compute_logloss() for a whole test file, however long it is.  The
+ * file is read MAX_STRING_LENGTH symbols at a time (see fread16_chunk()),
+ * and the cursor keeps walking from one chunk to the next, so it
+ * comes out the same as if the whole file were one test string.
+ *
+ * RETURNS: the average log-loss (in bits per symbol)
  * *********************************************/
-float compute_logloss( STRING16 * test_string, int verbose){
+float compute_logloss_file( MODEL_CURSOR *cursor, FILE *test_file, int verbose){
+	STRING16 *chunk;
+	int n;			// new symbols in the chunk
+	long length = 0;	// symbols so far
+	double summation = 0.0;
+
+	chunk = string16( MAX_STRING_LENGTH+1);
+	if (chunk == NULL)
+		error_exit( "Failure #16: allocating the test chunk!" );
+	start_context( cursor);
+	while ((n = fread16_chunk( chunk, cursor->model->max_order, MAX_STRING_LENGTH, test_file)) > 0)	{
+		summation += logloss_sum( cursor, chunk, strlen16( chunk) - n, length, verbose);
+		length += n;
+		}
+	delete_string16( chunk);
+	return( average_logloss( summation, length, verbose));
+}
+
+/* Take the average of a sum of log2(P()) over length symbols, and change the sign */
+float average_logloss( double summation, long length, int verbose){
+	if (length > 0)
+		summation /= length;
+	summation *= -1.0;
+	if (verbose)
+		printf("average log-loss is %f\n", summation);
+	return (summation);
+}
+
+/*******************************************
+ * logloss_sum
+ *
+ * Add up log2(P()) for the symbols of test_string from start on,
+ * carrying on from where the cursor is (start_context() has to be
+ * called before the first symbol of a test).  The symbols before
+ * start are only there to print the context with (verbose).
+ * INPUTS:
+ * 	  test_string, start = the symbols to test
+ * 	  position = position of test_string[ start ] in the whole test
+ * RETURNS: the sum (not the average)
+ * *********************************************/
+double logloss_sum( MODEL_CURSOR *cursor, STRING16 * test_string, int start, long position, int verbose){
 	int i;			// index into test string
 	int length;		// string length
+	int max_order = cursor->model->max_order;
+	int context_length;	// number of symbols before the test character
+	int order;		// order of the table being used
+	int first_order;	// order of the first table tried
+	CONTEXT *table;	// and the table
     SYMBOL s;		// interval information
     int escaped;	// true if we hit ESCAPE situation.
     double prob_numerator, prob_denominator;	// for calculating probabilities for each char
     float fl_prob;	// probability as a float
-    float summation = 0.0;	// summation of the log-base-2(P())
-    STRING16 * str_sub;
+    double bits;	// log-base-2(P()) for one symbol
+    double summation = 0.0;	// summation of the log-base-2(P())
 
     if (verbose)	{
  //   	printf("compute_logloss: Testing on string \"%s\"\n", format_string_16(test_string));
     	}
 
-    // Create working substring
-    str_sub = string16(max_order);
-
 	// Calculate the probability of each character in the test string.
 	// Since this calculation has to do with encoding, we need to include
 	// the ESCAPE probabilities and the EXCLUSION mechanism, which
 	// are handled by the convert_int_to_symbol routine.
 
-	for (i=0; i < strlen16( test_string) ; i++)	{
+	length = strlen16( test_string);
+	COUNT_ADD( logloss_symbols, length - start);
+	for (i=start; i < length; i++, position++)	{
 
-		// Create the context string, which is the max_order characters
-		// before the character in question.
+		// The context is the max_order characters before the
+		// character in question.
 		// Ex.  If the test_string is "abcdef" and i is 5, the
 		// test character will be 'f' and the context string (for
 		// a model order of 2) is the 2 characters before the 'f', which
 		// are "de".
-
-		if (i < max_order)  {
-			strncpy16( str_sub, test_string, 0, i);	// create test string
-			}
-		else {
-			strncpy16( str_sub, test_string, i-max_order, max_order);
-			}
+		context_length = (position < max_order) ? position : max_order;
+		order = first_order = cursor->current_order;		// the best context, from advance_context()
+		table = cursor->contexts[ order ];
 		prob_numerator = 1;
 		prob_denominator = 1;
-		clear_scoreboard();
-		if (verbose)
-			printf("\t%d: log2(P(0x%04x|\"%s\")",
-					i, get_symbol(test_string, i), format_string16(str_sub));	// print first part of line
-
-		do {
-			//printf("\ttraverse for \"%s\"\n", format_string16(str_sub));
-			traverse_tree( str_sub);		// set pointers to best context
-			escaped = convert_int_to_symbol( get_symbol(test_string,i), &s);
-			//printf("\thigh=%d, low=%d, scale=%d\n", s.high_count, s.low_count, s.scale);
+		clear_scoreboard( cursor );
+		if (verbose)	{
+			STRING16_VIEW str_sub = view16( test_string, i - context_length, context_length);
+			printf("\t%ld: log2(P(0x%04x|\"%s\")",
+					position, get_symbol(test_string, i), format_view16(&str_sub));	// print first part of line
+			}
+
+		for ( ; ; )	{
+			cursor->current_order = order;
+			cursor->contexts[ order ] = table;
+			escaped = convert_int_to_symbol( cursor, get_symbol(test_string,i), &s);
 			if (s.scale != 0) {
 				prob_numerator *= (s.high_count - s.low_count);
 				prob_denominator *= s.scale;
-				//printf("\tnum=%f,denom=%f\n", prob_numerator, prob_denominator);
 				}
-			if (escaped){
-				/* If the test char isn't found in this table, shorten the context and try again. */
-				//printf("escaped..");
-				// was ==>  if (strlen16(str_sub)== 0) {   	// can't shorten anymore
-				if (strlen16(str_sub)<= 1) {   	// can't shorten anymore
-					//printf(" abort\n");
-					escaped=false;				// abort if not found
-					}
-				else
-					shorten_string16( str_sub);	// remove first char from context
-				}
-		} while (escaped);
+			/* If the test char isn't found in this table, shorten the context and try again. */
+			if (!escaped || order <= 1)	// found, or can't shorten anymore
+				break;
+			table = table->lesser_context;	// remove first char from context
+			order--;
+			}
+		COUNT_HISTOGRAM( logloss_escapes, first_order - order + escaped);
 
 		fl_prob = (float) prob_numerator/(float) prob_denominator;
 		//printf("fl_prob (%c)= %f\n", test_string[i], fl_prob);
-		summation += log10(fl_prob);
+		bits = log2( fl_prob);
+		summation += bits;
 		if (verbose)
-			printf("= %f\n", log10(fl_prob)/log10(2.0));
+			printf("= %f\n", bits);
+		advance_context( cursor, get_symbol( test_string, i), max_order);
 	}
-
-	// Convert logbase10 to log base 2 by diving by log-base-10(2)
-	summation /= log10(2.0);
-	// Take the average and change the sign
-	summation /= length;
-	summation *= -1.0;
-	if (verbose)
-		printf("average log-loss is %f\n", summation);
 	return (summation);
-}	// end of compute_logloss
+}	// end of logloss_sum
 
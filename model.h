@@ -8,14 +8,9 @@
 #ifndef MODEL_H_
 #define MODEL_H_
 
-/*
- * Eternal variable declarations.
- */
-extern int max_order;
-extern int flushing_enabled;
-
 #include "string16.h"
 #include "coder.h"
+#include "arena.h"
 
 /*
  * Definitions
@@ -36,7 +31,15 @@ extern int flushing_enabled;
 #define INITIAL_LOCATION	0x2320
 #define FINAL_LOCATION		0x25FF
 #define LOWEST_SYMBOL		INITIAL_LOCATION	// was INITIAL_START_TIME
+#define LOWEST_BOX_SYMBOL	0x2120			// the old INITIAL_START_TIME, still in the traces
 #define RANGE_OF_SYMBOLS	FINAL_START_TIME-LOWEST_SYMBOL 	// was FINAL_LOCATION-LOWEST_SYMBOL
+// Only symbols in this range have a place on the exclusion scoreboard.  Symbols
+// outside it (such as the times, and the order -1 table's 0..255) are never excluded.
+#define ON_SCOREBOARD( s )	( (s) >= LOWEST_SYMBOL && (s) < LOWEST_SYMBOL + RANGE_OF_SYMBOLS )
+// A symbol is on a cursor's scoreboard when its place holds the cursor's current
+// epoch, so the scoreboard can be cleared by just starting a new epoch.
+#define SCOREBOARD_HAS( cursor, s )	( (cursor)->scoreboard[ (s) - LOWEST_SYMBOL ] == (cursor)->epoch )
+#define SCOREBOARD_ADD( cursor, s )	( (cursor)->scoreboard[ (s) - LOWEST_SYMBOL ] = (cursor)->epoch )
 
 /*
  * This program consumes massive amounts of memory.  One way to
@@ -97,6 +100,21 @@ typedef struct {
  * to -1.  As soon as single element is added to stats, max_index is
  * incremented to 0.
  *
+ * The stats and links arrays have room for capacity entries.  They
+ * come from the model's arena (see arena.h), and double in size
+ * whenever a new symbol doesn't fit, so they don't have to be
+ * reallocated every time a symbol is added.
+ *
+ * Most of the tables in a high order model only ever see one symbol,
+ * so a table with room for INLINE_SYMBOLS keeps its stats and links
+ * inside the CONTEXT itself, in inline_stats and inline_links, and
+ * the stats and links pointers just point there.  That takes no
+ * more room than the table alone, and following a long chain of
+ * these tables touches one cache line per table instead of three.  The inline
+ * entries share their space with the index, which such a small table
+ * never has, so IS_INLINE() has to be checked before hash is looked
+ * at (HAS_INDEX() does both).
+ *
  * The lesser context pointer is a navigational aid.  It points to
  * the context that is one less than the current order.  For example,
  * if the current context is "ABC", the lesser_context pointer will
@@ -104,14 +122,165 @@ typedef struct {
  * this particular bit of table searching is done frequently, but
  * the pointer only needs to be built once, when the context is
  * created.
+ *
+ * Other small tables are searched linearly.  Once a table grows past
+ * HASH_THRESHOLD symbols it also gets an open-addressing hash index,
+ * so the symbol lookups done by training and traversal don't have to
+ * scan the whole stats array.  Each hash slot holds a stats index + 1
+ * (0 means the slot is empty), and hash_mask is the number of slots - 1.
+ * The stats array itself stays sorted by count, the index just has to
+ * be patched whenever update_table swaps two entries.
+ *
+ * Tables with DENSE_THRESHOLD symbols or more (the root and the
+ * order-1 tables, mostly) get a dense index instead: hash has a slot
+ * for every symbol from LOWEST_BOX_SYMBOL to FINAL_START_TIME, at
+ * DENSE_SLOT( symbol ), so finding one of those is a single load.
+ * The slots hold a stats index + 1 just the same, and hash_mask is
+ * DENSE_INDEX.  A few symbols outside that range (such as the 0 the
+ * root starts out with) are kept in a short list after the slots:
+ * hash[ DENSE_SLOTS ] is how many there are, and the stats indexes
+ * + 1 follow it.  A table with more than DENSE_SPILL of them keeps
+ * its hash index.
+ *
+ * lesser_refs counts the tables whose lesser_context points here.  A
+ * table that has emptied out can only be removed from a decaying
+ * model when nothing else points to it (see set_model_decay()).
+ *
+ * total_counts is the sum of all the counts in the stats array, kept
+ * up to date as the counts change, so predict_in_context() doesn't
+ * have to add them up over the whole table for every prediction.
  */
+#define INLINE_SYMBOLS		1		// entries a table can keep inside its CONTEXT
+
 typedef struct context {
                          int max_index;
+                         int capacity;
                          LINKS __handle *links;
                          STATS __handle *stats;
                          struct context *lesser_context;
+                         int lesser_refs;
+                         int total_counts;
+                         union {
+                                 struct {
+                                          int *hash;
+                                          int hash_mask;
+                                        };
+                                 struct {
+                                          STATS inline_stats[ INLINE_SYMBOLS ];
+                                          LINKS inline_links[ INLINE_SYMBOLS ];
+                                        };
+                               };
                        } CONTEXT;
 
+#define IS_INLINE( table )		( (table)->stats == (table)->inline_stats )
+#define HAS_INDEX( table )		( !IS_INLINE( table ) && (table)->hash != NULL )
+
+#define DENSE_INDEX			-1		// hash_mask of a table with a dense index
+#define DENSE_SLOTS			( FINAL_START_TIME - LOWEST_BOX_SYMBOL + 1 )
+#define DENSE_SPILL			7		// most symbols a dense index keeps outside its slots
+#define IN_DENSE_RANGE( s )	( (s) >= LOWEST_BOX_SYMBOL && (s) <= FINAL_START_TIME )
+#define DENSE_SLOT( s )		( (s) - LOWEST_BOX_SYMBOL )
+// The number of ints in a table's index (which it has to have)
+#define INDEX_SLOTS( table )	( ( (table)->hash_mask == DENSE_INDEX ) ? DENSE_SLOTS + 1 + DENSE_SPILL : (table)->hash_mask + 1 )
+
+/*
+ * A DECAY_CURSOR keeps track of where a model is in its current decay
+ * pass, which is flush_model() broken up into small steps.  The tables
+ * on the path from the order 0 table down to the table being visited
+ * are in tables[], and next_link[] says which link of each one to
+ * follow next.  depth is 0 when no pass is in progress.
+ */
+typedef struct {
+                CONTEXT *tables[ MAX_DEPTH ];
+                int next_link[ MAX_DEPTH ];
+                int depth;
+                int steps;			// tables to rescale per symbol in this pass
+                int burst;			// extra tables per symbol near the memory limit
+               } DECAY_CURSOR;
+
+/*
+ * A MODEL holds everything that belongs to one model, so that a
+ * program can keep as many models as it likes:
+ *
+ * max_order is the maximum order that will be maintained by the model.
+ *
+ * *contexts[] is an array of current contexts.  If I want to find
+ * the order 0 context for the current state of the model, I just
+ * look at contexts[0].  This array of context pointers is set up
+ * every time the model is updated.  The indices go from -2 up to
+ * max_order.
+ *
+ * current_order contains the current order of the model while it is
+ * being trained.
+ *
+ * flushing_enabled tells COMP-2.C that the FLUSH symbol can be
+ * sent using this model.
+ *
+ * All of the memory used by the model comes out of its arena: the
+ * CONTEXT tables themselves, and their stats, links and hash arrays.
+ * Freeing the arena frees the whole model.
+ *
+ * decay_interval and memory_limit are set by set_model_decay().  If
+ * either one is set, training slowly halves every count in the model
+ * and removes the tables and counters that drop to 0.
+ */
+typedef struct {
+                int max_order;
+                CONTEXT **contexts;
+                int current_order;
+                int flushing_enabled;
+                ARENA *arena;
+                int alloc_count;		// number of CONTEXT structs allocated.
+                int decay_interval;		// halve all counts every decay_interval symbols, 0 = never
+                size_t memory_limit;	// most bytes the arena should have in use, 0 = no limit
+                long symbols_since_decay;	// symbols trained since the last decay pass started
+                DECAY_CURSOR decay;
+               } MODEL;
+
+/*
+ * A MODEL_CURSOR holds the scratch space for looking things up in a
+ * model, which used to be shared by everything that used the model:
+ *
+ * *contexts[] is set up by traverse_tree() to point to the tables
+ * along the path to the context being looked up (from -2 up to the
+ * order that was found).  The training contexts in the MODEL aren't
+ * touched.
+ *
+ * current_order contains the order of the context being used.  It is
+ * set by traverse_tree() (or advance_context()), and is decremented every time an ESCAPE is
+ * sent.  It will only go down to -1 for normal symbols, but can go to
+ * -2 for EOF and FLUSH.
+ *
+ * totals[] contains the cumulative totals for the current context.
+ * Because this program is using exclusion, totals has to be calculated
+ * every time a context is used.  The scoreboard array keeps track of
+ * symbols that have appeared in higher order models, so that they
+ * can be excluded from lower order context total calculations.
+ * Rather than a flag, each place on the scoreboard holds the epoch
+ * it was last set in, and only the ones set in the current epoch
+ * count.  clear_scoreboard() just starts a new epoch, so it costs
+ * the same no matter how big the range of symbols is (the array
+ * only gets zeroed when the epoch wraps around).
+ *
+ * shift is how far totalize_table() had to shift the counts of the
+ * last table it totaled down to keep them in range.  The table itself
+ * never gets rescaled by a lookup: looking things up only reads the
+ * model, so any number of threads can use the same model at once, as
+ * long as each has a cursor of its own (and nothing is training it).
+ */
+typedef struct {
+                MODEL *model;
+                CONTEXT *context_tables[ MAX_DEPTH ];
+                CONTEXT **contexts;		// context_tables + 2, so it can be indexed from -2
+                int current_order;
+                CONTEXT *walk_table;	// where advance_context() is, and its order
+                int walk_order;
+                short int totals[ RANGE_OF_SYMBOLS+2 ];
+                int shift;
+                unsigned short epoch;	// current scoreboard epoch, never 0
+                unsigned short scoreboard[ RANGE_OF_SYMBOLS ];
+               } MODEL_CURSOR;
+
 /*
  * This structure holds the results of a prediction, including the predicted
  * next symbol and it's probability (prob_numerator/prob_denominator).
@@ -146,22 +315,40 @@ typedef struct {
 /*
  * Prototypes for routines that can be called from MODEL-X.C
  */
-void initialize_model( void );
-void update_model( SYMBOL_TYPE symbol );
-void clear_current_order(void);
-int convert_int_to_symbol( SYMBOL_TYPE c, SYMBOL *s );
-//void get_symbol_scale( SYMBOL *s );
+MODEL *initialize_model( int max_order );
+void update_model( MODEL *model, SYMBOL_TYPE symbol );
+void clear_current_order( MODEL *model );
+int convert_int_to_symbol( MODEL_CURSOR *cursor, SYMBOL_TYPE c, SYMBOL *s );
+//void get_symbol_scale( MODEL_CURSOR *cursor, SYMBOL *s );
 //int convert_symbol_to_int( int count, SYMBOL *s );
-void add_character_to_model( SYMBOL_TYPE c );
-void flush_model( void );
-void print_model(void);
-void recursive_print( int depth, CONTEXT * table);
-float probability( SYMBOL_TYPE c, STRING16 * context_string, char verbose);
-unsigned char predict_next(STRING16 * context_string, STRUCT_PREDICTION * results);
-void print_model_allocation();
-void traverse_tree( STRING16 * context_string);
-void clear_scoreboard(void);
-float compute_logloss( STRING16 * test_string, int verbose);
+void add_character_to_model( MODEL *model, SYMBOL_TYPE c );
+void train_model( MODEL *model, SYMBOL_TYPE *symbols, long length );
+void flush_model( MODEL *model );
+void set_model_decay( MODEL *model, int decay_interval, size_t memory_limit );
+void print_model( MODEL *model );
+void recursive_print( MODEL *model, int depth, CONTEXT * table);
+float probability( MODEL_CURSOR *cursor, SYMBOL_TYPE c, STRING16_VIEW * context_string, char verbose);
+unsigned char predict_next( MODEL_CURSOR *cursor, STRING16_VIEW * context_string, STRUCT_PREDICTION * results);
+unsigned char predict_in_context( MODEL_CURSOR *cursor, int order, STRUCT_PREDICTION * results);
+void predict_next_batch( MODEL_CURSOR *cursor, int n, STRING16_VIEW *context_strings, STRUCT_PREDICTION *results );
+void print_model_allocation( MODEL *model );
+void free_model( MODEL *model );
+MODEL_CURSOR *model_cursor( MODEL *model );
+void delete_model_cursor( MODEL_CURSOR *cursor );
+int save_model( MODEL *model, FILE *file );
+MODEL *load_model( FILE *file );
+int freeze_model( MODEL *model, FILE *file );
+void traverse_tree( MODEL_CURSOR *cursor, STRING16_VIEW * context_string);
+int suffix_contexts( MODEL_CURSOR *cursor, STRING16_VIEW * context_string);
+int current_contexts( MODEL_CURSOR *cursor );
+void start_context( MODEL_CURSOR *cursor );
+int advance_context( MODEL_CURSOR *cursor, SYMBOL_TYPE c, int max_order );
+float symbol_probability( MODEL_CURSOR *cursor, SYMBOL_TYPE c, int order);
+void clear_scoreboard( MODEL_CURSOR *cursor );
+float compute_logloss( MODEL_CURSOR *cursor, STRING16 * test_string, int verbose);
+float compute_logloss_file( MODEL_CURSOR *cursor, FILE *test_file, int verbose);
+float average_logloss( double summation, long length, int verbose);
+double logloss_sum( MODEL_CURSOR *cursor, STRING16 * test_string, int start, long position, int verbose);
 
 
 
@@ -24,29 +24,80 @@
  * -delimiters string_of_delimeters	# characters in this string are ignored in prediction results.
  * (The -delimeters option is not supported in the 16bit version)
  * -input_type representation_type		# denotes type of input.  If verbose is set, outputs change by representation used.
+ * -alloc						# print the model's memory usage after training
+ * -save-model model_file_name	# save the trained model to a file
+ * -load-model model_file_name	# start from a saved model instead of training (-f is then optional,
+ * 								# and trains the loaded model some more)
+ * -freeze-model image_file_name	# write the trained model as a read-only image
+ * -image image_file_name		# predict from a frozen image (no training, -f not allowed)
+ * -batch manifest_file_name	# run every prediction test listed in the manifest (see batch.h)
+ * -threads n					# number of threads for -batch [defaults to one per processor]
+ * -orders order,order,...		# train once at the highest order, and test (-p or -logloss) every
+ * 								# order in one pass.  Prints the -p line for each, with the log-loss added.
+ * -stream stream_file_name		# predict each symbol as it arrives, then learn it ("-" for stdin).
+ * 								# -f is optional.  -save-model and -freeze-model save the model
+ * 								# as it is at the end of the stream.
+ * -decay n						# halve every count in the model every n symbols it trains on,
+ * 								# a little at a time, and drop the counts that reach 0
+ * -memory-limit bytes			# keep the model under this many bytes (k, M or G can follow the
+ * 								# number) by decaying it whenever it gets close
+ * -apmap ap_map_file_name		# use this AP map (text or binary, see apmap.h) for is_neighbor
+ * 								# instead of the one built in from mapping.h
+ * -save-apmap ap_map_file_name	# write the AP map in use in the binary form
+ * -counters json_file_name		# write the hot path counters (see counters.h) as JSON at the end.
+ * 								# Only in a build with PREDICT_COUNTERS defined.
+ * -results results_file_name	# write a binary record of every prediction -p makes (see sink.h)
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>		// for log10() function;
+#include <time.h>		// for clock_gettime()
 #include "coder.h"
 #include "model.h"
 //include <bitio.h>
 #include "predict.h"
 #include "string16.h"
-#include "mapping.h"	// for ap mapping, ap neighbors, timeslot mapping
+#include "ingest.h"		// for loading the training file
+#include "image.h"		// for frozen model images
+#include "batch.h"		// for -batch
+#include "apmap.h"		// for neighboring_ap()
+#include "counters.h"	// for -counters
 
 /*
  * The file pointers are used throughout this module.
  */
 FILE *training_file;		// File containing string to train on.
 FILE *test_file;			// File to test against (form future predictions)
+FILE *load_model_file;		// Saved model to start from (-load-model)
+FILE *save_model_file;		// File to save the trained model in (-save-model)
+FILE *freeze_model_file;	// File to write the frozen model image to (-freeze-model)
+FILE *batch_file;			// Manifest of prediction tests to run (-batch)
+FILE *stream_file;			// Symbols to predict and learn as they arrive (-stream)
+FILE *save_ap_map_file;		// File to write the AP map to (-save-apmap)
+AP_MAP *loaded_ap_map;		// AP map read from a file (-apmap), NULL for the built in one
+FILE *counters_file;		// File to write the counters to (-counters)
+FILE *results_file;			// File to write the prediction records to (-results)
+RESULT_SINK *text_sink;		// The test results, on their way to stdout
+RESULT_SINK *record_sink;	// The prediction records, on their way to results_file
+int num_threads = 0;		// number of threads for -batch, 0 = one per processor
+int orders[ MAX_ORDERS ];	// orders to test in one pass (-orders), lowest first
+int num_orders = 0;
+int decay_interval = 0;		// symbols between decay passes (-decay), 0 = no decay
+long memory_limit = 0;		// most bytes the model can use (-memory-limit), 0 = no limit
+MODEL *model;				// The model being trained and tested
+MODEL_IMAGE *model_image;	// Frozen model to predict from, instead of the live model (-image)
+int max_order = 3;			// order of the model (-o), or the order of the loaded model
 char verbose = FALSE;		// if true, print out lots of info
+char show_allocation = FALSE;	// if true, print memory usage after training
 
 //unsigned int str_delimiters[10];		// delimeters to ignore in prediction tests.
 int  representation;		// specified with -input_type argument.
 
+char str_representations[][21]={"Unknown","Locstrings","Loctimestrings","Boxstrings","Binboxstrings", "BinDOWts"};
+char str_mappings[][6] = {"LOC", "STRT", "DUR", "DELIM"};
+
 
 /*
  * The main procedure is similar to the main found in COMP-1.C.
@@ -70,41 +121,99 @@ int  representation;		// specified with -input_type argument.
  */
 int main( int argc, char **argv )
 {
-     SYMBOL_TYPE c;
      int function;		// function to perform
-     STRING16 * test_string;
+     SYMBOL_SPAN training_symbols;	// contents of the training file
+     MODEL_CURSOR *query;			// for looking things up in the model
+     IMAGE_CURSOR *image_query;		// for looking things up in a frozen model
+     TEST_RESULTS results;			// results of predict_test()
+     TEST_RESULTS order_results[ MAX_ORDERS ];	// results for each order (-orders)
 
      int i;				// general purpose register
 
     /* Initialize ********************************************/
     function = initialize_options( --argc, ++argv );
-    initialize_model();
-    test_string = string16(MAX_STRING_LENGTH+1);
+    text_sink = open_sink( stdout, FALSE, 0);		// (stdout has the buffer, see initialize_options())
+    if (results_file != NULL)
+    	record_sink = open_sink( results_file, TRUE, SINK_BUFFER_SIZE);
+    if (text_sink == NULL || (results_file != NULL && record_sink == NULL))	{
+    	printf( "Had trouble setting up the output buffers\n" );
+    	exit( -1 );
+    	}
+    if (loaded_ap_map == NULL)	{
+    	loaded_ap_map = builtin_ap_map();
+    	if (loaded_ap_map == NULL)	{
+    		printf( "Had trouble building the AP map\n" );
+    		exit( -1 );
+    		}
+    	}
+    set_ap_map( loaded_ap_map);
+    if (save_ap_map_file != NULL)	{
+    	if (save_ap_map( loaded_ap_map, save_ap_map_file) != 0)	{
+    		printf( "Had trouble writing the AP map (option -save-apmap)\n" );
+    		exit( -1 );
+    		}
+    	fclose( save_ap_map_file);
+    	}
+    if (function == BATCH_TEST)	{
+    	// Every job builds its own model
+    	i = run_batch( batch_file, num_threads, max_order, representation, stdout);
+    	fclose( batch_file);
+    	if (i < 0)
+    		printf( "Had trouble reading the batch manifest (option -batch)\n" );
+    	if (counters_file != NULL)	{
+    		if (write_counters( counters_file, NULL) != 0)
+    			printf( "Had trouble writing the counters (option -counters)\n" );
+    		fclose( counters_file);
+    		}
+    	if (close_results() != 0)
+    		i = -1;
+    	exit( i == 0 ? 0 : -1 );
+    	}
+    PHASE_START( ingest_start);
+    if (model_image != NULL)
+    	max_order = model_image->max_order;		// nothing to build or train
+    else if (load_model_file != NULL)	{
+    	// The saved model sets max_order
+    	model = load_model( load_model_file);
+    	if (model == NULL)	{
+    		printf( "Had trouble reading the model file (option -load-model)\n" );
+    		exit( -1 );
+    		}
+    	max_order = model->max_order;
+    	fclose( load_model_file);
+    	if (num_orders > 0 && max_order < orders[ num_orders-1 ])	{
+    		printf( "The loaded model is order %d, too low for option -orders\n", max_order );
+    		exit( -1 );
+    		}
+    	}
+    else
+    	model = initialize_model( max_order);
+    if (model != NULL && (decay_interval > 0 || memory_limit > 0))
+    	set_model_decay( model, decay_interval, (size_t) memory_limit);
 
     /* Train the model on the given input training file ***********/
-    for ( ; ; )
-    {
-     		if (fread(&c, sizeof(SYMBOL_TYPE),1,training_file) == 0)
-    			c = DONE;
-    		/* NOTE: fread() seems to skip over whitespace chars, so be careful what's in your bin file. */
-    		//printf("Training on 0x%04x\n", c);
-            /*** The 16-bit version does not currently support delimiter-removal
-            **  if (strchr(str_delimiters, c) != NULL)	{
-    		** 	//printf("Skipping training on '%c'\n",c);
-    		**	continue;					// This char is a delimiter, go onto the next character
-    		** }
-    		****************/
-//       if ( c == EOF  || c == '\n' || c == 0x0a)	// skip line feeds
-//            c = DONE;
-       	clear_current_order();
-        if ( c == DONE )
-        	break;
-        update_model( c );
-        add_character_to_model( c );
-    }
+    // The whole file is loaded (mapped) at once and checked in one pass.
+    // Training stops at a DONE symbol or at the end of the file.
+    if (training_file != NULL)	{
+    	if (load_symbol_span( &training_symbols, training_file) != 0)	{
+    		printf( "Had trouble reading the input training file!\n" );
+    		exit( -1 );
+    		}
+    	if (verbose && training_symbols.skipped_symbols)
+    		printf("Skipped %ld negative symbols in the training file\n", training_symbols.skipped_symbols);
+    	PHASE_END( PHASE_INGEST, ingest_start);
+    	PHASE_START( train_start);
+    	train_model( model, training_symbols.s, training_symbols.length);
+    	free_symbol_span( &training_symbols);
+    	fclose( training_file);
+    	PHASE_END( PHASE_TRAIN, train_start);
+    	}
+    else
+    	PHASE_END( PHASE_INGEST, ingest_start);
 
     /*** Print information about the model */
-//    print_model_allocation();
+    if (show_allocation)
+    	print_model_allocation( model);
 //    if (verbose)
 //    	print_model();
 	/***************************************/
@@ -150,26 +259,72 @@ int main( int argc, char **argv )
 
 	******************************************/
 
+	PHASE_START( evaluate_start);
 	switch (function)	{
     	case PREDICT_TEST:
-    		// read test file
-    		i = fread16( test_string, MAX_STRING_LENGTH, test_file);
-    		if (i == MAX_STRING_LENGTH)
-    			fprintf(stderr,"Test String may be over max length and may have been truncated.\n");
-    		predict_test(test_string);
+    		// The test file is read a chunk at a time, so it can be any length
+    		predict_test( model, model_image, max_order, representation, test_file, 0, NULL, &results);
+    		print_test_results( stdout, &results, verbose);
     		break;
     	case LOGLOSS_EVAL:
-    		// read test file
-    		//fgets(test_string, MAX_STRING_LENGTH, test_file);
-    		i = fread16( test_string, MAX_STRING_LENGTH, test_file);
-    		if (i == MAX_STRING_LENGTH)
-    			fprintf(stderr,"Test String may be over max length and may have been truncated.\n");
-    		printf("%d, %f\n", max_order, compute_logloss(test_string, verbose));
+    		// (so can this one)
+    		if (model_image != NULL)	{
+    			image_query = image_cursor( model_image);
+    			printf("%d, %f\n", max_order, image_compute_logloss_file(image_query, test_file, verbose));
+    			delete_image_cursor( image_query);
+    			}
+    		else	{
+    			query = model_cursor( model);
+    			printf("%d, %f\n", max_order, compute_logloss_file(query, test_file, verbose));
+    			delete_model_cursor( query);
+    			}
+    		break;
+    	case ORDERS_TEST:
+    		// (and this one)
+    		predict_test_orders( model, num_orders, orders, representation, test_file, order_results);
+    		for (i = 0; i < num_orders; i++)
+    			print_test_results( stdout, &order_results[ i ], verbose);
+    		break;
+    	case STREAM_TEST:
+    		stream_test( model, stream_file, representation);
+    		if (stream_file != stdin)
+    			fclose( stream_file);
     		break;
      	case NO_FUNCTION:
     	default:
     		break;
     	}
+	PHASE_END( PHASE_EVALUATE, evaluate_start);
+
+    /*** Save the trained model (after -stream, with everything it learned) */
+    if (save_model_file != NULL)	{
+    	if (save_model( model, save_model_file) != 0)	{
+    		printf( "Had trouble writing the model file (option -save-model)\n" );
+    		exit( -1 );
+    		}
+    	fclose( save_model_file);
+    	}
+    if (freeze_model_file != NULL)	{
+    	if (freeze_model( model, freeze_model_file) != 0)	{
+    		printf( "Had trouble writing the model image (option -freeze-model)\n" );
+    		exit( -1 );
+    		}
+    	fclose( freeze_model_file);
+    	}
+    if (counters_file != NULL)	{
+    	if (write_counters( counters_file, model) != 0)	{
+    		printf( "Had trouble writing the counters (option -counters)\n" );
+    		exit( -1 );
+    		}
+    	fclose( counters_file);
+    	}
+    if (close_results() != 0)
+    	exit( -1 );
+    if (model_image != NULL)
+    	close_image( model_image);
+    else
+    	free_model( model);
+    free_ap_map( loaded_ap_map);
     exit( 0 );
 }
 
@@ -187,12 +342,14 @@ int initialize_options( int argc, char **argv )
     char test_file_name[ 81 ];
     int function = NO_FUNCTION;
     char str_type[41];
+    FILE *ap_map_file;
 
     	/* Set Defaults */
 #ifdef NOT_USED_IN_16_BIT_VERSION
     str_delimiters[0] = '\0';		// clear delimeter string
 #endif
     str_type[0] = '\0';				// clear string_type
+    training_file_name[0] = '\0';	// no training file (allowed with -load-model)
     representation = NONE;
 
 //    strcpy( training_file_name, "test.inp" );
@@ -236,6 +393,182 @@ int initialize_options( int argc, char **argv )
         	argc--;
             verbose = TRUE;			// print out prediction information
         	}
+        // -alloc
+        else if ( strcmp( *argv, "-alloc" ) == 0 )
+        	{
+            show_allocation = TRUE;	// print out memory usage
+        	}
+        // -save-model <filename>
+        else if ( strcmp( *argv, "-save-model" ) == 0 )
+        	{
+        	argc--;
+        	save_model_file = fopen( *++argv, "wb");
+        	if ( save_model_file == NULL )
+        		{
+        		printf( "Had trouble opening the model file (option -save-model)\n" );
+        		exit( -1 );
+        		}
+        	setvbuf( save_model_file, NULL, _IOFBF, 1 << 16 );
+        	}
+        // -load-model <filename>
+        else if ( strcmp( *argv, "-load-model" ) == 0 )
+        	{
+        	argc--;
+        	load_model_file = fopen( *++argv, "rb");
+        	if ( load_model_file == NULL )
+        		{
+        		printf( "Had trouble opening the model file (option -load-model)\n" );
+        		exit( -1 );
+        		}
+        	setvbuf( load_model_file, NULL, _IOFBF, 1 << 16 );
+        	}
+        // -freeze-model <filename>
+        else if ( strcmp( *argv, "-freeze-model" ) == 0 )
+        	{
+        	argc--;
+        	freeze_model_file = fopen( *++argv, "wb");
+        	if ( freeze_model_file == NULL )
+        		{
+        		printf( "Had trouble opening the model image (option -freeze-model)\n" );
+        		exit( -1 );
+        		}
+        	setvbuf( freeze_model_file, NULL, _IOFBF, 1 << 16 );
+        	}
+        // -image <filename>
+        else if ( strcmp( *argv, "-image" ) == 0 )
+        	{
+        	argc--;
+        	model_image = open_image( *++argv );
+        	if ( model_image == NULL )
+        		{
+        		printf( "Had trouble opening the model image (option -image)\n" );
+        		exit( -1 );
+        		}
+        	}
+        // -apmap <filename>
+        else if ( strcmp( *argv, "-apmap" ) == 0 )
+        	{
+        	argc--;
+        	ap_map_file = fopen( *++argv, "rb");
+        	if ( ap_map_file == NULL )
+        		{
+        		printf( "Had trouble opening the AP map (option -apmap)\n" );
+        		exit( -1 );
+        		}
+        	free_ap_map( loaded_ap_map);
+        	loaded_ap_map = load_ap_map( ap_map_file);
+        	fclose( ap_map_file);
+        	if ( loaded_ap_map == NULL )
+        		{
+        		printf( "Had trouble reading the AP map (option -apmap)\n" );
+        		exit( -1 );
+        		}
+        	}
+        // -save-apmap <filename>
+        else if ( strcmp( *argv, "-save-apmap" ) == 0 )
+        	{
+        	argc--;
+        	save_ap_map_file = fopen( *++argv, "wb");
+        	if ( save_ap_map_file == NULL )
+        		{
+        		printf( "Had trouble opening the AP map file (option -save-apmap)\n" );
+        		exit( -1 );
+        		}
+        	}
+        // -counters <filename>
+        else if ( strcmp( *argv, "-counters" ) == 0 )
+        	{
+        	argc--;
+        	if ( !counters_enabled() )
+        		{
+        		printf( "The -counters option needs a build with PREDICT_COUNTERS defined (see counters.h)\n" );
+        		exit( -1 );
+        		}
+        	counters_file = fopen( *++argv, "w");
+        	if ( counters_file == NULL )
+        		{
+        		printf( "Had trouble opening the counters file (option -counters)\n" );
+        		exit( -1 );
+        		}
+        	}
+        // -results <filename>
+        else if ( strcmp( *argv, "-results" ) == 0 )
+        	{
+        	argc--;
+        	results_file = fopen( *++argv, "wb");
+        	if ( results_file == NULL )
+        		{
+        		printf( "Had trouble opening the results file (option -results)\n" );
+        		exit( -1 );
+        		}
+        	}
+        // -batch <manifest filename>
+        else if ( strcmp( *argv, "-batch" ) == 0 )
+        	{
+        	argc--;
+        	batch_file = fopen( *++argv, "r");
+        	if ( batch_file == NULL )
+        		{
+        		printf( "Had trouble opening the batch manifest (option -batch)\n" );
+        		exit( -1 );
+        		}
+        	}
+        // -threads <number of threads>
+        else if ( strcmp( *argv, "-threads" ) == 0 )
+        	{
+        	argc--;
+        	num_threads = atoi( *++argv );
+        	if (num_threads < 0 || num_threads > MAX_BATCH_THREADS)	{
+        		printf( "The number of threads (option -threads) must be from 0 to %d\n", MAX_BATCH_THREADS );
+        		exit( -1 );
+        		}
+        	}
+        // -orders <order,order,...>
+        else if ( strcmp( *argv, "-orders" ) == 0 )
+        	{
+        	argc--;
+        	num_orders = parse_orders( *++argv, orders );
+        	if (num_orders <= 0)	{
+        		printf( "The -orders option needs a list of up to %d different orders from 1 to %d, like 1,3,5,7\n",
+        				MAX_ORDERS, MAX_DEPTH - 3 );
+        		exit( -1 );
+        		}
+        	}
+        // -decay <number of symbols>
+        else if ( strcmp( *argv, "-decay" ) == 0 )
+        	{
+        	argc--;
+        	decay_interval = atoi( *++argv );
+        	if (decay_interval <= 0)	{
+        		printf( "The -decay option needs a number of symbols greater than 0\n" );
+        		exit( -1 );
+        		}
+        	}
+        // -memory-limit <bytes>
+        else if ( strcmp( *argv, "-memory-limit" ) == 0 )
+        	{
+        	argc--;
+        	memory_limit = parse_byte_count( *++argv );
+        	if (memory_limit <= 0)	{
+        		printf( "The -memory-limit option needs a number of bytes, like 500000, 64k or 2M\n" );
+        		exit( -1 );
+        		}
+        	}
+        // -stream <filename>, or - for stdin
+        else if ( strcmp( *argv, "-stream" ) == 0 )
+        	{
+        	argc--;
+        	if ( strcmp( *++argv, "-" ) == 0 )
+        		stream_file = stdin;
+        	else
+        		stream_file = fopen( *argv, "rb");
+        	if ( stream_file == NULL )
+        		{
+        		printf( "Had trouble opening the stream (option -stream)\n" );
+        		exit( -1 );
+        		}
+        	function = STREAM_TEST;
+        	}
         // -logloss <test filename>
          else if ( strcmp( *argv, "-logloss" ) == 0 )
          	{
@@ -264,18 +597,7 @@ int initialize_options( int argc, char **argv )
          else if ( strcmp( *argv, "-input_type" ) == 0 ) 	{
         	argc--;
         	strcpy( str_type, *++argv );
-        	if (strcmp(str_type, "locstrings") == 0)
-        		representation = LOCSTRINGS;
-        	else if (strcmp(str_type, "loctimestrings")== 0)
-        		representation = LOCTIMESTRINGS;
-        	else if (strcmp(str_type, "boxstrings") == 0)
-            	representation = BOXSTRINGS;
-        	else if (strcmp(str_type, "binboxstrings") == 0)
-            	representation = BINBOXSTRINGS;
-        	else if (strcmp(str_type, "bindowts") == 0)
-            	representation = BINDOWTS;
-        	else
-        		representation = NONE;
+        	representation = get_representation( str_type);
            	if (verbose)
        			printf("Input string type is %d (%s)\n",
         				representation,
@@ -284,32 +606,96 @@ int initialize_options( int argc, char **argv )
        else
         	{
             fprintf( stderr, "\nUsage: predict_MELT [-o order] [-v] [-logloss predictfile] " );
-            fprintf( stderr, "[-f text file] [-p predictfile] [-input_type string_type]\n" );
+            fprintf( stderr, "[-f text file] [-p predictfile] [-input_type string_type] [-alloc]\n" );
+            fprintf( stderr, "       [-save-model model_file] [-load-model model_file] [-freeze-model image_file] [-image image_file]\n" );
+            fprintf( stderr, "       [-batch manifest_file [-threads n]] [-orders order,order,...] [-stream stream_file]\n" );
+            fprintf( stderr, "       [-decay n] [-memory-limit bytes] [-apmap ap_map_file] [-save-apmap ap_map_file]\n" );
+            fprintf( stderr, "       [-counters json_file] [-results results_file]\n" );
             fprintf( stdout, "\nUsage: predict_MELT [-o order] [-v] [-logloss predictfile] " );
-            fprintf( stdout, "[-f text file] [-p predictfile] [-input_type string_type]\n" );
+            fprintf( stdout, "[-f text file] [-p predictfile] [-input_type string_type] [-alloc]\n" );
+            fprintf( stdout, "       [-save-model model_file] [-load-model model_file] [-freeze-model image_file] [-image image_file]\n" );
+            fprintf( stdout, "       [-batch manifest_file [-threads n]] [-orders order,order,...] [-stream stream_file]\n" );
+            fprintf( stdout, "       [-decay n] [-memory-limit bytes] [-apmap ap_map_file] [-save-apmap ap_map_file]\n" );
+            fprintf( stdout, "       [-counters json_file] [-results results_file]\n" );
              exit( -1 );
         	}
         argc--;
         argv++;
     	}
-    training_file = fopen( training_file_name, "rb" );
-    if (verbose)
-    	fprintf(stdout,"%s\n", training_file_name);
-    if ( training_file == NULL  )
+    // A batch brings its own files, and only uses -o and -input_type as defaults.
+    if ( batch_file != NULL )
     	{
-        printf( "Had trouble opening the input training file %s!\n", training_file_name );
-        exit( -1 );
+    	if ( training_file_name[0] != '\0' || test_file != NULL || verbose || num_orders > 0 || stream_file != NULL ||
+    			load_model_file != NULL || model_image != NULL || decay_interval > 0 || memory_limit > 0 ||
+    			save_model_file != NULL || freeze_model_file != NULL || show_allocation )
+    		{
+    		printf( "The -batch option can only be used with -o, -input_type, -threads, -apmap, -counters and -results\n" );
+    		exit( -1 );
+    		}
+    	setbuf( stdout, NULL );
+    	return( BATCH_TEST );
     	}
-    // Setup full buffering w/ a 4K buffer. (for speed)
-    setvbuf( training_file, NULL, _IOFBF, 4096 );
-    setbuf( stdout, NULL );
+    // A stream is tested on its own, and the model has to be able to learn
+    if ( stream_file != NULL &&
+    		( test_file != NULL || num_orders > 0 || model_image != NULL ) )
+    	{
+    	printf( "The -stream option can't be used with -p, -logloss, -orders or -image\n" );
+    	exit( -1 );
+    	}
+    // Train once, at the highest of the -orders
+    if ( num_orders > 0 )
+    	{
+    	if ( model_image != NULL )
+    		{
+    		printf( "The -orders option can't be used with -image\n" );
+    		exit( -1 );
+    		}
+    	max_order = orders[ num_orders-1 ];
+    	if ( function != NO_FUNCTION )
+    		function = ORDERS_TEST;
+    	}
+    // With a saved model or a stream, training on -f is optional.  A frozen image can't be trained.
+    if ( model_image != NULL &&
+    		( training_file_name[0] != '\0' || load_model_file != NULL ||
+    		  save_model_file != NULL || freeze_model_file != NULL || show_allocation ) )
+    	{
+    	printf( "The -image option can't be used with -f, -load-model, -save-model, -freeze-model or -alloc\n" );
+    	exit( -1 );
+    	}
+    if ( model_image != NULL && ( decay_interval > 0 || memory_limit > 0 ) )
+    	{
+    	printf( "A frozen image (option -image) can't decay\n" );
+    	exit( -1 );
+    	}
+    if ( ( load_model_file != NULL || model_image != NULL || stream_file != NULL ) && training_file_name[0] == '\0' )
+    	training_file = NULL;
+    else	{
+    	training_file = fopen( training_file_name, "rb" );
+    	if (verbose)
+    		fprintf(stdout,"%s\n", training_file_name);
+    	if ( training_file == NULL  )
+    		{
+    		printf( "Had trouble opening the input training file %s!\n", training_file_name );
+    		exit( -1 );
+    		}
+    	}
+    // (The training file is mapped into memory in one piece by main())
+    // The test results are written a big piece at a time (see sink.h), but the
+    // predictions for a stream should show up as soon as they are made.
+    if ( function == STREAM_TEST )
+    	setbuf( stdout, NULL );
+    else
+    	setvbuf( stdout, NULL, _IOFBF, SINK_BUFFER_SIZE );
     return( function );
    }
 
 /*******************************************
  * predict_test
  *
- * Given a test string, test each character of the string.
+ * Given a test file, test each character of it.  The file is read
+ * MAX_STRING_LENGTH symbols at a time (see fread16_chunk()), so it
+ * can be as long as it likes, and the results are the same as if
+ * it were one test string.
  * For example, if the test string is "abc", call
  * predict_next() for each substring:
  * 		predict_next("", &pred);
@@ -320,110 +706,448 @@ int initialize_options( int argc, char **argv )
  * first character in each pair as context and the second to predict.
  * (Of course, this assumes 1st order, and a representation of
  * <time,loc> pairs (aka binboxstrings).)
+ *
+ * Everything it needs is passed in, so tests on different models
+ * can run at the same time (see batch.c).
  * INPUTS:
- * 	  test_string = pointer to string to test.
+ *    model = model to predict from, or NULL to use image
+ *    image = frozen model to predict from, or NULL
+ *    max_order = order of the model
+ *    representation = type of input string (-input_type)
+ * 	  test_file = file of symbols to test.
+ *    test = which test this is, for the -results records
+ * OUTPUTS:
+ *    results = the test results (print them with print_test_results())
  *
  * RETURNS: nothing
  * *********************************************/
-void predict_test( STRING16 * test_string){
+void predict_test( MODEL *model, MODEL_IMAGE *image, int max_order, int representation,
+		FILE *test_file, int test, const char *job_id, TEST_RESULTS *results){
+	STRING16 * test_string;	// the chunk of the test file being tested
 	int i;			// index into test string
-	int j;			// counter into # predictions
+	int n;			// number of new symbols in it
 	int length;		// string length
+	long position = 0;	// position of test_string[ i ] in the whole file
+	STRING16_VIEW new_symbols;	// the part of it that wasn't in the last chunk
 	SYMBOL_TYPE predicted_char;
-	int mapping;	// type of symbol (LOC, DUR, DELIM, etc)
-	int num_tested=0, num_right=0;		// test results
     STRUCT_PREDICTION pred;
-    int num_locations = 0;
-    STRING16 *str_sub;		// sub-strings (chunks of context)
-	int number_fallbacks_to_zero_but_still_right = 0;  // number of times it fell to level 0 and was still right.
-	int total_fallbacks_to_zero = 0;	// number of times model went to level 0 for a prediction
-	int number_multiple_predictions = 0; //number fo times model made > 1 prediction for a given time.
-	int number_times_neighbors_are_correct = 0;	// number of times the prediction is a neighbor of actual
-	unsigned char predicted_correctly;		// true if one of the predictions for a particular time are correct
-	unsigned char is_neighbor;				// true if two aps are neighbors
-	
-	if (verbose)	{
-    	printf("Testing on string %s\n", format_string16(test_string));
-//    	if (strlen( str_delimiters))
-//    		printf("ignoring characters in \"%s\"\n", str_delimiters);
-       	printf("expected symbol, predicted symbol, # predictions, depth, probability, representation %s, is_neighbor\n",
-       			str_representations[representation]);
-    	}
+    MODEL_CURSOR *query = NULL;		// for looking things up in the model
+    IMAGE_CURSOR *image_query = NULL;	// or in the frozen model
+	int next_type_index = 0;				// position in a loctimestring (see get_char_type())
+	char line[ MAX_LINE ];					// a line for text_sink
+	char *end;
+	char *text;
 
     // initialize
+    memset( results, 0, sizeof( TEST_RESULTS));
+    results->test = test;
+    results->job_id = job_id;
+    results->max_order = max_order;
+    test_string = string16( MAX_STRING_LENGTH+1);
 
-    str_sub = string16(max_order);			// allocate memory for sub-string
-    length = strlen16( test_string);
+    if (image != NULL)
+    	image_query = image_cursor( image);
+    else
+    	query = model_cursor( model);
 
     // Go through test string, and try to predict every other symbol
-    // using the context of the preceding symbol.
-    // note that the loop starts with 1 because we are using char 0 for context only,
+    // using the context of the max_order symbols before it.
+    // note that the first max_order symbols are only used for context,
     // not prediction.
+    // Rather than looking each context up from the root, the cursor
+    // walks along the test string one symbol at a time (see advance_context()),
+    // so it always has the context of the symbols before test-symbol i,
+    // and carries on from one chunk to the next.
 // original:    for (i=1; i < length; i+= 2, num_tested++)	{
-    for (i=max_order; i < length; i+= 2, num_tested++)	{		// works for higher orders
-		// Copy the symbols preceding the test-symbol into str_sub.
-		if (i < max_order)
-			strncpy16( str_sub, test_string,0, i);	// create test string
-		else
-			strncpy16( str_sub, test_string, i-max_order, max_order);
-
-		//printf("predict_test: context_string is \"%s\", expected result is '0x%04x'\n",
-			//	format_string16(str_sub), get_symbol( test_string, i));
-		predicted_char = predict_next(str_sub, &pred);
-		//printf("%s!\n\n", predicted_char == get_symbol( test_string, i) ?  "RIGHT" : "WRONG");
-		// print
-		// "expected, predicted, # predictions, depth, probability, symbol type"
-		mapping = get_char_type( get_symbol( test_string, i), i);
-		if (mapping != LOC)
-			printf("Error: Expecting a LOC char and got something else! (0x%x)", get_symbol( test_string, i));		// It better be a LOC
-		num_locations++;		// should equal num_tested in this case.
-		if (pred.num_predictions > 1)
-			number_multiple_predictions++;
-		// Check each of the possible predictions
-		predicted_correctly = FALSE;		// Assume they are all wrong.
-		for (j=0; j < pred.num_predictions; j++)  {
-			if (verbose) {
-				if (get_symbol(test_string,i) == pred.sym[j].symbol)
-					is_neighbor = FALSE;
-				else 
-					is_neighbor = neighboring_ap( pred.sym[j].symbol, get_symbol(test_string,i));
-				printf("0x%04x, 0x%04x, %d, %d, %f, %s, %s\n",
-					get_symbol( test_string, i),	// expected symbol
-					pred.sym[j].symbol,				// predicted symbol
-					pred.num_predictions,
-					pred.depth,						// depth
-					(float) pred.sym[j].prob_numerator/pred.prob_denominator,
-					str_mappings[mapping],
-					(is_neighbor) ? "YES" : "NO");
-			}
-			// if one of these predictions is right, increment the counter
-			if (get_symbol( test_string,i) == pred.sym[j].symbol)	{
-				num_right++;
-				predicted_correctly = TRUE;		
-				// Count the number of times it fell back to level 0 and still 
-				// made a correct prediction.
-				if (pred.depth == 0)
-					number_fallbacks_to_zero_but_still_right++;
+    if (image_query != NULL)
+    	image_start_context( image_query);
+    else
+    	start_context( query);
+    while ((n = fread16_chunk( test_string, max_order, MAX_STRING_LENGTH, test_file)) > 0)	{
+    	length = strlen16( test_string);
+    	if (verbose)	{
+    		// Only the new symbols, so the headers add up to the file
+    		new_symbols = view16( test_string, length-n, n);
+    		sink_write( text_sink, "Testing on string ", 18);
+    		text = format_view16( &new_symbols);
+    		sink_write( text_sink, text, strlen( text));
+    		sink_write( text_sink, "\n", 1);
+//    		if (strlen( str_delimiters))
+//    			printf("ignoring characters in \"%s\"\n", str_delimiters);
+    		if (position == 0)	{
+    			end = format_text( line, "expected symbol, predicted symbol, # predictions, depth, probability, representation ");
+    			end = format_text( end, str_representations[representation]);
+    			end = format_text( end, ", is_neighbor\n");
+    			sink_write( text_sink, line, end - line);
+    			}
+    		}
+    	// The first length-n symbols were carried over from the last chunk
+    	for (i=length-n; i < length; i++, position++)	{
+    		if (position >= max_order && (position - max_order) % 2 == 0)	{	// works for higher orders
+				//printf("predict_test: expected result is '0x%04x'\n", get_symbol( test_string, i));
+				if (image_query != NULL)
+					predicted_char = image_predict_in_context(image_query, image_query->current_order, &pred);
+				else
+					predicted_char = predict_in_context(query, query->current_order, &pred);
+				//printf("%s!\n\n", predicted_char == get_symbol( test_string, i) ?  "RIGHT" : "WRONG");
+				score_prediction( results, &pred, get_symbol( test_string, i), position, representation, &next_type_index, verbose);
+    			}
+			if (image_query != NULL)
+				image_advance_context( image_query, get_symbol( test_string, i), max_order);
+			else
+				advance_context( query, get_symbol( test_string, i), max_order);
+    		}
+    	}
+
+	if (image_query != NULL)
+		delete_image_cursor( image_query);
+	else
+		delete_model_cursor( query);
+	delete_string16( test_string);
+	flush_sink( text_sink);		// before the results are printed
+	return;
+}	// end of predict_test
+
+/*******************************************
+ * predict_test_orders
+ *
+ * Do predict_test() and compute_logloss() for several orders at
+ * once, with one model trained at the highest of them.
+ *
+ * An order K model holds every lower order context, with the same
+ * counts that a model trained at that order would have, so each
+ * symbol of the test string takes just one trip down the tree.
+ * suffix_contexts() finds the longest context, and the table that
+ * order k would use is the one for its last k symbols.  (The one
+ * difference: when a table is rescaled, an order k model throws
+ * away the symbols whose counts drop to 0 from its order k tables,
+ * and a higher order model keeps them, because those tables have
+ * links.  So the results only match separate runs until a count
+ * reaches 255.)
+ *
+ * The test file is read a chunk at a time, like predict_test() does,
+ * with the last few symbols of each chunk carried over as context for
+ * the next, and the log-loss is averaged over the whole file.
+ * INPUTS:
+ *    model = model trained at order orders[ num_orders-1 ] or higher
+ *    num_orders, orders = the orders to test, lowest first
+ *    representation = type of input string (-input_type)
+ * 	  test_file = file to test (binary)
+ * OUTPUTS:
+ *    results[ k ] = the test results for orders[ k ], with the log-loss
+ *
+ * RETURNS: nothing
+ * *********************************************/
+void predict_test_orders( MODEL *model, int num_orders, int *orders, int representation,
+		FILE *test_file, TEST_RESULTS *results){
+	STRING16 * test_string;	// the chunk of the test file being tested
+	int i;			// index into test string
+	int k;			// index into orders[]
+	int n;			// number of new symbols in it
+	int length;		// string length
+	long position = 0;	// position of test_string[ i ] in the whole file
+	int highest;	// highest order being tested
+	int context_length;		// number of symbols before i used as context
+	int depth;		// order of the longest context found in the model
+	int order;		// order of the table used for orders[ k ]
+    STRUCT_PREDICTION pred;
+    STRING16_VIEW str_sub;	// context for each test symbol (a slice of test_string)
+    MODEL_CURSOR *query;	// for looking things up in the model
+	int next_type_index[ MAX_ORDERS ];	// position in a loctimestring, for each order
+	double summation[ MAX_ORDERS ];		// summation of the log-base-2(P()), for each order (as in logloss_sum())
+
+	highest = orders[ num_orders-1 ];
+	for (k=0; k < num_orders; k++)	{
+		memset( &results[ k ], 0, sizeof( TEST_RESULTS));
+		results[ k ].max_order = orders[ k ];
+		next_type_index[ k ] = 0;
+		summation[ k ] = 0.0;
+		}
+    query = model_cursor( model);
+    test_string = string16( MAX_STRING_LENGTH+1);
+
+    while ((n = fread16_chunk( test_string, highest, MAX_STRING_LENGTH, test_file)) > 0)	{
+    	length = strlen16( test_string);
+    	// The first length-n symbols were carried over from the last chunk
+    	for (i=length-n; i < length; i++, position++)	{
+			// One look up, with the longest context any of the orders use
+			context_length = (position < highest) ? position : highest;
+			str_sub = view16( test_string, i-context_length, context_length);
+			depth = suffix_contexts( query, &str_sub);
+
+			for (k=0; k < num_orders; k++)	{
+				// The context for orders[ k ] is its last (up to) orders[ k ] symbols
+				order = (orders[ k ] < context_length) ? orders[ k ] : context_length;
+				if (depth < order)
+					order = depth;
+				summation[ k ] += log2( symbol_probability( query, get_symbol( test_string, i), order));
+
+				// predict_test() tries every other symbol, starting at orders[ k ]
+				if (position >= orders[ k ] && (position - orders[ k ]) % 2 == 0)	{
+					predict_in_context( query, order, &pred);
+					score_prediction( &results[ k ], &pred, get_symbol( test_string, i), position, representation, &next_type_index[ k ], FALSE);
+					}
 				}
-			if (pred.depth == 0 && j == 0)	// count the number of level0 predictions, but
-											// only count it once for multiple predictions
-				total_fallbacks_to_zero++;
+    		}
+    	}
+
+	flush_sink( text_sink);
+	for (k=0; k < num_orders; k++)	{
+		results[ k ].logloss = average_logloss( summation[ k ], position, FALSE);
+		results[ k ].have_logloss = TRUE;
 		}
-		//If all the predictions are wrong, then check to see if one of the neighbors are right.
-		if (!predicted_correctly) {
-			for (j=0; j < pred.num_predictions; j++)  {
-				if (neighboring_ap(pred.sym[j].symbol, get_symbol( test_string, i)))
-					number_times_neighbors_are_correct++;
+	delete_string16( test_string);
+	delete_model_cursor( query);
+}
+
+/*******************************************
+ * stream_test
+ *
+ * Predict-then-learn on a stream of symbols (a file, a pipe or
+ * stdin), one symbol at a time as they arrive.  Each location symbol
+ * is predicted from the model's current context before it is seen,
+ * and then every symbol is added to the model, so it keeps learning.
+ * The model keeps its current context as it goes (see
+ * add_character_to_model()), so a prediction costs O(max_order)
+ * instead of a search from the root (see current_contexts()).
+ * With no -input_type, every symbol is predicted.
+ *
+ * The stream ends at EOF or a DONE symbol.  Other negative symbols
+ * are skipped, as they are in training.
+ *
+ * For each prediction, prints:
+ *    event #, expected symbol, predicted symbol, # predictions, depth,
+ *    probability, correct?, latency
+ * where the latency is the time in microseconds to predict the symbol
+ * and add it to the model.  A summary is printed at the end.
+ * INPUTS:
+ *    model = model to predict from and update
+ *    stream = where the symbols come from
+ *    representation = type of input string (-input_type)
+ * RETURNS: nothing
+ * *********************************************/
+void stream_test( MODEL *model, FILE *stream, int representation){
+	SYMBOL_TYPE symbol;
+	long num_events = 0;		// number of symbols read
+	long num_predictions = 0;	// number of symbols predicted
+	long num_right = 0;			// number of those that were right
+	int predicting;				// true if this symbol gets predicted
+	int predicted_correctly;
+	int next_type_index = 0;	// position in a loctimestring (see get_char_type())
+	int j;
+    STRUCT_PREDICTION pred;
+    MODEL_CURSOR *query;		// for looking things up in the model
+    struct timespec start, finish;
+    double latency;				// microseconds for this event
+    double total_latency = 0.0, max_latency = 0.0;
+
+    query = model_cursor( model);
+	while (fread( &symbol, sizeof( SYMBOL_TYPE), 1, stream) == 1 && symbol != DONE)	{
+		if (symbol < 0)
+			continue;
+		clock_gettime( CLOCK_MONOTONIC, &start);
+		predicting = (representation == NONE ||
+				get_char_type( representation, symbol, num_events, &next_type_index) == LOC);
+		if (predicting)
+			predict_in_context( query, current_contexts( query), &pred);
+		train_model( model, &symbol, 1);
+		clock_gettime( CLOCK_MONOTONIC, &finish);
+		latency = (finish.tv_sec - start.tv_sec) * 1e6 + (finish.tv_nsec - start.tv_nsec) / 1e3;
+
+		if (predicting)	{
+			predicted_correctly = FALSE;
+			for (j=0; j < pred.num_predictions; j++)
+				if (pred.sym[j].symbol == symbol)
+					predicted_correctly = TRUE;
+			num_predictions++;
+			if (predicted_correctly)
+				num_right++;
+			total_latency += latency;
+			if (latency > max_latency)
+				max_latency = latency;
+			printf("%ld, 0x%04x, 0x%04x, %d, %d, %f, %s, %.2f\n",
+				num_events,
+				symbol,							// expected symbol
+				pred.sym[0].symbol,				// (first) predicted symbol
+				pred.num_predictions,
+				pred.depth,
+				(float) pred.sym[0].prob_numerator/pred.prob_denominator,
+				(predicted_correctly) ? "YES" : "NO",
+				latency);
 			}
+		num_events++;
 		}
-    }
+	printf("%ld events, %ld predictions, %ld correct (%.1f%%), latency average %.2f us, maximum %.2f us\n",
+			num_events,
+			num_predictions,
+			num_right,
+			num_predictions ? 100.0 * num_right / num_predictions : 0.0,
+			num_predictions ? total_latency / num_predictions : 0.0,
+			max_latency);
+	delete_model_cursor( query);
+}
+
+/*******************************************
+ * score_prediction
+ *
+ * Score the predictions made for the symbol at the given position
+ * of the test, adding them into the test results.
+ * INPUTS:
+ *    pred = the predictions, from predict_next()
+ *    actual, position = the symbol that was predicted, and where it is in the test
+ *    representation = type of input string (-input_type)
+ *    next_type_index = position in a loctimestring (see get_char_type())
+ *    verbose = print a line for each prediction
+ * OUTPUTS:
+ *    results = updated with this test
+ * RETURNS: nothing
+ * *********************************************/
+void score_prediction( TEST_RESULTS *results, STRUCT_PREDICTION *pred, SYMBOL_TYPE actual, long position,
+		int representation, int *next_type_index, char verbose){
+	int j;			// counter into # predictions
+	int mapping;	// type of symbol (LOC, DUR, DELIM, etc)
+	unsigned char predicted_correctly;		// true if one of the predictions for a particular time are correct
+	unsigned char is_neighbor;				// true if two aps are neighbors
+	char line[ MAX_LINE ];					// a line for text_sink
+	char *end;								// (and where it ends)
+	RESULT_RECORD record;					// or a record for record_sink
+
+	results->num_tested++;
+	// print
+	// "expected, predicted, # predictions, depth, probability, symbol type"
+	mapping = get_char_type( representation, actual, position, next_type_index);
+	if (mapping != LOC)	{		// It better be a LOC
+		end = format_text( line, "Error: Expecting a LOC char and got something else! (0x");
+		end = format_hex( end, actual, 1);
+		*end++ = ')';
+		report_test_error( results, line, end);
+		}
+	results->num_locations++;		// should equal num_tested in this case.
+	if (pred->num_predictions > 1)
+		results->multiple_predictions++;
+	// Check each of the possible predictions
+	predicted_correctly = FALSE;		// Assume they are all wrong.
+	for (j=0; j < pred->num_predictions; j++)  {
+		if (verbose || record_sink != NULL) {
+			if (actual == pred->sym[j].symbol)
+				is_neighbor = FALSE;
+			else 
+				is_neighbor = check_neighbor( results, pred->sym[j].symbol, actual);
+		}
+		if (verbose) {
+			// "0x%04x, 0x%04x, %d, %d, %f, %s, %s\n", put together by hand
+			end = format_text( line, "0x");
+			end = format_hex( end, actual, 4);				// expected symbol
+			end = format_text( end, ", 0x");
+			end = format_hex( end, pred->sym[j].symbol, 4);	// predicted symbol
+			end = format_text( end, ", ");
+			end = format_int( end, pred->num_predictions);
+			end = format_text( end, ", ");
+			end = format_int( end, pred->depth);				// depth
+			end = format_text( end, ", ");
+			end = format_float( end, (float) pred->sym[j].prob_numerator/pred->prob_denominator);
+			end = format_text( end, ", ");
+			end = format_text( end, str_mappings[mapping]);
+			end = format_text( end, (is_neighbor) ? ", YES\n" : ", NO\n");
+			sink_write( text_sink, line, end - line);
+		}
+		if (record_sink != NULL) {
+			record.test = results->test;
+			record.position = position;
+			record.expected = actual;
+			record.predicted = pred->sym[j].symbol;
+			record.depth = pred->depth;
+			record.order = results->max_order;
+			record.rank = j;
+			record.is_neighbor = (is_neighbor) ? 1 : 0;
+			record.numerator = pred->sym[j].prob_numerator;
+			record.denominator = pred->prob_denominator;
+			sink_record( record_sink, &record);
+		}
+		// if one of these predictions is right, increment the counter
+		if (actual == pred->sym[j].symbol)	{
+			results->num_right++;
+			predicted_correctly = TRUE;		
+			// Count the number of times it fell back to level 0 and still 
+			// made a correct prediction.
+			if (pred->depth == 0)
+				results->fallbacks_to_zero_but_still_right++;
+			}
+		if (pred->depth == 0 && j == 0)	// count the number of level0 predictions, but
+										// only count it once for multiple predictions
+			results->total_fallbacks_to_zero++;
+	}
+	//If all the predictions are wrong, then check to see if one of the neighbors are right.
+	if (!predicted_correctly) {
+		for (j=0; j < pred->num_predictions; j++)  {
+			if (check_neighbor( results, pred->sym[j].symbol, actual))
+				results->neighbors_correct++;
+		}
+	}
+}
+
+/*******************************************
+ * check_neighbor
+ *
+ * neighboring_ap() for score_prediction(), which also reports an
+ * actual symbol that isn't an AP.
+ * RETURNS: true if predicted is a neighbor of actual
+ * *********************************************/
+unsigned char check_neighbor( TEST_RESULTS *results, SYMBOL_TYPE predicted, SYMBOL_TYPE actual){
+	char line[ MAX_LINE ];
+	char *end;
+
+	if (ap_number( actual) >= 0)
+		return( neighboring_ap( predicted, actual));
+	end = format_text( line, "Error: hit end of ap_map looking for 0x");
+	end = format_hex( end, actual, 1);
+	*end++ = '\n';
+	report_test_error( results, line, end);
+	return( FALSE );
+}
+
+/*******************************************
+ * report_test_error
+ *
+ * Report something wrong with a test symbol (the text from line up
+ * to end).  Outside of a batch it goes in with the rest of the
+ * output, where it always has.  A batch job says so on stderr, with
+ * its job id, so the lines of CSV on stdout stay the same however
+ * many threads there are.
+ * *********************************************/
+void report_test_error( TEST_RESULTS *results, char *line, char *end){
+	if (results->job_id == NULL) {
+		sink_write( text_sink, line, end - line);
+		return;
+	}
+	if (end > line && end[ -1 ] == '\n')
+		end--;
+	fprintf( stderr, "%s (manifest line %d): %.*s\n", results->job_id, results->test, (int) (end - line), line);
+}
+
+/*******************************************
+ * print_test_results
+ *
+ * Print the results of predict_test().  Normally this is one line
+ * of CSV:
+ *    order, # right, # tests, % right, # fallbacks to 0 still right,
+ *    # fallbacks to 0, # multiple predictions, # neighbors right
+ * INPUTS:
+ *    out = where to print them
+ *    results = results from predict_test()
+ *    verbose = print the longer, readable summary instead
+ * RETURNS: nothing
+ * *********************************************/
+void print_test_results( FILE *out, TEST_RESULTS *results, char verbose){
 	if (verbose)	{
-		printf("max_order=%d, number of tests=%d, number correct=%d, %% correct = %.1f, number neighbors=%d\n",
-				max_order,
-				num_tested,
-				num_right,
-				num_tested ? 100 * (float) num_right/(float)num_tested : 0.0,
-				number_times_neighbors_are_correct 	);
+		fprintf( out, "max_order=%d, number of tests=%d, number correct=%d, %% correct = %.1f, number neighbors=%d\n",
+				results->max_order,
+				results->num_tested,
+				results->num_right,
+				results->num_tested ? 100 * (float) results->num_right/(float)results->num_tested : 0.0,
+				results->neighbors_correct 	);
+		if (results->have_logloss)
+			fprintf( out, "average log-loss is %f\n", results->logloss);
 		}
 	else
 		/**** OLD WAY ****/
@@ -440,22 +1164,122 @@ void predict_test( STRING16 * test_string){
 			num_locations);
 			*****/
 		/* Print only the percentage of pairs correct & percentage when time is correct */
-		printf("%d, %d, %d, %.1f, %d, %d, %d, %d\n",
-			max_order,				// should be '1'
-			num_right,				// number of correct predictions
-			num_locations,			// number of tests
+		fprintf( out, "%d, %d, %d, %.1f, %d, %d, %d, %d",
+			results->max_order,				// should be '1'
+			results->num_right,				// number of correct predictions
+			results->num_locations,			// number of tests
 			// percentage of correct predictions
-			num_locations ? 100 * (float) num_right/(float) num_locations : 0.0,
-			number_fallbacks_to_zero_but_still_right,		// number of times it fell back to level 0
+			results->num_locations ? 100 * (float) results->num_right/(float) results->num_locations : 0.0,
+			results->fallbacks_to_zero_but_still_right,		// number of times it fell back to level 0
 									// but was still correct
-			total_fallbacks_to_zero,	// number of times it fell back to 0, wrong or right prediction
-			number_multiple_predictions,
-			number_times_neighbors_are_correct); //# times pred was wrong but a neighbor was right.
-	
-	return;
-}	// end of predict_test
+			results->total_fallbacks_to_zero,	// number of times it fell back to 0, wrong or right prediction
+			results->multiple_predictions,
+			results->neighbors_correct); //# times pred was wrong but a neighbor was right.
+	if (!verbose)
+		fprintf( out, results->have_logloss ? ", %f\n" : "\n", results->logloss);
+}
 
 
+/*******************************************
+ * close_results
+ *
+ * Flush and close the text and record sinks, and the -results file.
+ * RETURNS: 0, or -1 if the results couldn't all be written
+ * *********************************************/
+int close_results( void ){
+	int result = 0;
+
+	close_sink( text_sink);
+	text_sink = NULL;
+	if (record_sink != NULL)	{
+		if (close_sink( record_sink) != 0 || fclose( results_file) != 0)	{
+			printf( "Had trouble writing the results file (option -results)\n" );
+			result = -1;
+			}
+		record_sink = NULL;
+		}
+	return( result);
+}
+
+/********************************************************************
+ * parse_orders
+ *
+ * Read a list of orders like "1,3,5,7" (-orders) into orders[],
+ * sorted from lowest to highest.  Order 0 isn't allowed: the order 0
+ * table of a higher order model has an extra entry (for the link to
+ * the starting context) that an order 0 model doesn't have, so it
+ * doesn't give the same results.
+ * RETURNS: the number of orders, or -1 if the list isn't valid
+ ************************************************************************/
+int parse_orders( char *str_orders, int *orders)
+{
+	int n = 0;
+	int order;
+	int i;
+	char *end;
+
+	do {
+		order = (int) strtol( str_orders, &end, 10);
+		if (end == str_orders || order < 1 || order > MAX_DEPTH - 3 || n == MAX_ORDERS)
+			return -1;
+		// insert it in order
+		for (i = n; i > 0 && orders[ i-1 ] > order; i--)
+			orders[ i ] = orders[ i-1 ];
+		if (i > 0 && orders[ i-1 ] == order)
+			return -1;
+		orders[ i ] = order;
+		n++;
+		str_orders = end + 1;
+	} while (*end == ',');
+	return( *end == '\0' ? n : -1);
+}
+
+/********************************************************************
+ * parse_byte_count
+ *
+ * Read a number of bytes (-memory-limit), which can be followed by
+ * k, M or G for kilobytes, megabytes or gigabytes.
+ * RETURNS: the number of bytes, or -1 if it isn't valid
+ ************************************************************************/
+long parse_byte_count( char *str_bytes)
+{
+	long bytes;
+	char *end;
+
+	bytes = strtol( str_bytes, &end, 10);
+	if (end == str_bytes || bytes <= 0)
+		return -1;
+	switch (*end)	{
+		case 'k': case 'K':	bytes <<= 10; end++; break;
+		case 'm': case 'M':	bytes <<= 20; end++; break;
+		case 'g': case 'G':	bytes <<= 30; end++; break;
+		default: break;
+		}
+	return( *end == '\0' ? bytes : -1);
+}
+
+/********************************************************************
+ * get_representation
+ *
+ * Return the representation (string type) named by an -input_type
+ * argument, or NONE if it isn't one we know.
+ ************************************************************************/
+int get_representation( char *str_type)
+{
+	if (strcmp(str_type, "locstrings") == 0)
+		return( LOCSTRINGS);
+	else if (strcmp(str_type, "loctimestrings")== 0)
+		return( LOCTIMESTRINGS);
+	else if (strcmp(str_type, "boxstrings") == 0)
+		return( BOXSTRINGS);
+	else if (strcmp(str_type, "binboxstrings") == 0)
+		return( BINBOXSTRINGS);
+	else if (strcmp(str_type, "bindowts") == 0)
+		return( BINDOWTS);
+	else
+		return( NONE);
+}
+
 /********************************************************************
  * get_char_type
  *
@@ -463,13 +1287,14 @@ void predict_test( STRING16 * test_string){
  * INPUTS: representation
  * 			expected symbol
  * 			index into input string
+ * 			next_type_index (start it at 0 for each test string)
  * OUTPUTS: next_type_index is changed for loctimestrings
  * RETURNS: 0 = Location
  * 			1 = Starting Time
  * 			2 = Duration
  * 			3 = Delimiter
  ************************************************************************/
-int get_char_type( SYMBOL_TYPE symbol, int index_into_input_string)
+int get_char_type( int representation, SYMBOL_TYPE symbol, int index_into_input_string, int *next_type_index)
 {
 	switch (representation)	{
 	case LOCSTRINGS:
@@ -477,7 +1302,7 @@ int get_char_type( SYMBOL_TYPE symbol, int index_into_input_string)
 	case BOXSTRINGS:
 		return( get_boxstring_type( index_into_input_string));
 	case LOCTIMESTRINGS:
-		return( get_loctimestring_type( symbol));
+		return( get_loctimestring_type( symbol, next_type_index));
 	case BINBOXSTRINGS:
 		return( get_binboxstring_type( symbol));
 	case BINDOWTS:
@@ -536,15 +1361,15 @@ int get_boxstring_type( int index_into_input_string)
  *    L}tt:tt~dd:dd
  * where L is a location, tt:tt is the starting time and dd:dd is the duration.
  * INPUTS: 	symbol in input string
+ * 			next_type_index = position within the L}tt:tt~dd:dd group
  *
- * OUTPUTS: None
+ * OUTPUTS: next_type_index is moved on to the next non-delimiter
  * RETURNS: DELIM for a delimiter
  * 			LOC for a location char
  **************************************************************************/
-int get_loctimestring_type( SYMBOL_TYPE symbol)
+int get_loctimestring_type( SYMBOL_TYPE symbol, int *next_type_index)
 {
-	static int next_type_index = 0;
-	static int types[] = {LOC, STRT, STRT, STRT, STRT, DUR, DUR, DUR, DUR};
+	static const int types[] = {LOC, STRT, STRT, STRT, STRT, DUR, DUR, DUR, DUR};
 	int result;
 
 	if (symbol == (SYMBOL_TYPE) '}' || symbol == (SYMBOL_TYPE) ':' ||
@@ -552,8 +1377,8 @@ int get_loctimestring_type( SYMBOL_TYPE symbol)
 		return (DELIM);
 
 	else {
-		result = types[ next_type_index];
-		next_type_index = (next_type_index + 1) % 9;	// point to the next type
+		result = types[ *next_type_index];
+		*next_type_index = (*next_type_index + 1) % 9;	// point to the next type
 		return(result);
 	}
 }
@@ -652,42 +1477,3 @@ int main( int argc, char **argv )
 }
 #endif	// STRING16 Test Code
 
-/***********************************************************
- *	neighboring_ap
- * 
- * Given two symbols for locations (AP) return true if
- * the first one is a neighbor of the second.
- * 
- ***********************************************************/
-unsigned char neighboring_ap( SYMBOL_TYPE predicted_ap, SYMBOL_TYPE actual_ap)
-{
-	unsigned int i;
-	unsigned int actual_ap_number;
-	
-	// Translate from the ap symbol value to the actual ap number (1-524)
-	// mappings are in the ap_map[] in mapping.h
-	for (i=0;i < 525; i++)
-		if (ap_map[i] == actual_ap) {
-			actual_ap_number = i;
-			break;
-		}
-	if (i == 525)  {
-		printf("Error: hit end of ap_map looking for 0x%x\n", actual_ap);
-		return( FALSE );
-	}
-	
-	// Look in the ap_neighbors array to see if the predicted_ap is a 
-	// neighbor of the actual_ap.
-	i = 0;
-	while (ap_neighbors[ actual_ap_number][i] != 0) {
-		//printf("compare 0x%x to 0x%x - ", ap_neighbors[ actual_ap_number][i], predicted_ap);
-		if (ap_neighbors[ actual_ap_number][i] == predicted_ap) {
-			//printf("return TRUE\n");
-			return (TRUE);
-		}
-		//else printf("return FALSE\n");
-		i++;
-	}
-	return(FALSE);
-	
-}	// end of neighboring_ap
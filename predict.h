@@ -1,33 +1,76 @@
 #ifndef PREDICT_H_
 #define PREDICT_H_
 
+#include <stdio.h>		// for FILE
+#include "model.h"
+#include "image.h"
+#include "sink.h"		// for RESULT_SINK
+
 
 #define FALSE	0
 #define TRUE ~FALSE
+
+#define MAX_ORDERS		8		// most orders -orders can evaluate in one pass
+
+/*
+ * The results of predict_test() on one test string.
+ * print_test_results() prints them as a line of CSV.
+ * predict_test_orders() adds the log-loss to the end of the line.
+ */
+typedef struct {
+	int test;						// which test this is (for the -results records)
+	const char *job_id;				// the batch job it is for, or NULL
+	int max_order;
+	int num_tested;
+	int num_right;					// number of correct predictions
+	int num_locations;				// number of tests
+	int fallbacks_to_zero_but_still_right;	// fell back to level 0, but was still correct
+	int total_fallbacks_to_zero;	// fell back to level 0, wrong or right prediction
+	int multiple_predictions;		// number of times > 1 prediction was made
+	int neighbors_correct;			// number of times pred was wrong but a neighbor was right
+	int have_logloss;				// true if logloss was worked out too (-orders)
+	float logloss;					// average log-loss of the test string
+} TEST_RESULTS;
+
 /*
  * Declarations for local procedures.
  */
 int initialize_options( int argc, char **argv );
 int check_compression( void );
 //void print_compression( void );
-void predict_test( STRING16 * test_string);
+void predict_test( MODEL *model, MODEL_IMAGE *image, int max_order, int representation,
+		FILE *test_file, int test, const char *job_id, TEST_RESULTS *results);
+void score_prediction( TEST_RESULTS *results, STRUCT_PREDICTION *pred, SYMBOL_TYPE actual, long position,
+		int representation, int *next_type_index, char verbose);
+unsigned char check_neighbor( TEST_RESULTS *results, SYMBOL_TYPE predicted, SYMBOL_TYPE actual);
+void report_test_error( TEST_RESULTS *results, char *line, char *end);
+void predict_test_orders( MODEL *model, int num_orders, int *orders, int representation,
+		FILE *test_file, TEST_RESULTS *results);
+void print_test_results( FILE *out, TEST_RESULTS *results, char verbose);
+int close_results( void );
+void stream_test( MODEL *model, FILE *stream, int representation);
+int parse_orders( char *str_orders, int *orders);
+long parse_byte_count( char *str_bytes);
+int get_representation( char *str_type);
 #ifdef NOTUSEDIN16BITVERSION
 void remove_delimiters( char * str_input, char * str_purge);
 void strpurge( char * str_in, char ch_purge);
 #endif
-int get_char_type( SYMBOL_TYPE symbol, int index_into_input_string);
+int get_char_type( int representation, SYMBOL_TYPE symbol, int index_into_input_string, int *next_type_index);
 int get_locstring_type( SYMBOL_TYPE symbol);
 int get_boxstring_type( int index_into_input_string);
-int get_loctimestring_type( SYMBOL_TYPE symbol);
+int get_loctimestring_type( SYMBOL_TYPE symbol, int *next_type_index);
 int get_binboxstring_type( SYMBOL_TYPE symbol);
 int get_bindowts_type( SYMBOL_TYPE symbol);
-unsigned char neighboring_ap( SYMBOL_TYPE predicted_ap, SYMBOL_TYPE actual_ap);
 
 
 /* Function Types */
 #define NO_FUNCTION		0
 #define PREDICT_TEST	1
 #define LOGLOSS_EVAL	2
+#define BATCH_TEST		3
+#define ORDERS_TEST		4		// -p or -logloss with -orders
+#define STREAM_TEST		5
 
 /* String Types (types of input strings) */
 #define NONE			0
@@ -36,7 +79,7 @@ unsigned char neighboring_ap( SYMBOL_TYPE predicted_ap, SYMBOL_TYPE actual_ap);
 #define BOXSTRINGS		3
 #define BINBOXSTRINGS	4
 #define BINDOWTS		5
-char str_representations[][21]={"Unknown","Locstrings","Loctimestrings","Boxstrings","Binboxstrings", "BinDOWts"};
+extern char str_representations[][21];		// names of the string types, in predict.c
 
 
 /* Character (Symbol) Types */
@@ -44,6 +87,8 @@ char str_representations[][21]={"Unknown","Locstrings","Loctimestrings","Boxstri
 #define STRT		1		// starting time
 #define DUR			2		// duration
 #define DELIM		3		// delimiter
-char str_mappings[][6] = {"LOC", "STRT", "DUR", "DELIM"};
+extern char str_mappings[][6];			// names of the symbol types, in predict.c
+extern RESULT_SINK *text_sink;			// where the test results go (stdout), in predict.c
+extern RESULT_SINK *record_sink;		// and the -results records, NULL for none
 
 #endif /*PREDICT_H_*/
@@ -0,0 +1,188 @@
+/*******************************************************
+ * sink.c
+ *
+ * Buffered, thread safe writing of test results (see sink.h),
+ * and the formatting routines that build the lines for it.
+ *
+ * *****************************************************/
+#include <stdlib.h>			// for malloc(), free()
+#include <string.h>			// for memcpy(), memset()
+#include <stdio.h>
+#include <math.h>			// for rint()
+#include "sink.h"
+
+char hex_digits[] = "0123456789abcdef";
+
+void write_buffer( RESULT_SINK *sink );
+
+/* open_sink
+ * Start a sink writing to file, with a buffer of buffer_size bytes
+ * (SINK_BUFFER_SIZE, say), or none at all if it's 0.  A binary sink
+ * writes the RESULT_HEADER first.
+ * RETURNS: the sink, or NULL if there wasn't memory for it
+ */
+RESULT_SINK * open_sink( FILE *file, int binary, size_t buffer_size ){
+	RESULT_SINK *sink;
+	RESULT_HEADER header;
+
+	sink = (RESULT_SINK *) calloc( 1, sizeof( RESULT_SINK));
+	if (sink == NULL)
+		return NULL;
+	if (buffer_size > 0) {
+		sink->buffer = (char *) malloc( buffer_size);
+		if (sink->buffer == NULL) {
+			free( sink);
+			return NULL;
+		}
+	}
+	sink->size = buffer_size;
+	sink->file = file;
+	sink->binary = binary;
+	pthread_mutex_init( &sink->lock, NULL);
+	if (binary) {
+		memset( &header, 0, sizeof( header));
+		memcpy( header.magic, RESULT_MAGIC, sizeof( header.magic));
+		header.version = RESULT_VERSION;
+		header.byte_order = RESULT_BYTE_ORDER;
+		header.record_size = sizeof( RESULT_RECORD);
+		sink_write( sink, (char *) &header, sizeof( header));
+	}
+	return( sink);
+}
+
+/* close_sink
+ * Flush the sink and free it.  The file is left open.
+ * RETURNS: 0, or -1 if any of the writes failed
+ */
+int close_sink( RESULT_SINK *sink ){
+	int result;
+
+	if (sink == NULL)
+		return( 0);
+	result = flush_sink( sink);
+	pthread_mutex_destroy( &sink->lock);
+	free( sink->buffer);
+	free( sink);
+	return( result);
+}
+
+/* flush_sink
+ * Write out everything in the buffer (and flush the file, so it
+ * shows up in order with anything else written to it).
+ * RETURNS: 0, or -1 if any of the writes so far failed
+ */
+int flush_sink( RESULT_SINK *sink ){
+	int result;
+
+	pthread_mutex_lock( &sink->lock);
+	write_buffer( sink);
+	if (fflush( sink->file) != 0)
+		sink->error = 1;
+	result = sink->error ? -1 : 0;
+	pthread_mutex_unlock( &sink->lock);
+	return( result);
+}
+
+/* sink_write
+ * Add length bytes to the sink, in one piece.
+ */
+void sink_write( RESULT_SINK *sink, const char *text, size_t length ){
+	pthread_mutex_lock( &sink->lock);
+	if (sink->used + length > sink->size)
+		write_buffer( sink);
+	if (length > sink->size) {
+		if (fwrite( text, 1, length, sink->file) != length)
+			sink->error = 1;
+	}
+	else if (length > 0) {
+		memcpy( sink->buffer + sink->used, text, length);
+		sink->used += length;
+	}
+	pthread_mutex_unlock( &sink->lock);
+}
+
+void sink_record( RESULT_SINK *sink, RESULT_RECORD *record ){
+	sink_write( sink, (char *) record, sizeof( RESULT_RECORD));
+}
+
+/* write_buffer - write out the buffer (with the lock held) */
+void write_buffer( RESULT_SINK *sink ){
+	if (sink->used > 0 && fwrite( sink->buffer, 1, sink->used, sink->file) != sink->used)
+		sink->error = 1;
+	sink->used = 0;
+}
+
+/* The format_...() routines each put their value at dest, like the
+ * printf() format they stand in for, and return where the next thing
+ * goes.  Nothing is terminated: the caller knows how long the line is
+ * from the pointer it ends up with.
+ */
+
+/* the string, like %s */
+char * format_text( char *dest, const char *text ){
+	while (*text != '\0')
+		*dest++ = *text++;
+	return( dest);
+}
+
+/* like %d or %ld */
+char * format_int( char *dest, long value ){
+	char digits[ 24 ];
+	unsigned long magnitude = value;
+	int n = 0;
+
+	if (value < 0) {
+		*dest++ = '-';
+		magnitude = -magnitude;
+	}
+	do {
+		digits[ n++ ] = '0' + magnitude % 10;
+		magnitude /= 10;
+	} while (magnitude > 0);
+	while (n > 0)
+		*dest++ = digits[ --n ];
+	return( dest);
+}
+
+/* like %04x (with min_digits 4) */
+char * format_hex( char *dest, unsigned int value, int min_digits ){
+	int n = 1;
+	int i;
+
+	while (n < 8 && (value >> (4 * n)) != 0)
+		n++;
+	if (n < min_digits)
+		n = min_digits;
+	for (i = n - 1; i >= 0; i--)
+		*dest++ = hex_digits[ (value >> (4 * i)) & 0xf ];
+	return( dest);
+}
+
+/* format_float
+ * Like %f (6 decimal places) for a float.  A float times 1000000 is
+ * exact in a double, and rint() rounds it the way printf() does (to
+ * the nearest, with ties to even), so this comes out exactly the same.
+ * The odd values (NaN, infinity, and floats too big for a long) are
+ * left to sprintf().
+ */
+char * format_float( char *dest, float value ){
+	long scaled;
+	long fraction;
+	int i;
+
+	if (isnan( value) || isinf( value) || fabs( value) >= 1e12)
+		return( dest + sprintf( dest, "%f", value));
+	if (signbit( value)) {
+		*dest++ = '-';
+		value = -value;
+	}
+	scaled = (long) rint( (double) value * 1e6);
+	fraction = scaled % 1000000;
+	dest = format_int( dest, scaled / 1000000);
+	*dest++ = '.';
+	for (i = 5; i >= 0; i--) {
+		dest[ i ] = '0' + fraction % 10;
+		fraction /= 10;
+	}
+	return( dest + 6);
+}
@@ -0,0 +1,82 @@
+/**************************************************
+ * sink.h
+ *
+ * A results sink: somewhere to write the results of the prediction
+ * tests, a big buffer at a time.  A text sink takes lines that have
+ * already been put together with the format_...() routines below,
+ * which do by hand what printf() would do for them, and a binary
+ * sink takes a RESULT_RECORD for every prediction made (-results),
+ * for programs that analyze them later.  The binary form is:
+ *
+ *     RESULT_HEADER
+ *     RESULT_RECORD records[]		(to the end of the file)
+ *
+ * in the machine's own byte order.
+ *
+ * Each write goes into the buffer in one piece, under a lock, so
+ * threads (batch jobs) can share a sink without their lines or
+ * records getting mixed up.  Nothing reaches the file until the
+ * buffer fills up or flush_sink() is called.  A sink whose file
+ * has other things printed to it too (stdout) is opened with no
+ * buffer of its own, so everything stays in order; each line goes
+ * straight to the file in one fwrite(), and the file should have
+ * a big buffer instead.
+ *
+ * ************************************************/
+
+#ifndef SINK_H_
+#define SINK_H_
+
+#include <stdio.h>		// for FILE
+#include <pthread.h>
+#include "model.h"		// for SYMBOL_TYPE
+
+#define RESULT_MAGIC		"PMELTRES"
+#define RESULT_VERSION		1
+#define RESULT_BYTE_ORDER	0x01020304
+#define SINK_BUFFER_SIZE	( 256 * 1024 )
+#define MAX_LINE			256		// longest line the format_...() routines are used to build
+
+typedef struct {
+	char magic[ 8 ];
+	int version;
+	int byte_order;
+	int record_size;		// sizeof( RESULT_RECORD )
+} RESULT_HEADER;
+
+/* One prediction: a test symbol can get several (rank 0 is the likeliest) */
+typedef struct {
+	int test;				// which test (the manifest line of a batch job, 0 otherwise)
+	int position;			// position of the symbol in the test file
+	SYMBOL_TYPE expected;	// the symbol that was there
+	SYMBOL_TYPE predicted;
+	signed char depth;		// order of the context the prediction came from
+	unsigned char order;	// order of the model
+	unsigned char rank;		// which of the predictions for the symbol this is
+	unsigned char is_neighbor;	// true if predicted is a neighboring AP of expected
+	int numerator;			// probability of the prediction is numerator/denominator
+	int denominator;
+} RESULT_RECORD;
+
+typedef struct {
+	FILE *file;
+	char *buffer;			// NULL if the sink has no buffer of its own
+	size_t size;			// size of the buffer
+	size_t used;			// bytes in the buffer
+	int binary;				// true if this sink takes RESULT_RECORDs
+	int error;				// true if a write failed
+	pthread_mutex_t lock;
+} RESULT_SINK;
+
+/* Function Prototypes */
+RESULT_SINK * open_sink( FILE *file, int binary, size_t buffer_size );
+int close_sink( RESULT_SINK *sink );
+int flush_sink( RESULT_SINK *sink );
+void sink_write( RESULT_SINK *sink, const char *text, size_t length );
+void sink_record( RESULT_SINK *sink, RESULT_RECORD *record );
+char * format_text( char *dest, const char *text );
+char * format_int( char *dest, long value );
+char * format_hex( char *dest, unsigned int value, int min_digits );
+char * format_float( char *dest, float value );
+
+#endif /*SINK_H_*/
@@ -11,8 +11,10 @@
 #include <stdlib.h>			// for calloc(), free()
 #include <assert.h>			// for assert()
 #include <stdio.h>			// for sprintf()
+#include <string.h>			// for memmove()
 #include "model.h"			// for MAX_STRING_LENGTH definition
 #include "string16.h"
+#include "counters.h"			// for COUNT()
 
 char printable_string16[5 * MAX_STRING_LENGTH+1]; 
 
@@ -66,20 +68,35 @@ STRING16 * strncpy16( STRING16 *dest, STRING16 *src, int offset, int n)	{
  * memory to avoid memory leakage (if I allocated the string)
  */ 
 char * format_string16( STRING16 *s16)	{
+	STRING16_VIEW v;
+
+	v.s = s16->s;
+	v.length = s16->length;
+	return( format_view16( &v));
+}
+
+/* format a STRING16_VIEW the same way (into the same memory).
+ * Each symbol is 4 hex digits and a space, done by hand rather
+ * than with sprintf(), since verbose runs print a lot of these.
+ */
+char * format_view16( STRING16_VIEW *v)	{
+	static const char hex[] = "0123456789abcdef";
 	char * dest;
 	SYMBOL_TYPE * src;
-	int i, j;
+	unsigned short symbol;
+	int i;
 	
 	dest = printable_string16;
-	src = s16->s;
-
-	for (i = 0; i < s16->length && i < 5 * MAX_STRING_LENGTH; ) {
-		for (j=0; j < 8 && (s16->length-i > 0); j++, i++)	{
-			sprintf( dest, "%04x ",  *src);
-			dest += 5;
-			src++;
-			}
-		//*dest++ = '\n';
+	src = v->s;
+
+	for (i = 0; i < v->length && i < MAX_STRING_LENGTH; i++) {
+		symbol = (unsigned short) *src++;
+		dest[0] = hex[ symbol >> 12 ];
+		dest[1] = hex[ (symbol >> 8) & 0xf ];
+		dest[2] = hex[ (symbol >> 4) & 0xf ];
+		dest[3] = hex[ symbol & 0xf ];
+		dest[4] = ' ';
+		dest += 5;
 	}
 	*dest = '\0';		// terminate string
 	return (printable_string16);
@@ -89,10 +106,44 @@ char * format_string16( STRING16 *s16)	{
 void shorten_string16( STRING16 *s16){
 	int i;
 	
-	// (Use length+1 to copy the terminating null char)
-	for (i=0; i < s16->length+1; i++)
+	COUNT( shorten_string16_calls);
+	if (s16->length <= 0)
+		return;
+	// (Don't read past the end of a full string; terminate it here instead)
+	for (i=0; i < s16->length-1; i++)
 		s16->s[i] = s16->s[i+1];
 	s16->length--;
+	s16->s[ s16->length ] = 0x00;
+}
+
+/* view16 - Make a view of n elements of src, starting at offset.
+ * Nothing is copied: the view points into src.
+ */
+STRING16_VIEW view16( STRING16 *src, int offset, int n)	{
+	STRING16_VIEW v;
+
+	assert(offset >= 0 && offset+n <= src->max_length);
+	v.s = src->s + offset;
+	v.length = n;
+	return( v);
+}
+
+/* Drop the first symbol from the view, shortening it by one symbol */
+void shorten_view16( STRING16_VIEW *v){
+	if (v->length <= 0)
+		return;
+	v->s++;
+	v->length--;
+}
+
+/* Drop symbols from the front of the view, keeping only its last n */
+void tail_view16( STRING16_VIEW *v, int n){
+	if (n >= v->length)
+		return;
+	if (n < 0)
+		n = 0;
+	v->s += v->length - n;
+	v->length = n;
 }
 
 /* Return the symbol at the given offset of the given string. */
@@ -115,3 +166,24 @@ int fread16( STRING16 *dest, int max_length, FILE *src_file){
 	return(i);
 }
 
+/* fread16_chunk - read the next chunk of a file that may be too long
+ * to read into one STRING16.  The last carry symbols already in dest
+ * (or all of them, if there are fewer) are moved to the front, to
+ * give the first new symbols their context, and as many new symbols
+ * are read after them as fit in max_length.  dest has to have room
+ * for max_length+1 symbols, and carry has to be less than max_length.
+ * RETURNS: the number of new symbols (0 at the end of the file), which
+ * are the last ones in dest.
+ */
+int fread16_chunk( STRING16 *dest, int carry, int max_length, FILE *src_file){
+	int i;
+
+	if (carry > dest->length)
+		carry = dest->length;
+	memmove( dest->s, dest->s + dest->length - carry, carry * sizeof( SYMBOL_TYPE));
+	i = fread( dest->s + carry, sizeof( SYMBOL_TYPE), max_length - carry, src_file);
+	dest->length = carry + i;
+	dest->s[ dest->length ] = 0x00;
+	return(i);
+}
+
@@ -19,6 +19,18 @@ typedef struct {
 	int length;		// length of string
 } STRING16;
 
+/*
+ * A view of part of a STRING16 (or of any array of symbols).  It
+ * doesn't own the symbols, it just points at the first one, so
+ * taking a slice of a string doesn't copy anything, and dropping
+ * the first symbol just moves the pointer.  The view is only good
+ * as long as the string it points into.
+ */
+typedef struct {
+	SYMBOL_TYPE *s;		// first symbol in the view
+	int length;		// number of symbols in the view
+} STRING16_VIEW;
+
 /* Function Prototypes */
 STRING16 * string16(int length);
 void delete_string16( STRING16 * str16_to_delete);
@@ -26,8 +38,13 @@ int strlen16( STRING16 * s);
 STRING16 * strncpy16( STRING16 *dest, STRING16 *src, int offset, int n);
 char * format_string16( STRING16 *s16);
 void shorten_string16( STRING16 *s16);
+STRING16_VIEW view16( STRING16 *src, int offset, int n);
+void shorten_view16( STRING16_VIEW *v);
+void tail_view16( STRING16_VIEW *v, int n);
+char * format_view16( STRING16_VIEW *v);
 SYMBOL_TYPE get_symbol( STRING16 *s16, int offset);
 int fread16( STRING16 *dest, int max_length, FILE *src_file);
+int fread16_chunk( STRING16 *dest, int carry, int max_length, FILE *src_file);
 
 
 #endif /*STRING16_H_*/